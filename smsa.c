@@ -11,11 +11,17 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <libgen.h>
 #include <assert.h>
 
 // Project Include files
@@ -27,25 +33,95 @@
 //
 // Defines
 //#define SMSA_BLOCK_ADDRESS(drum,blk) ((smsa_disk_array[drum])+(blk*SMSA_BLOCK_SIZE))
-#define SMSA_BLOCK_ADDRESS(drum,blk) &smsa_disk_array[drum][blk*SMSA_BLOCK_SIZE]
-// #define SMSA_STORAGE_ENABLED
+#define SMSA_EXTENT_SHIFT 16	// An extent is 64 KiB (or the whole drum if smaller)
+#define SMSA_EXTENT_BYTES (1<<SMSA_EXTENT_SHIFT)
+#define SMSA_EXTENT(drum,blk) smsa_disk_array[drum][(blk)>>smsa_extent_shift]
+#define SMSA_EXTENT_BLOCKS ((uint32_t)1<<smsa_extent_shift)
+#define SMSA_EXTENT_SIZE ((size_t)1<<(smsa_extent_shift+smsa_geometry.block_shift))
+#define SMSA_DRUM_EXTENTS (smsa_geometry.blocks>>smsa_extent_shift)
+#define SMSA_SIGNATURES(drum,blk) smsa_signatures[drum][(blk)>>smsa_extent_shift]
+#define SMSA_SIGNATURE_TAG(gen) ((((uint64_t)(gen))<<1)|1)	// A cached signature good for a generation
+#define SMSA_DRUM_BYTES ((size_t)1<<smsa_geometry.drum_shift)
+#define SMSA_DIRTY_WORDS ((smsa_geometry.blocks+63)/64)
+#define SMSA_BLOCK_DIRTY(map,n,per) (map[(n)/(per)][(n)%(per)/64] & (1ULL << ((n)%(per)%64)))
+// #define SMSA_STORAGE_ENABLED	// Store the array between mounts without being asked (-f)
+#ifdef SMSA_STORAGE_ENABLED
+#define SMSA_STORAGE_DEFAULT 1
+#else
+#define SMSA_STORAGE_DEFAULT 0
+#endif
 #define SMSA_ROW(x) ((int)x/4)
 #define SMSA_COL(x) (x%4)
 #define SMSA_DIFF(x,y) ((x>y) ? (x-y) : (y-x))
+#define SMSA_STORE_GAP_BLOCKS 4	// Clean blocks a store writes over to join two dirty extents
+#define SMSA_STORE_IOVECS 64	// Pieces a store writes at once
+#define SMSA_JOURNAL_MAGIC 0x534d4a52	// Where a journal record starts ("SMJR")
+#define SMSA_JOURNAL_SEED 2166136261U	// The checksum of nothing
+#define SMSA_JOURNAL_BUFFER 65536	// The least a journal buffer grows by
+#define SMSA_JOURNAL_OLD ".old"		// The journal a checkpoint is retiring
 
 //
 // Library global data
 
-static uint8_t				smsa_library_initialized = 0;	// Flag indicating the library init occurred
+static pthread_once_t			smsa_library_initialized = PTHREAD_ONCE_INIT; // The library init occurs once
 static uint32_t				smsa_mount_state = 0;  			// Mount state (0=not mounted, 1=mounted)
-SMSA_ERROR_LEVEL			smsa_error_number = 0;			// This is the current error number
-
-// This is the disk array itself
-static uint8_t				smsa_drum_head; // The current drum under eval
-static uint32_t				smsa_read_head; // The current read position on the drum
-static unsigned char		       *smsa_disk_array[SMSA_DISK_ARRAY_SIZE]; // The disk memory
+__thread SMSA_ERROR_LEVEL		smsa_error_number = 0;			// This is the current error number
+char					*smsa_disk_file = SMSA_DISK_FILE;	// Where the array is kept between mounts
+int					smsa_disk_store = SMSA_STORAGE_DEFAULT;	// Load the array at mount and store it at unmount
+int					smsa_disk_mmap = 0;			// Map the file as the array (stored as it changes)
+int					smsa_checkpoint_interval = 0;		// Seconds between checkpoints of a stored array (0=none)
+char					*smsa_journal_file = NULL;		// Where changes are journaled until checkpointed (NULL=none)
+SMSA_GEOMETRY				smsa_geometry = {			// The geometry of the array (the defaults)
+		SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE, 8, 16, SMSA_MAX_RANGE_BLOCKS };
+
+// This is the disk array itself, each session moves its own heads over it
+static SMSA_SESSION			smsa_default_session = { 0, 0 }; // The heads smsa_operation moves
+static unsigned char		      **smsa_disk_array[SMSA_DISK_ARRAY_SIZE]; // The disk memory (extents, NULL until written)
+static unsigned char		       *smsa_disk_map = NULL; // The mapped file (when mapped)
+static uint32_t				smsa_extent_shift; // The blocks in an extent (log 2)
+static uint32_t				smsa_extent_count = 0; // The extents allocated since mounting
+static const unsigned char		smsa_zero_extent[SMSA_EXTENT_BYTES]; // What never written blocks read as
 static unsigned long                    smsa_cycle_count = 0; // This is the clock count for the SMSA
 
+// These are the physical heads the cycle costs follow, an arm over one drum
+// at a time and the read head of each drum, whatever session moved them last
+static uint32_t				smsa_arm_drum = 0; // The drum under the arm
+static uint32_t				smsa_arm_blocks[SMSA_DISK_ARRAY_SIZE]; // The read head of each drum
+
+// These are the drum locks, readers of a drum share its lock and writers hold
+// it alone (mounting and unmounting hold all of them)
+static pthread_rwlock_t			smsa_drum_locks[SMSA_DISK_ARRAY_SIZE];
+static uint64_t			       *smsa_dirty_blocks[SMSA_DISK_ARRAY_SIZE]; // Blocks changed since stored
+static int				smsa_drum_formatted[SMSA_DISK_ARRAY_SIZE]; // Formatted since stored (all dirty)
+static uint32_t				smsa_drum_generation[SMSA_DISK_ARRAY_SIZE]; // Each format starts a new one
+static uint32_t			       *smsa_block_stamps[SMSA_DISK_ARRAY_SIZE]; // The generation each block was written in
+
+// These are the signatures of the blocks signed since last written, kept
+// for each extent signed in (blocks reading as zeros all share one)
+static SMSA_SIGNATURE_CACHE		      **smsa_signatures[SMSA_DISK_ARRAY_SIZE];
+static uint32_t				smsa_zero_signature[SMSA_SIGNATURE_WORDS];
+static uint32_t				smsa_signature_length = 0; // The bytes of a signature (0=too long to cache)
+
+// This is the checkpoint thread, storing the changed blocks now and then
+static pthread_t			smsa_checkpoint_thread;
+static pthread_mutex_t			smsa_checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			smsa_checkpoint_wakeup = PTHREAD_COND_INITIALIZER;
+static int				smsa_checkpoint_running = 0; // Cleared to stop the thread
+
+// This is the journal, changes are appended to a buffer before they are made
+// and the buffer made durable a batch at a time (by whoever commits first)
+static int				smsa_journal_fd = -1; // The journal being appended to (-1=none)
+static char				smsa_journal_old[PATH_MAX]; // The name of the journal being retired
+static pthread_mutex_t			smsa_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			smsa_journal_synced = PTHREAD_COND_INITIALIZER;
+static unsigned char		       *smsa_journal_buf = NULL; // The records not written yet
+static size_t				smsa_journal_used = 0, smsa_journal_size = 0;
+static unsigned char		       *smsa_journal_spare = NULL; // The other buffer (while not being written)
+static size_t				smsa_journal_spare_size = 0;
+static uint64_t				smsa_journal_appended = 0; // The bytes appended
+static uint64_t				smsa_journal_durable = 0; // The bytes synced
+static int				smsa_journal_syncing = 0; // Set while one commits for the rest
+
 // This is the text associated with the SMSA operation (commands)
 static const char *smsa_op_text[] = {
 		"SMSA_MOUNT",  		// Mount the disk array
@@ -57,6 +133,10 @@ static const char *smsa_op_text[] = {
 		"SMSA_GET_STATE",	// Get the current disk state (unimplemented)
 		"SMSA_BLOCK_SIGN",  // Generate a signature for a block (and output to log)
 		"SMSA_FORMAT_DRUM",	// Format the current drum (zeros)
+		"SMSA_READ_RANGE",	// Read consecutive blocks starting at drum/block
+		"SMSA_WRITE_RANGE",	// Write consecutive blocks starting at drum/block
+		"SMSA_WRITE_AT",	// Write bytes within the block at drum/block
+		"SMSA_SIGN_RANGE",	// Sign consecutive blocks starting at drum/block
 };
 
 // This is the text associated with the SMSA disk error
@@ -88,56 +168,103 @@ static const char *smsa_error_text[] = {
 
 int smsa_operation( uint32_t op, unsigned char *block ) {
 
+	// No command without an argument needs one
+	return( smsa_session_operation(&smsa_default_session, op, 0, block) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_operation_ex
+// Description  : This is the external interface to the disk array for
+//                commands that carry an argument.  The range commands take
+//                the number of blocks to move, and their block buffer holds
+//                that many blocks back to back.  A partial write takes the
+//                number of bytes, its buffer holds their offset in the block
+//                (SMSA_WRITE_AT_HEADER bytes) and then just those bytes.
+//                A range signature takes the number of blocks to sign, and
+//                its buffer gets their signatures (SMSA_SIGNATURE_SIZE bytes
+//                each) back to back.
+//
+// Inputs       : op - the operation encoded structure
+//              : arg - the command argument (block count for ranges and
+//                      signatures, byte count for partial writes)
+//              : block - the block(s) of data to operate on
+// Outputs      : 0 if successful test, -1 if failure
+
+int smsa_operation_ex( uint32_t op, uint16_t arg, unsigned char *block ) {
+
+	// These callers share one set of heads
+	return( smsa_session_operation(&smsa_default_session, op, arg, block) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_session_operation
+// Description  : This is the interface to the disk array for callers that
+//                keep heads for each of their clients.  The operation moves
+//                the heads of the session only, and holds the lock of the
+//                drum it works on, so sessions can be served from any number
+//                of threads.
+//
+// Inputs       : sess - the session (its heads)
+//              : op - the operation encoded structure
+//              : arg - the command argument (as smsa_operation_ex)
+//              : block - the block(s) of data to operate on
+// Outputs      : 0 if successful test, -1 if failure
+
+int smsa_session_operation( SMSA_SESSION *sess, uint32_t op, uint16_t arg, unsigned char *block ) {
+
 	// Local variables
-	int retcode = 0;
+	int retcode = 0, lock;
 	SMSA_OPERATION dop;
 
 	// Decode the command and log it if verbose
 	if ( decode_SMSA_operation(&dop, op, block) ) {
 		logMessage( LOG_ERROR_LEVEL, "Unable to decode SMSA operation [%lu]", op );
 	}
+	if ( (dop.cmd == SMSA_READ_RANGE) || (dop.cmd == SMSA_WRITE_RANGE) ) {
+		dop.len = (uint32_t)arg << smsa_geometry.block_shift;
+	} else if ( dop.cmd == SMSA_WRITE_AT ) {
+		dop.len = SMSA_WRITE_AT_HEADER + arg;
+	} else if ( dop.cmd == SMSA_SIGN_RANGE ) {
+		dop.len = arg * SMSA_SIGNATURE_SIZE;
+	}
 	logMessage( LOG_INFO_LEVEL, "SMSA Array received operation [%s/did=%d,blk=%d]",
 			smsa_op_text[dop.cmd], dop.did, dop.bid );
 
 
 	// Check to see if this is the first time we have called the library
-	if ( smsa_library_initialized == 0 ) {
-
-		// Setup the virtual hardware initial state
-		smsa_mount_state  = 0;
-		smsa_error_number = SMSA_NO_ERROR;
-		memset( smsa_disk_array, 0x0, sizeof(smsa_disk_array) );
-		smsa_library_initialized = 1;
-	}
+	pthread_once( &smsa_library_initialized, smsa_library_init );
 
-	// Count the cycles the operation will take
-	smsa_cycle_count += operation_cycle_cost( dop.cmd, dop.did, dop.bid );
+	// Hold the drum, then count the cycles the operation will take
+	lock = operation_drum_lock( sess, dop.cmd, dop.did );
+	__sync_fetch_and_add( &smsa_cycle_count, operation_cycle_cost(sess, dop.cmd, dop.did, dop.bid, arg) );
 
 	// Perform the disk operation
 	switch (dop.cmd) {
 
 		case SMSA_MOUNT: // Mount the disk array
-			retcode = SMSAMountArray();
+			retcode = SMSAMountArray( sess );
 			break;
 
 		case SMSA_UNMOUNT: // Unmount the disk array
-			retcode = SMSAUnmountArray();
+			retcode = SMSAUnmountArray( sess );
 			break;
 
 		case SMSA_SEEK_DRUM: // See to a new drum
-			retcode = SMSASeekDrum( dop.did );
+			retcode = SMSASeekDrum( sess, dop.did );
 			break;
 
 		case SMSA_SEEK_BLOCK: // Seek to a disk address in the current drum
-			retcode = SMSASeekBlock( dop.bid );
+			retcode = SMSASeekBlock( sess, dop.bid );
 			break;
 
 		case SMSA_DISK_READ: // Read from the disk
-			retcode = SMSAReadBlock( block );
+			retcode = SMSAReadBlock( sess, block );
 			break;
 
 		case SMSA_DISK_WRITE: // Write to the disk
-			retcode = SMSAWriteBlock( block );
+			retcode = SMSAWriteBlock( sess, block );
 			break;
 
 		case SMSA_GET_STATE: // Get the current disk state (unimplemented)
@@ -146,19 +273,36 @@ int smsa_operation( uint32_t op, unsigned char *block ) {
 			break;
 
 		case SMSA_FORMAT_DRUM: // Format the current drum (zeros)
-			retcode = SMSAFormatDrum();
+			retcode = SMSAFormatDrum( sess );
 			break;
 
 		case SMSA_BLOCK_SIGN: // Generate a signature for a block (and output to log)
 			retcode = SMSABlockSign( dop.did, dop.bid );
 			break;
 
+		case SMSA_READ_RANGE: // Read consecutive blocks starting at drum/block
+			retcode = SMSAReadBlocks( sess, dop.did, dop.bid, arg, block );
+			break;
+
+		case SMSA_WRITE_RANGE: // Write consecutive blocks starting at drum/block
+			retcode = SMSAWriteBlocks( sess, dop.did, dop.bid, arg, block );
+			break;
+
+		case SMSA_WRITE_AT: // Write bytes within the block at drum/block
+			retcode = SMSAWriteAt( sess, dop.did, dop.bid, SMSA_WRITE_AT_OFFSET(block), arg, &block[SMSA_WRITE_AT_HEADER] );
+			break;
+
+		case SMSA_SIGN_RANGE: // Sign consecutive blocks starting at drum/block
+			retcode = SMSASignBlocks( dop.did, dop.bid, arg, block );
+			break;
+
 		default: logMessage( LOG_ERROR_LEVEL, "OP Illegal disk command [%u]", dop.cmd );
 			retcode = -1;
 			break;
 	}
 
-	// Return successfully
+	// Let the drum go and return
+	operation_drum_unlock( lock );
 	return( retcode );
 }
 
@@ -182,43 +326,78 @@ const char * smsa_error_string( int eno ) {
 	return( smsa_error_text[eno] );
 }
 
-////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : SMSABlockSign
-// Description  : Write a block to the current read head positions
+// Description  : Generate the signature of a block (and output to log)
 //
 // Inputs       : drum - the drum to sign the block from
 //                block - the block to generate the signature for
 // Outputs      : 0 if successful test, -1 if failure
 
 int SMSABlockSign( SMSA_DRUM_ID drum, SMSA_BLOCK_ID block ) {
+	return( SMSASignBlocks(drum, block, 1, NULL) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSASignBlocks
+// Description  : Generate the signatures of consecutive blocks (and output
+//                each to log), the heads do not move
+//
+// Inputs       : did - the drum to sign the blocks from
+//                bid - the first block to sign
+//                count - the number of blocks to sign
+//                sigs - where to put the signatures (count*SMSA_SIGNATURE_SIZE
+//                       bytes), NULL if only logged
+// Outputs      : 0 if successful test, -1 if failure
+
+int SMSASignBlocks( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *sigs ) {
 
 	// Local variables
 	unsigned char sig[CMPSC311_HASH_LENGTH], sigstr[CMPSC311_HASH_LENGTH*4];
-	uint32_t slen = CMPSC311_HASH_LENGTH*4;
+	uint32_t slen;
+	int i;
+
+	// Check to see if the disk array has been mounted (it has no drums if not)
+	if ( ! smsa_mount_state ) {
+		logMessage( LOG_ERROR_LEVEL, "Trying to sign on unmounted array." );
+		smsa_error_number = SMSA_UNMOUNTED_DISK;
+		return( -1 );
+	}
 
-	// Check for sane signature address
-	if ( drum >= SMSA_DISK_ARRAY_SIZE ) {
-		logMessage( LOG_ERROR_LEVEL, "Illegal signature drum [%u/%u]",	smsa_drum_head, smsa_read_head );
+	// Check for sane signature addresses, the range may not run off the drum
+	// (or its signatures past one range operation's worth)
+	if ( did >= smsa_geometry.drums ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal signature drum [%u/%u]", did, bid );
 		smsa_error_number =	SMSA_BAD_DRUM_ID;
 		return( -1 );
 	}
-	if ( block >= SMSA_DISK_SIZE ) {
-		logMessage( LOG_ERROR_LEVEL, "Illegal signature block [%u/%u]",	smsa_drum_head, smsa_read_head );
+	if ( (count == 0) || (count > SMSA_MAX_SIGN_BLOCKS) || (bid+count > smsa_geometry.blocks) ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal signature blocks [%u/%u+%u]", did, bid, count );
 		smsa_error_number =	SMSA_BAD_BLOCK_ID;
 		return( -1 );
 	}
 
-	// Now do the signature and check the result
-	if ( generate_md5_signature( block_address(drum,block), SMSA_BLOCK_SIZE, sig, &slen) ) {
-		logMessage( LOG_ERROR_LEVEL, "Signature failed (%d/%d]", drum, block );
-		smsa_error_number =	SMSA_SIG_FAIL;
-		return( -1 );
-	}
+	// Now do each signature (unless it is known) and check the result
+	for ( i=0; i<count; i++ ) {
+		slen = CMPSC311_HASH_LENGTH*4;
+		if ( block_signature(did, bid+i, sig, &slen) ) {
+			logMessage( LOG_ERROR_LEVEL, "Signature failed (%d/%d]", did, bid+i );
+			smsa_error_number =	SMSA_SIG_FAIL;
+			return( -1 );
+		}
 
-	// Log the string byte for the message
-	bufToString( sig, slen, sigstr, CMPSC311_HASH_LENGTH*4 );
-	logMessage( LOG_OUTPUT_LEVEL, "SIG(drum,block) %2d %3d : %s", drum, block, sigstr );
+		// Pass it back if wanted (first, the string can run over into sig),
+		// then log the string byte for the message (if anyone is listening)
+		if ( sigs != NULL ) {
+			memcpy( &sigs[i*SMSA_SIGNATURE_SIZE], sig, SMSA_SIGNATURE_SIZE );
+		}
+		if ( levelEnabled(LOG_OUTPUT_LEVEL) ) {
+			bufToString( sig, slen, sigstr, CMPSC311_HASH_LENGTH*4 );
+			logMessage( LOG_OUTPUT_LEVEL, "SIG(drum,block) %2d %3d : %s", did, bid+i, sigstr );
+		}
+	}
 
 	// Return successfully
 	return( 0 );
@@ -238,6 +417,52 @@ unsigned long smsa_get_cycle_count( void ) {
 	return( smsa_cycle_count );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_set_geometry
+// Description  : Change the geometry of the array, only while it is not
+//                mounted.  The block ids of a drum have to fit the op word
+//                and a block a range operation, both are powers of 2 so
+//                virtual addresses split with shifts.
+//
+// Inputs       : drums - the number of drums
+//                blocks - the blocks in a drum
+//                block_size - the bytes in a block
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_set_geometry( uint32_t drums, uint32_t blocks, uint32_t block_size ) {
+
+	// Local variables
+	uint32_t shift;
+
+	// Check for a sane geometry
+	if ( smsa_mount_state ) {
+		logMessage( LOG_ERROR_LEVEL, "Unable to change the geometry of a mounted array" );
+		return( -1 );
+	}
+	if ( (drums < 1) || (drums > SMSA_DISK_ARRAY_SIZE) ||
+			(blocks < 1) || (blocks > SMSA_MAX_DRUM_BLOCKS) || (blocks & (blocks-1)) ||
+			(block_size < SMSA_BLOCK_SIZE) || (block_size > SMSA_MAX_BLOCK_SIZE) || (block_size & (block_size-1)) ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal array geometry [%u drums, %u blocks of %u bytes]",
+				drums, blocks, block_size );
+		return( -1 );
+	}
+
+	// Set it, working out the shifts
+	smsa_geometry.drums = drums;
+	smsa_geometry.blocks = blocks;
+	smsa_geometry.block_size = block_size;
+	for ( shift=0; (1U << shift) < block_size; shift++ );
+	smsa_geometry.block_shift = shift;
+	for ( shift=0; (1U << shift) < blocks; shift++ );
+	smsa_geometry.drum_shift = smsa_geometry.block_shift + shift;
+	smsa_geometry.range_blocks = SMSA_MAX_RANGE_BYTES / block_size;
+	logMessage( LOG_INFO_LEVEL, "Array geometry is %u drums, %u blocks of %u bytes", drums, blocks, block_size );
+
+	// Return successfully
+	return( 0 );
+}
+
 //
 // Internal Disk Interfaces
 
@@ -249,10 +474,11 @@ unsigned long smsa_get_cycle_count( void ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSAMountArray( void ) {
+int SMSAMountArray( SMSA_SESSION *sess ) {
 
 	// Local variables
-	int i;
+	uint32_t slen;
+	int i, stored;
 
 	// See if already mounted
 	if ( smsa_mount_state ) {
@@ -260,33 +486,89 @@ int SMSAMountArray( void ) {
 		return( 0 );
 	}
 
-	// Mounting operation begin
+	// Mounting operation begin, nothing has changed yet
 	logMessage( LOG_INFO_LEVEL, "Mounting the disk array ..." );
 
-	// Allocate the data for the array, set pointer to the beginning of the array
-	for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-		smsa_disk_array[i] = malloc( SMSA_DISK_SIZE );
-		memset( smsa_disk_array[i], 0x0, SMSA_DISK_SIZE );
+	// Allocate the extent tables of the drums, the extents themselves only
+	// come when first written (or all at once from the mapped file)
+	smsa_extent_shift = ((smsa_geometry.drum_shift < SMSA_EXTENT_SHIFT) ? smsa_geometry.drum_shift :
+			SMSA_EXTENT_SHIFT) - smsa_geometry.block_shift;
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		if ( (smsa_disk_array[i] = calloc(SMSA_DRUM_EXTENTS, sizeof(unsigned char *))) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Unable to allocate drum [%d] (%u extents)", i, SMSA_DRUM_EXTENTS );
+			while ( i-- > 0 ) {
+				free( smsa_disk_array[i] );
+				smsa_disk_array[i] = NULL;
+			}
+			return( -1 );
+		}
+	}
+	if ( smsa_disk_mmap && (SMSAMapArray() != 0) ) {
+		for ( i=0; i<smsa_geometry.drums; i++ ) {
+			free( smsa_disk_array[i] );
+			smsa_disk_array[i] = NULL;
+		}
+		return( -1 );
+	}
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		if ( ((smsa_dirty_blocks[i] = calloc(SMSA_DIRTY_WORDS, sizeof(uint64_t))) == NULL) ||
+				(!smsa_disk_mmap && ((smsa_block_stamps[i] = calloc(smsa_geometry.blocks, sizeof(uint32_t))) == NULL)) ) {
+			logMessage( LOG_ERROR_LEVEL, "Unable to allocate the state of drum [%d]", i );
+			if ( smsa_disk_mmap ) {
+				SMSAUnmapArray();
+			}
+			SMSAReleaseArray();
+			return( -1 );
+		}
+		smsa_drum_formatted[i] = 0;
+		smsa_drum_generation[i] = 0;
+
+		// The signature cache only saves work, a drum can go without
+		if ( (smsa_signatures[i] = calloc(SMSA_DRUM_EXTENTS, sizeof(SMSA_SIGNATURE_CACHE *))) == NULL ) {
+			logMessage( LOG_WARNING_LEVEL, "Unable to allocate the signature cache of drum [%d], not caching", i );
+		}
 	}
-	smsa_drum_head = 0;
-	smsa_read_head = 0;
+	slen = CMPSC311_HASH_LENGTH;
+	smsa_signature_length = ((slen <= sizeof(smsa_zero_signature)) && (generate_md5_signature((unsigned char *)smsa_zero_extent,
+			smsa_geometry.block_size, (unsigned char *)smsa_zero_signature, &slen) == 0)) ? slen : 0;
+	sess->drum = 0;
+	sess->block = 0;
+	smsa_arm_drum = 0;
+	memset( smsa_arm_blocks, 0x0, sizeof(smsa_arm_blocks) );
 
 	// Mounting operation finished, set appropriate flag
 	logMessage( LOG_INFO_LEVEL, "Mounted the disk array successfully." );
 	smsa_mount_state  = 1;
 
-#if SMSA_STORAGE_ENABLED
 	// Try to load the disk array from disk file or format disks if not available
-	if ( SMSALoadArray() != 0 ) {
+	if ( smsa_disk_store && !smsa_disk_mmap && (SMSALoadArray() != 0) ) {
 		logMessage( LOG_INFO_LEVEL, "No mount data or failed, resetting disk data." );
 
 		// Initialize the disk array data
-		for (  i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-			SMSASeekDrum( i );
-			SMSAFormatDrum();
+		for (  i=0; i<smsa_geometry.drums; i++ ) {
+			SMSASeekDrum( sess, i );
+			SMSAFormatDrum( sess );
 		}
 	}
-#endif
+	stored = smsa_disk_store || smsa_disk_mmap;
+
+	// A stored array is journaled (if asked) and checkpointed, the mount
+	// fails rather than go on without them (the journal is kept)
+	if ( stored ) {
+		if ( (smsa_journal_open() != 0) || (smsa_start_checkpoints() != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "Unable to journal or checkpoint the array, failing mount." );
+			smsa_journal_close( 0 );
+			if ( smsa_disk_mmap ) {
+				SMSAUnmapArray();
+			}
+			SMSAReleaseArray();
+			smsa_mount_state = 0;
+			smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
+			return( -1 );
+		}
+	} else if ( smsa_journal_file != NULL ) {
+		logMessage( LOG_WARNING_LEVEL, "The array is not stored, not journaling to [%s]", smsa_journal_file );
+	}
 
 	// Return successfully
 	return( 0 );
@@ -300,10 +582,10 @@ int SMSAMountArray( void ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSAUnmountArray( void ) {
+int SMSAUnmountArray( SMSA_SESSION *sess ) {
 
 	// Local variables
-	int i;
+	int ret = 0;
 
 	// See if already mounted
 	if ( ! smsa_mount_state ) {
@@ -314,16 +596,18 @@ int SMSAUnmountArray( void ) {
 	// Mounting operation begin
 	logMessage( LOG_INFO_LEVEL, "Unmounting the disk array ..." );
 
-	// Store contents, deallocate the data from the array, reset disk heads
-#if SMSA_STORAGE_ENABLED
-	SMSAStoreArray();
-#endif
-	for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-		free( smsa_disk_array[i] );
-		smsa_disk_array[i] = NULL;
+	// Store contents, deallocate the data from the array (or flush and drop
+	// the mapping), reset disk heads.  Once stored the journal is not needed.
+	smsa_stop_checkpoints();
+	if ( smsa_disk_mmap ) {
+		ret = SMSAUnmapArray();
+	} else if ( smsa_disk_store ) {
+		ret = SMSAStoreArray();
 	}
-	smsa_drum_head = 0;
-	smsa_read_head = 0;
+	SMSAReleaseArray();
+	smsa_journal_close( ret == 0 );
+	sess->drum = 0;
+	sess->block = 0;
 	smsa_mount_state = 0;
 
 	// Return successfully
@@ -338,7 +622,7 @@ int SMSAUnmountArray( void ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSASeekDrum( SMSA_DRUM_ID did ) {
+int SMSASeekDrum( SMSA_SESSION *sess, SMSA_DRUM_ID did ) {
 
 	// Check to see if the disk array has been mounted
 	if ( ! smsa_mount_state ) {
@@ -351,15 +635,15 @@ int SMSASeekDrum( SMSA_DRUM_ID did ) {
 	logMessage( LOG_INFO_LEVEL, "Seeking new drum [%u]", did );
 
 	// Check for legal disk
-	if ( did >= SMSA_DISK_ARRAY_SIZE ) {
+	if ( did >= smsa_geometry.drums ) {
 		logMessage( LOG_ERROR_LEVEL, "Seek illegal drum id [%u]", did );
 		smsa_error_number = SMSA_BAD_DRUM_ID;
 		return( -1 );
 	}
 
 	// Move to the drum and return successfully
-	smsa_drum_head = did;
-	smsa_read_head = 0;
+	sess->drum = did;
+	sess->block = 0;
 	return( 0 );
 }
 
@@ -371,7 +655,7 @@ int SMSASeekDrum( SMSA_DRUM_ID did ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSASeekBlock( SMSA_BLOCK_ID blk ) {
+int SMSASeekBlock( SMSA_SESSION *sess, SMSA_BLOCK_ID blk ) {
 
 	// Check to see if the disk array has been mounted
 	if ( ! smsa_mount_state ) {
@@ -381,17 +665,17 @@ int SMSASeekBlock( SMSA_BLOCK_ID blk ) {
 	}
 
 	// Storing operation begin
-	logMessage( LOG_INFO_LEVEL, "Seeking new block [%u] on current disk [%d]", blk, smsa_drum_head );
+	logMessage( LOG_INFO_LEVEL, "Seeking new block [%u] on current disk [%d]", blk, sess->drum );
 
 	// Check for legal disk
-	if ( blk >= SMSA_MAX_BLOCK_ID ) {
+	if ( blk >= smsa_geometry.blocks ) {
 		logMessage( LOG_ERROR_LEVEL, "Seek illegal block id [%u]", blk );
 		smsa_error_number = SMSA_BAD_BLOCK_ID;
 		return( -1 );
 	}
 
 	// Move to the drum and return successfully
-	smsa_read_head = blk;
+	sess->block = blk;
 	return( 0 );
 }
 
@@ -403,12 +687,12 @@ int SMSASeekBlock( SMSA_BLOCK_ID blk ) {
 // Inputs       : block - the buffer to place the data in
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSAReadBlock( unsigned char *block ) {
+int SMSAReadBlock( SMSA_SESSION *sess, unsigned char *block ) {
 
 	// Storing operation begin
-	logMessage( LOG_INFO_LEVEL, "Reading drum/block [%u/%u]", smsa_drum_head, smsa_read_head );
-	assert( smsa_drum_head < SMSA_DISK_ARRAY_SIZE );
-	assert( smsa_read_head < SMSA_MAX_BLOCK_ID );
+	logMessage( LOG_INFO_LEVEL, "Reading drum/block [%u/%u]", sess->drum, sess->block );
+	assert( sess->drum < smsa_geometry.drums );
+	assert( sess->block < smsa_geometry.blocks );
 
 	// Check to see if the disk array has been mounted
 	if ( ! smsa_mount_state ) {
@@ -418,16 +702,16 @@ int SMSAReadBlock( unsigned char *block ) {
 	}
 
 	// Check to make sure that we are in a good read place
-	if ( (smsa_drum_head >= SMSA_DISK_ARRAY_SIZE) || (smsa_read_head >= SMSA_MAX_BLOCK_ID) ) {
+	if ( (sess->drum >= smsa_geometry.drums) || (sess->block >= smsa_geometry.blocks) ) {
 		logMessage( LOG_ERROR_LEVEL, "Illegal read drum/block [%u/%u]",
-				smsa_drum_head, smsa_read_head );
+				sess->drum, sess->block );
 		smsa_error_number = SMSA_BAD_READ;
 		return( -1 );
 	}
 
 	// Now do the read and return successfully
-	memcpy( block, SMSA_BLOCK_ADDRESS(smsa_drum_head,smsa_read_head), SMSA_BLOCK_SIZE );
-	smsa_read_head ++;
+	memcpy( block, block_address(sess->drum,sess->block), smsa_geometry.block_size );
+	sess->block ++;
 	return( 0 );
 }
 
@@ -439,12 +723,15 @@ int SMSAReadBlock( unsigned char *block ) {
 // Inputs       : block - the buffer to obtain data to write
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSAWriteBlock( unsigned char *block ) {
+int SMSAWriteBlock( SMSA_SESSION *sess, unsigned char *block ) {
+
+	// Local variables
+	unsigned char *ptr;
 
 	// Log the write, check to see if current position sane
-	logMessage( LOG_INFO_LEVEL, "Write drum/block [%u/%u]", smsa_drum_head, smsa_read_head );
-	assert( smsa_drum_head < SMSA_DISK_ARRAY_SIZE );
-	assert( smsa_read_head < SMSA_MAX_BLOCK_ID );
+	logMessage( LOG_INFO_LEVEL, "Write drum/block [%u/%u]", sess->drum, sess->block );
+	assert( sess->drum < smsa_geometry.drums );
+	assert( sess->block < smsa_geometry.blocks );
 
 	// Check to see if the disk array has been mounted
 	if ( ! smsa_mount_state ) {
@@ -454,16 +741,139 @@ int SMSAWriteBlock( unsigned char *block ) {
 	}
 
 	// Check the write for sanity
-	if ( (smsa_drum_head >= SMSA_DISK_ARRAY_SIZE) || (smsa_read_head >= SMSA_MAX_BLOCK_ID) ) {
+	if ( (sess->drum >= smsa_geometry.drums) || (sess->block >= smsa_geometry.blocks) ) {
 		logMessage( LOG_ERROR_LEVEL, "Illegal write drum/block [%u/%u]",
-				smsa_drum_head, smsa_read_head );
+				sess->drum, sess->block );
 		smsa_error_number = SMSA_BAD_WRITE;
 		return( -1 );
 	}
 
-	// Now do the read and return successfully
-	memcpy( SMSA_BLOCK_ADDRESS(smsa_drum_head,smsa_read_head), block, SMSA_BLOCK_SIZE );
-	smsa_read_head ++;
+	// Now journal and do the write (its extent may be new) and return successfully
+	if ( smsa_journal_append(SMSA_DISK_WRITE, sess->drum, sess->block, 0, smsa_geometry.block_size, block) ||
+			((ptr = block_write_address(sess->drum,sess->block,0)) == NULL) ) {
+		smsa_error_number = SMSA_BAD_WRITE;
+		return( -1 );
+	}
+	memcpy( ptr, block, smsa_geometry.block_size );
+	mark_blocks_dirty( sess->drum, sess->block, 1 );
+	sess->block ++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSAReadBlocks
+// Description  : Seek to a drum/block and read consecutive blocks from it
+//
+// Inputs       : did - the drum to read from
+//                bid - the first block to read
+//                count - the number of blocks to read
+//                buf - the buffer to place the data in (count blocks)
+// Outputs      : 0 if successful test, -1 if failure
+
+int SMSAReadBlocks( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *buf ) {
+
+	// Local variables
+	int i;
+
+	// Check the range for sanity, it may not run off the end of the drum
+	if ( (count == 0) || (count > smsa_geometry.range_blocks) || (bid+count > smsa_geometry.blocks) ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal read range [%u/%u+%u]", did, bid, count );
+		smsa_error_number = SMSA_BAD_READ;
+		return( -1 );
+	}
+
+	// Position the heads, then read block by block
+	if ( SMSASeekDrum(sess, did) || SMSASeekBlock(sess, bid) ) {
+		return( -1 );
+	}
+	for ( i=0; i<count; i++ ) {
+		if ( SMSAReadBlock(sess, &buf[i << smsa_geometry.block_shift]) ) {
+			return( -1 );
+		}
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSAWriteBlocks
+// Description  : Seek to a drum/block and write consecutive blocks to it
+//
+// Inputs       : did - the drum to write to
+//                bid - the first block to write
+//                count - the number of blocks to write
+//                buf - the buffer to obtain data to write (count blocks)
+// Outputs      : 0 if successful test, -1 if failure
+
+int SMSAWriteBlocks( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *buf ) {
+
+	// Local variables
+	int i;
+
+	// Check the range for sanity, it may not run off the end of the drum
+	if ( (count == 0) || (count > smsa_geometry.range_blocks) || (bid+count > smsa_geometry.blocks) ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal write range [%u/%u+%u]", did, bid, count );
+		smsa_error_number = SMSA_BAD_WRITE;
+		return( -1 );
+	}
+
+	// Position the heads, then write block by block
+	if ( SMSASeekDrum(sess, did) || SMSASeekBlock(sess, bid) ) {
+		return( -1 );
+	}
+	for ( i=0; i<count; i++ ) {
+		if ( SMSAWriteBlock(sess, &buf[i << smsa_geometry.block_shift]) ) {
+			return( -1 );
+		}
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSAWriteAt
+// Description  : Seek to a drum/block and write bytes within the block in
+//                place, the rest of the block is left as it is
+//
+// Inputs       : did - the drum to write to
+//                bid - the block to write
+//                off - the first byte of the block to write
+//                len - the number of bytes to write
+//                buf - the buffer to obtain the bytes from (len bytes)
+// Outputs      : 0 if successful test, -1 if failure
+
+int SMSAWriteAt( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t off, uint16_t len, unsigned char *buf ) {
+
+	// Local variables
+	unsigned char *ptr;
+
+	// Check the bytes for sanity, they may not run off the end of the block
+	if ( (len == 0) || (off+len > smsa_geometry.block_size) ) {
+		logMessage( LOG_ERROR_LEVEL, "Illegal partial write [%u/%u@%u+%u]", did, bid, off, len );
+		smsa_error_number = SMSA_BAD_WRITE;
+		return( -1 );
+	}
+
+	// Position the heads, then write the bytes and pass the block
+	if ( SMSASeekDrum(sess, did) || SMSASeekBlock(sess, bid) ) {
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "Write drum/block [%u/%u] bytes [%u+%u]", sess->drum, sess->block, off, len );
+	if ( smsa_journal_append(SMSA_DISK_WRITE, sess->drum, sess->block, off, len, buf) ||
+			((ptr = block_write_address(sess->drum,sess->block,1)) == NULL) ) {
+		smsa_error_number = SMSA_BAD_WRITE;
+		return( -1 );
+	}
+	memcpy( ptr+off, buf, len );
+	mark_blocks_dirty( sess->drum, sess->block, 1 );
+	sess->block ++;
+
+	// Return successfully
 	return( 0 );
 }
 
@@ -475,10 +885,15 @@ int SMSAWriteBlock( unsigned char *block ) {
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int SMSAFormatDrum( void ) {
+int SMSAFormatDrum( SMSA_SESSION *sess ) {
+
+	// Local variables
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	unsigned char *drum;
+	uint32_t e, gen;
 
 	// Log the format
-	logMessage( LOG_INFO_LEVEL, "Formatting drum [%u] ...", smsa_drum_head );
+	logMessage( LOG_INFO_LEVEL, "Formatting drum [%u] ...", sess->drum );
 
 	// Check if the drum array has been mounted
 	if ( ! smsa_mount_state ) {
@@ -487,18 +902,49 @@ int SMSAFormatDrum( void ) {
 	}
 
 	// Check if we are on a legal drum
-	if ( smsa_drum_head >= SMSA_DISK_ARRAY_SIZE ) {
+	if ( sess->drum >= smsa_geometry.drums ) {
 		smsa_error_number = SMSA_ILLEGAL_DRUM;
 		return( -1 );
 	}
 
-	// Zero the disk contents, reset the read head
-	memset( smsa_disk_array[smsa_drum_head], 0x0, SMSA_DISK_SIZE );
-	smsa_drum_head = 0;
-	smsa_read_head = 0;
+	// Journal it first
+	if ( smsa_journal_append(SMSA_FORMAT_DRUM, sess->drum, 0, 0, 0, NULL) ) {
+		smsa_error_number = SMSA_BAD_WRITE;
+		return( -1 );
+	}
+
+	// Start a new generation, the blocks written before read as zeros from
+	// here on (and are zeroed when next written), and their signatures are
+	// stale.  The mapped file has no stamps, so its drum is punched out (or
+	// zeroed) instead.  Only if the generation wraps do the extents have to
+	// be zeroed (and the signatures dropped) for real.
+	gen = __atomic_add_fetch( &smsa_drum_generation[sess->drum], 1, __ATOMIC_RELEASE );
+	if ( gen == 0 ) {
+		for ( e=0; (smsa_signatures[sess->drum] != NULL) && (e<SMSA_DRUM_EXTENTS); e++ ) {
+			if ( smsa_signatures[sess->drum][e] != NULL ) {
+				memset( smsa_signatures[sess->drum][e], 0x0, SMSA_EXTENT_BLOCKS*sizeof(SMSA_SIGNATURE_CACHE) );
+			}
+		}
+	}
+	if ( smsa_disk_mmap ) {
+		drum = smsa_disk_array[sess->drum][0];
+		if ( (SMSA_DRUM_BYTES % page) || madvise(drum, SMSA_DRUM_BYTES, MADV_REMOVE) ) {
+			memset( drum, 0x0, SMSA_DRUM_BYTES );
+		}
+	} else if ( gen == 0 ) {
+		for ( e=0; e<SMSA_DRUM_EXTENTS; e++ ) {
+			if ( smsa_disk_array[sess->drum][e] != NULL ) {
+				memset( smsa_disk_array[sess->drum][e], 0x0, SMSA_EXTENT_SIZE );
+			}
+		}
+		memset( smsa_block_stamps[sess->drum], 0x0, smsa_geometry.blocks*sizeof(uint32_t) );
+	}
+	__atomic_store_n( &smsa_drum_formatted[sess->drum], 1, __ATOMIC_RELEASE );
 
-	// Log the format completion
-	logMessage( LOG_INFO_LEVEL, "Formatting drum [%u] completed successfully.", smsa_drum_head );
+	// Log the format completion, then reset the heads
+	logMessage( LOG_INFO_LEVEL, "Formatting drum [%u] completed successfully.", sess->drum );
+	sess->drum = 0;
+	sess->block = 0;
 
 	// Return successfully
 	return( 0 );
@@ -510,7 +956,12 @@ int SMSAFormatDrum( void ) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : SMSAStoreArray
-// Description  : Push the contents of the array to disk file.
+// Description  : Push the blocks changed since the last store to the disk
+//                file.  The file holds the drums back to back, so each run
+//                of dirty blocks (bridging short clean gaps) goes out with
+//                one pwritev, even where it crosses from one drum to the
+//                next.  Blocks never written (or not since the drum was
+//                formatted) go out from the zero extent.
 //
 // Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
@@ -518,35 +969,115 @@ int SMSAFormatDrum( void ) {
 int SMSAStoreArray( void ) {
 
 	// Local variables
-	int fh, bytes, i;
+	uint64_t *dirty[SMSA_DISK_ARRAY_SIZE];
+	struct iovec iov[SMSA_STORE_IOVECS];
+	int fh, i, n, next, start, end, blocks = 0, writes = 0, niov, current;
+	int per = smsa_geometry.blocks, total = smsa_geometry.drums*smsa_geometry.blocks;
+	int ebl = SMSA_EXTENT_BLOCKS;
+	ssize_t bytes = 0, want = 0;
+	off_t off;
 
 	// Storing operation begin
 	logMessage( LOG_INFO_LEVEL, "Storing the disk array contents ..." );
 
 	// Open the disk file, check for error
-	if ( (fh=open(SMSA_DISK_FILE, O_CREAT|O_WRONLY|O_TRUNC,S_IRWXU)) == -1 ) {
+	if ( (fh=open(smsa_disk_file, O_CREAT|O_WRONLY,S_IRWXU)) == -1 ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening array data for store [%s], error=[%s]",
-				SMSA_DISK_FILE, strerror(errno) );
+				smsa_disk_file, strerror(errno) );
 		smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
 		return( -1 );
 	}
 
-	// Now read the disk data
-	for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-		// Keep reading disk by disk
-		bytes = write( fh, smsa_disk_array[i], SMSA_DISK_SIZE );
-		if ( bytes != SMSA_DISK_SIZE ) {
+	// Make room for the snapshot first, the dirty blocks stay put if not
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		if ( (dirty[i] = malloc(SMSA_DIRTY_WORDS*sizeof(uint64_t))) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Unable to allocate the dirty blocks of drum [%d] for store", i );
+			smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
+			while ( i-- > 0 ) {
+				free( dirty[i] );
+			}
+			close( fh );
+			return( -1 );
+		}
+	}
+
+	// Take the dirty blocks (all of a formatted drum), writes from here on
+	// mark them again
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		for ( n=0; n<SMSA_DIRTY_WORDS; n++ ) {
+			dirty[i][n] = __atomic_exchange_n( &smsa_dirty_blocks[i][n], 0, __ATOMIC_ACQ_REL );
+		}
+		if ( __atomic_exchange_n(&smsa_drum_formatted[i], 0, __ATOMIC_ACQ_REL) ) {
+			memset( dirty[i], 0xff, SMSA_DIRTY_WORDS*sizeof(uint64_t) );
+		}
+	}
+
+	// Now write the dirty extents (stepping over clean words whole)
+	for ( n=0; n<total; n++ ) {
+		if ( ! SMSA_BLOCK_DIRTY(dirty, n, per) ) {
+			if ( (n%per%64 == 0) && (dirty[n/per][n%per/64] == 0) ) {
+				n += ((n%per+64 < per) ? 64 : per-n%per) - 1;
+			}
+			continue;
+		}
+
+		// Find the end of the extent, past any short clean gaps
+		for ( start = n, end = n+1; (n < total) && (n-end < SMSA_STORE_GAP_BLOCKS); n++ ) {
+			if ( SMSA_BLOCK_DIRTY(dirty, n, per) ) {
+				end = n+1;
+			}
+		}
+		n = end;
+
+		// One piece for each part of an extent it covers (drums hold whole
+		// extents) that is current or not, writing whenever the vector fills
+		off = (off_t)start << smsa_geometry.block_shift;
+		for ( niov=0, i=start; i<end; i=next ) {
+			current = block_current( i/per, i%per );
+			for ( next=i+1; (next < end) && (next%ebl != 0) && (block_current(next/per, next%per) == current); next++ );
+			iov[niov].iov_base = (unsigned char *)block_address( i/per, i%per );
+			iov[niov].iov_len = (size_t)(next-i) << smsa_geometry.block_shift;
+			want += iov[niov].iov_len;
+			if ( (++niov == SMSA_STORE_IOVECS) || (next == end) ) {
+				if ( (bytes = pwritev(fh, iov, niov, off)) != want ) {
+					break;
+				}
+				off += want;
+				bytes = want = niov = 0;
+				writes ++;
+			}
+		}
+		if ( bytes != want ) {
 			logMessage( LOG_ERROR_LEVEL, "Failure writing array data [%s], error=[%s]",
-							SMSA_DISK_FILE, strerror(errno) );
+							smsa_disk_file, strerror(errno) );
 			smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
+
+			// Whatever was not written is still dirty
+			for ( i=0; i<smsa_geometry.drums; i++ ) {
+				for ( n=0; n<SMSA_DIRTY_WORDS; n++ ) {
+					__atomic_fetch_or( &smsa_dirty_blocks[i][n], dirty[i][n], __ATOMIC_RELEASE );
+				}
+				free( dirty[i] );
+			}
+			close( fh );
 			return( -1 );
 		}
-		logMessage( LOG_INFO_LEVEL, "Wrote disk (%d) contents successfully", i );
+		blocks += end-start;
+	}
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		free( dirty[i] );
 	}
 
-	// Now close the file and log results
+	// Now close the file (synced first if a journal relies on it) and log results
+	if ( (smsa_journal_file != NULL) && (fdatasync(fh) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure syncing array data [%s], error=[%s]",
+				smsa_disk_file, strerror(errno) );
+		smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
+		close( fh );
+		return( -1 );
+	}
 	close( fh );
-	logMessage( LOG_INFO_LEVEL, "Stored the disk array contents successfully." );
+	logMessage( LOG_INFO_LEVEL, "Stored the disk array contents successfully (%d blocks in %d writes).", blocks, writes );
 
 	// Return successfully
 	return( 0 );
@@ -563,28 +1094,50 @@ int SMSAStoreArray( void ) {
 int SMSALoadArray( void ) {
 
 	// Local variables
-	int fh, bytes, i;
+	unsigned char *ext;
+	size_t got;
+	ssize_t bytes;
+	uint32_t e;
+	int fh, i;
 
 	// Storing operation begin
 	logMessage( LOG_INFO_LEVEL, "Loading the disk array contents ..." );
 
 	// Open the disk file, check for error
-	if ( (fh=open(SMSA_DISK_FILE, O_RDONLY)) == -1 ) {
+	if ( (fh=open(smsa_disk_file, O_RDONLY)) == -1 ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening array data for load [%s], error=[%s]",
-				SMSA_DISK_FILE, strerror(errno) );
+				smsa_disk_file, strerror(errno) );
 		smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
 		return( -1 );
 	}
 
 	// Now read the disk data
-	for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-		// Keep reading disk by disk
-		bytes = read( fh, smsa_disk_array[i], SMSA_DISK_SIZE );
-		if ( bytes != SMSA_DISK_SIZE ) {
-			logMessage( LOG_ERROR_LEVEL, "Failure reading array data [%s], error=[%s]",
-							SMSA_DISK_FILE, strerror(errno) );
-			smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
-			return( -1 );
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		// Read extent by extent, keeping only the ones holding data
+		for ( e=0; e<SMSA_DRUM_EXTENTS; e++ ) {
+			if ( (ext = malloc(SMSA_EXTENT_SIZE)) == NULL ) {
+				logMessage( LOG_ERROR_LEVEL, "Unable to allocate extent [%d/%u]", i, e );
+				smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
+				close( fh );
+				return( -1 );
+			}
+			for ( got=0; got<SMSA_EXTENT_SIZE; got+=bytes ) {
+				bytes = read( fh, &ext[got], SMSA_EXTENT_SIZE-got );
+				if ( bytes <= 0 ) {
+					logMessage( LOG_ERROR_LEVEL, "Failure reading array data [%s], error=[%s]",
+									smsa_disk_file, strerror(errno) );
+					smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
+					free( ext );
+					close( fh );
+					return( -1 );
+				}
+			}
+			if ( memcmp(ext, smsa_zero_extent, SMSA_EXTENT_SIZE) == 0 ) {
+				free( ext );
+			} else {
+				smsa_disk_array[i][e] = ext;
+				smsa_extent_count ++;
+			}
 		}
 		logMessage( LOG_INFO_LEVEL, "Loaded disk (%d) contents successfully", i );
 	}
@@ -599,61 +1152,54 @@ int SMSALoadArray( void ) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : decode_SMSA_operation
-// Description  : This function decodes a disk operation from a buffer for
-//                receiving from the disk layer.
+// Function     : SMSAMapArray
+// Description  : Map the disk file as the array.  Nothing is read up front,
+//                drums are paged in as they are touched, and space the file
+//                did not have reads as zeros (a formatted drum).
 //
-// Inputs       : dop - structure to place operation contents on
-//                op - the operation structure
-//                block - the disk block
+// Inputs       : none
 // Outputs      : 0 if successful test, -1 if failure
 
-int decode_SMSA_operation( SMSA_OPERATION *dop, uint32_t op, unsigned char *block ) {
-
-	/*
-	 * SMSA operation bit layout
-	 *
-	 * 	0-5		- command number (6-bits)
-	 * 	6-9		- drum identifier (4-bits)
-	 * 	10-23	- RESERVED (unused)
-	 * 	24-31	- block address (8-bits)
-	 *
-	 */
-
-	// Do the bit manipulations
-	dop->cmd = (op>>26);		// The type of operation being performed
-	dop->did = (op>>22)&0xf;	// This is the drum to be written to/read from
-	dop->bid = (op&0xff);		// This is the block address to read/write
+int SMSAMapArray( void ) {
 
-	// Check for legal values
-	if ( dop->cmd >= SMSA_MAX_COMMAND ) {
-		logMessage( LOG_ERROR_LEVEL, "Decoded operation illegal [%lu->%u]", op, dop->cmd );
-		smsa_error_number = SMSA_BAD_OPCODE;
+	// Local variables
+	off_t size = (off_t)smsa_geometry.drums << smsa_geometry.drum_shift;
+	unsigned char *base;
+	struct stat st;
+	uint32_t e;
+	int fh, i;
+
+	// Open the disk file (creating it if needed), it has to hold the array
+	if ( (fh=open(smsa_disk_file, O_CREAT|O_RDWR, S_IRWXU)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure opening array data for map [%s], error=[%s]",
+				smsa_disk_file, strerror(errno) );
+		smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
 		return( -1 );
 	}
-
-	// Check for legal disk
-	if ( dop->did >= SMSA_DISK_ARRAY_SIZE ) {
-		logMessage( LOG_ERROR_LEVEL, "Decoded drum id illegal [%lu->%u]", op, dop->did );
-		smsa_error_number = SMSA_BAD_DRUM_ID;
+	if ( (fstat(fh, &st) == -1) || ((st.st_size < size) && (ftruncate(fh, size) == -1)) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure sizing array data [%s], error=[%s]",
+				smsa_disk_file, strerror(errno) );
+		smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
+		close( fh );
 		return( -1 );
 	}
 
-	// Check for legal block address
-	if ( dop->bid >= SMSA_MAX_BLOCK_ID ) {
-		logMessage( LOG_ERROR_LEVEL, "Decoded block id illegal [%lu->%u]", op, dop->bid );
-		smsa_error_number = SMSA_BAD_BLOCK_ID;
+	// Map it, the mapping keeps the file open
+	base = mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fh, 0 );
+	close( fh );
+	if ( base == MAP_FAILED ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure mapping array data [%s], error=[%s]",
+				smsa_disk_file, strerror(errno) );
+		smsa_error_number = SMSA_DISK_CACHELOAD_FAIL;
 		return( -1 );
 	}
-
-	// Set the block for processing
-	if ( block != NULL ) {
-		dop->len = SMSA_BLOCK_SIZE;
-		dop->blk = block;
-	} else {
-		dop->len = 0;
-		dop->blk = NULL;
+	smsa_disk_map = base;
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		for ( e=0; e<SMSA_DRUM_EXTENTS; e++ ) {
+			smsa_disk_array[i][e] = &base[((size_t)i << smsa_geometry.drum_shift) + e*SMSA_EXTENT_SIZE];
+		}
 	}
+	logMessage( LOG_INFO_LEVEL, "Mapped the disk array contents from [%s].", smsa_disk_file );
 
 	// Return successfully
 	return( 0 );
@@ -661,33 +1207,746 @@ int decode_SMSA_operation( SMSA_OPERATION *dop, uint32_t op, unsigned char *bloc
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : encode_SMSA_operation
-// Description  : This function encodes a disk operation in a buffer for
-//                passing to the disk layer.
+// Function     : SMSAUnmapArray
+// Description  : Flush the mapped array to the disk file (only the pages
+//                written since they were last flushed go out) and unmap it
 //
-// Inputs       : cmd - the command to be created
-//                did - the drum identifier
-//                bid - the block identifier
-// Outputs      : the encoded operation value or 0 on failure
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
 
-uint32_t encode_SMSA_operation( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+int SMSAUnmapArray( void ) {
 
-	// Check for legal command
-	if ( cmd >= SMSA_MAX_COMMAND ) {
+	// Local variables
+	size_t size = (size_t)smsa_geometry.drums << smsa_geometry.drum_shift;
+	int ret = 0;
+
+	// Flush the dirty pages, then drop the mapping
+	if ( msync(smsa_disk_map, size, MS_SYNC) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure flushing array data [%s], error=[%s]",
+				smsa_disk_file, strerror(errno) );
+		smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
+		ret = -1;
+	}
+	munmap( smsa_disk_map, size );
+	smsa_disk_map = NULL;
+	logMessage( LOG_INFO_LEVEL, "Unmapped the disk array contents." );
+
+	// Return
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSAReleaseArray
+// Description  : Free the drums of the array and their state (after it has
+//                been stored or unmapped, or if a mount fails part way)
+//
+// Inputs       : none
+// Outputs      : none
+
+void SMSAReleaseArray( void ) {
+
+	// Local variables
+	uint32_t e;
+	int i;
+
+	// The extents are only ours if not mapped from the file
+	if ( ! smsa_disk_mmap ) {
+		logMessage( LOG_INFO_LEVEL, "Releasing %u extents (%lu bytes each).", smsa_extent_count, SMSA_EXTENT_SIZE );
+		for ( i=0; i<smsa_geometry.drums; i++ ) {
+			for ( e=0; (smsa_disk_array[i] != NULL) && (e<SMSA_DRUM_EXTENTS); e++ ) {
+				free( smsa_disk_array[i][e] );
+			}
+		}
+	}
+	for ( i=0; i<smsa_geometry.drums; i++ ) {
+		free( smsa_disk_array[i] );
+		smsa_disk_array[i] = NULL;
+		free( smsa_dirty_blocks[i] );
+		smsa_dirty_blocks[i] = NULL;
+		free( smsa_block_stamps[i] );
+		smsa_block_stamps[i] = NULL;
+		for ( e=0; (smsa_signatures[i] != NULL) && (e<SMSA_DRUM_EXTENTS); e++ ) {
+			free( smsa_signatures[i][e] );
+		}
+		free( smsa_signatures[i] );
+		smsa_signatures[i] = NULL;
+	}
+	smsa_extent_count = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : SMSACheckpointArray
+// Description  : Bring the stored copy of the array up to date (the blocks
+//                changed since the last store, or the dirty pages of the
+//                mapping) without unmounting, the journal of the changes it
+//                covers is then dropped
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int SMSACheckpointArray( void ) {
+
+	// Local variables
+	int ret;
+
+	// Start a new journal, the old one holds nothing this will not store
+	if ( smsa_journal_rotate() != 0 ) {
+		return( -1 );
+	}
+
+	// The mapping knows its own dirty pages
+	if ( smsa_disk_mmap ) {
+		ret = 0;
+		if ( msync(smsa_disk_map, (size_t)smsa_geometry.drums << smsa_geometry.drum_shift, MS_SYNC) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure flushing array data [%s], error=[%s]",
+					smsa_disk_file, strerror(errno) );
+			smsa_error_number = SMSA_DISK_CACHEWRITE_FAIL;
+			ret = -1;
+		}
+	} else {
+		ret = SMSAStoreArray();
+	}
+
+	// Drop the old journal once it is covered
+	if ( ret == 0 ) {
+		smsa_journal_retire();
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mark_blocks_dirty
+// Description  : Note blocks have changed since the array was last stored
+//                (after changing them, so a store racing the change sees it
+//                the next time)
+//
+// Inputs       : did - the drum
+//                bid - the first block changed
+//                count - the number of blocks changed
+// Outputs      : none
+
+void mark_blocks_dirty( SMSA_DRUM_ID did, uint32_t bid, uint32_t count ) {
+
+	// Local variables
+	uint32_t i;
+
+	for ( i=bid; i<bid+count; i++ ) {
+		__atomic_fetch_or( &smsa_dirty_blocks[did][i/64], 1ULL << (i%64), __ATOMIC_RELEASE );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_start_checkpoints
+// Description  : Start the thread that checkpoints the mounted array every
+//                smsa_checkpoint_interval seconds, bounding what a crash
+//                loses (nothing is started without an interval)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_start_checkpoints( void ) {
+
+	// Nothing to do, or already running
+	if ( (smsa_checkpoint_interval <= 0) || smsa_checkpoint_running ) {
+		return( 0 );
+	}
+
+	// Start the thread
+	smsa_checkpoint_running = 1;
+	if ( pthread_create(&smsa_checkpoint_thread, NULL, smsa_checkpoint_main, NULL) != 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "Unable to start the checkpoint thread" );
+		smsa_checkpoint_running = 0;
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "Checkpointing the disk array every %d seconds", smsa_checkpoint_interval );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_stop_checkpoints
+// Description  : Stop the checkpoint thread, waiting for it to finish
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_stop_checkpoints( void ) {
+
+	// Tell it to stop, then wait for it
+	pthread_mutex_lock( &smsa_checkpoint_lock );
+	if ( ! smsa_checkpoint_running ) {
+		pthread_mutex_unlock( &smsa_checkpoint_lock );
+		return;
+	}
+	smsa_checkpoint_running = 0;
+	pthread_cond_signal( &smsa_checkpoint_wakeup );
+	pthread_mutex_unlock( &smsa_checkpoint_lock );
+	pthread_join( smsa_checkpoint_thread, NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_checkpoint_main
+// Description  : The checkpoint thread, checkpoints the array until stopped
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+void *smsa_checkpoint_main( void *arg ) {
+
+	// Local variables
+	struct timespec until;
+
+	pthread_mutex_lock( &smsa_checkpoint_lock );
+	while ( smsa_checkpoint_running ) {
+
+		// Sleep the interval (or until stopped), then checkpoint
+		clock_gettime( CLOCK_REALTIME, &until );
+		until.tv_sec += smsa_checkpoint_interval;
+		while ( smsa_checkpoint_running &&
+				(pthread_cond_timedwait(&smsa_checkpoint_wakeup, &smsa_checkpoint_lock, &until) != ETIMEDOUT) );
+		if ( smsa_checkpoint_running ) {
+			pthread_mutex_unlock( &smsa_checkpoint_lock );
+			SMSACheckpointArray();
+			pthread_mutex_lock( &smsa_checkpoint_lock );
+		}
+	}
+	pthread_mutex_unlock( &smsa_checkpoint_lock );
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_open
+// Description  : Replay the journal (the one a checkpoint was retiring, then
+//                the current one) over the loaded array, checkpoint what it
+//                restored, and start appending to it.  Nothing is journaled
+//                without a journal file.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_open( void ) {
+
+	// Local variables
+	off_t good = 0;
+	int older, records;
+
+	// Nothing to do without a journal
+	if ( smsa_journal_file == NULL ) {
+		return( 0 );
+	}
+	snprintf( smsa_journal_old, sizeof(smsa_journal_old), "%s%s", smsa_journal_file, SMSA_JOURNAL_OLD );
+
+	// Replay both, the older first, and checkpoint anything replayed
+	if ( ((older = smsa_journal_replay(smsa_journal_old, NULL)) < 0) ||
+			((records = smsa_journal_replay(smsa_journal_file, &good)) < 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "Unable to replay the journal, not journaling" );
+		return( -1 );
+	}
+	records += older;
+	if ( (records == 0) || (SMSACheckpointArray() == 0) ) {
+		unlink( smsa_journal_old );
+		good = (records == 0) ? good : 0;
+	}
+
+	// Append after the last whole record (a torn one is dropped)
+	if ( ((smsa_journal_fd = open(smsa_journal_file, O_CREAT|O_WRONLY, S_IRWXU)) == -1) ||
+			(ftruncate(smsa_journal_fd, good) == -1) || (lseek(smsa_journal_fd, good, SEEK_SET) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure opening journal [%s], error=[%s]",
+				smsa_journal_file, strerror(errno) );
+		if ( smsa_journal_fd != -1 ) {
+			close( smsa_journal_fd );
+			smsa_journal_fd = -1;
+		}
+		return( -1 );
+	}
+	smsa_journal_appended = smsa_journal_durable = 0;
+	logMessage( LOG_INFO_LEVEL, "Journaling changes to [%s] (%d records replayed)", smsa_journal_file, records );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_replay
+// Description  : Apply the records of a journal file to the array, up to
+//                the first that is not whole (where a crash tore it)
+//
+// Inputs       : path - the journal file
+//                good - set to the bytes of whole records (NULL if unwanted)
+// Outputs      : the number of records applied, -1 if failure
+
+int smsa_journal_replay( const char *path, off_t *good ) {
+
+	// Local variables
+	SMSA_JOURNAL_RECORD rec;
+	SMSA_SESSION sess;
+	unsigned char *buf, *ptr;
+	struct stat st;
+	size_t got, pos = 0;
+	ssize_t bytes;
+	uint32_t sum;
+	int fh, records = 0;
+
+	// A missing journal has nothing in it
+	if ( (fh=open(path, O_RDONLY)) == -1 ) {
+		return( (errno == ENOENT) ? 0 : -1 );
+	}
+	if ( (fstat(fh, &st) == -1) || ((buf = malloc(st.st_size+1)) == NULL) ) {
+		close( fh );
+		return( -1 );
+	}
+	for ( got=0; got<(size_t)st.st_size; got+=bytes ) {
+		if ( (bytes = read(fh, &buf[got], st.st_size-got)) <= 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure reading journal [%s], error=[%s]", path, strerror(errno) );
+			free( buf );
+			close( fh );
+			return( -1 );
+		}
+	}
+	close( fh );
+
+	// Walk the records, checking each before applying it
+	while ( pos+sizeof(rec) <= got ) {
+		memcpy( &rec, &buf[pos], sizeof(rec) );
+		sum = rec.sum;
+		rec.sum = 0;
+		if ( (rec.magic != SMSA_JOURNAL_MAGIC) || (pos+sizeof(rec)+rec.len > got) ||
+				(smsa_journal_checksum(&buf[pos+sizeof(rec)], rec.len,
+					smsa_journal_checksum((unsigned char *)&rec, sizeof(rec), SMSA_JOURNAL_SEED)) != sum) ) {
+			logMessage( LOG_WARNING_LEVEL, "Journal [%s] torn at byte %lu of %lu", path, pos, got );
+			break;
+		}
+		if ( (rec.did >= smsa_geometry.drums) || (rec.bid >= smsa_geometry.blocks) ||
+				(rec.off+rec.len > smsa_geometry.block_size) ) {
+			logMessage( LOG_ERROR_LEVEL, "Journal [%s] record does not fit the array [%u/%u@%u+%u]",
+					path, rec.did, rec.bid, rec.off, rec.len );
+			free( buf );
+			return( -1 );
+		}
+
+		// Redo the change
+		if ( rec.cmd == SMSA_FORMAT_DRUM ) {
+			sess.drum = rec.did;
+			SMSAFormatDrum( &sess );
+		} else {
+			if ( (ptr = block_write_address(rec.did, rec.bid, rec.len < smsa_geometry.block_size)) == NULL ) {
+				free( buf );
+				return( -1 );
+			}
+			memcpy( ptr+rec.off, &buf[pos+sizeof(rec)], rec.len );
+			mark_blocks_dirty( rec.did, rec.bid, 1 );
+		}
+		pos += sizeof(rec) + rec.len;
+		records ++;
+	}
+	free( buf );
+
+	// Return the records
+	if ( good != NULL ) {
+		*good = pos;
+	}
+	logMessage( LOG_INFO_LEVEL, "Replayed %d records from journal [%s]", records, path );
+	return( records );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_append
+// Description  : Add the record of a change to the journal buffer, it is
+//                durable once committed (nothing happens without a journal)
+//
+// Inputs       : cmd - SMSA_DISK_WRITE or SMSA_FORMAT_DRUM
+//                did - the drum
+//                bid - the block written
+//                off - the first byte written in the block
+//                len - the number of bytes written
+//                data - the bytes written
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_append( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t off, uint16_t len, const unsigned char *data ) {
+
+	// Local variables
+	SMSA_JOURNAL_RECORD rec;
+	unsigned char *buf;
+	size_t size;
+
+	// Nothing to do without a journal
+	if ( __atomic_load_n(&smsa_journal_fd, __ATOMIC_ACQUIRE) == -1 ) {
+		return( 0 );
+	}
+
+	// Setup the record, checksumming it with its bytes
+	memset( &rec, 0x0, sizeof(rec) );
+	rec.magic = SMSA_JOURNAL_MAGIC;
+	rec.cmd = cmd;
+	rec.did = did;
+	rec.bid = bid;
+	rec.off = off;
+	rec.len = len;
+	rec.sum = smsa_journal_checksum( data, len, smsa_journal_checksum((unsigned char *)&rec, sizeof(rec), SMSA_JOURNAL_SEED) );
+
+	// Add it to the buffer, growing it if needed
+	pthread_mutex_lock( &smsa_journal_lock );
+	if ( smsa_journal_used+sizeof(rec)+len > smsa_journal_size ) {
+		size = smsa_journal_size + ((sizeof(rec)+len > SMSA_JOURNAL_BUFFER) ? sizeof(rec)+len : SMSA_JOURNAL_BUFFER);
+		if ( (buf = realloc(smsa_journal_buf, size)) == NULL ) {
+			pthread_mutex_unlock( &smsa_journal_lock );
+			logMessage( LOG_ERROR_LEVEL, "Unable to grow the journal buffer (%lu bytes)", size );
+			return( -1 );
+		}
+		smsa_journal_buf = buf;
+		smsa_journal_size = size;
+	}
+	memcpy( &smsa_journal_buf[smsa_journal_used], &rec, sizeof(rec) );
+	if ( len > 0 ) {
+		memcpy( &smsa_journal_buf[smsa_journal_used+sizeof(rec)], data, len );
+	}
+	smsa_journal_used += sizeof(rec) + len;
+	smsa_journal_appended += sizeof(rec) + len;
+	pthread_mutex_unlock( &smsa_journal_lock );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_commit
+// Description  : Make everything appended to the journal so far durable.
+//                Whoever gets here first writes the buffer and syncs it for
+//                everyone that appended before, anyone arriving meanwhile
+//                waits for it and then commits what they added together.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_commit( void ) {
+
+	// Local variables
+	unsigned char *buf;
+	uint64_t upto;
+	size_t used, size;
+	int ret = 0;
+
+	// Nothing to do without a journal
+	if ( __atomic_load_n(&smsa_journal_fd, __ATOMIC_ACQUIRE) == -1 ) {
+		return( 0 );
+	}
+
+	pthread_mutex_lock( &smsa_journal_lock );
+	upto = smsa_journal_appended;
+	while ( (smsa_journal_durable < upto) && (ret == 0) ) {
+
+		// Someone else is syncing, they may cover us
+		if ( smsa_journal_syncing ) {
+			pthread_cond_wait( &smsa_journal_synced, &smsa_journal_lock );
+			continue;
+		}
+
+		// Take the buffer (leaving the spare for appends), write and sync it
+		smsa_journal_syncing = 1;
+		buf = smsa_journal_buf;
+		used = smsa_journal_used;
+		size = smsa_journal_size;
+		smsa_journal_buf = smsa_journal_spare;
+		smsa_journal_size = smsa_journal_spare_size;
+		smsa_journal_used = 0;
+		upto = smsa_journal_appended;
+		pthread_mutex_unlock( &smsa_journal_lock );
+		ret = smsa_journal_write( smsa_journal_fd, buf, used );
+		pthread_mutex_lock( &smsa_journal_lock );
+
+		// Give back the buffer, let the others see how far it got
+		smsa_journal_spare = buf;
+		smsa_journal_spare_size = size;
+		if ( ret == 0 ) {
+			smsa_journal_durable = upto;
+		}
+		smsa_journal_syncing = 0;
+		pthread_cond_broadcast( &smsa_journal_synced );
+	}
+	pthread_mutex_unlock( &smsa_journal_lock );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_write
+// Description  : Write records to the end of the journal and sync them
+//
+// Inputs       : fd - the journal file handle
+//                buf - the records
+//                len - the number of bytes of records
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_write( int fd, unsigned char *buf, size_t len ) {
+
+	// Local variables
+	size_t done;
+	ssize_t bytes;
+
+	for ( done=0; done<len; done+=bytes ) {
+		if ( (bytes = write(fd, &buf[done], len-done)) <= 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure writing journal [%s], error=[%s]",
+					smsa_journal_file, strerror(errno) );
+			return( -1 );
+		}
+	}
+	if ( (len > 0) && (fdatasync(fd) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure syncing journal [%s], error=[%s]",
+				smsa_journal_file, strerror(errno) );
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_rotate
+// Description  : Start a new journal for a checkpoint, the old one is kept
+//                (synced) until the checkpoint is done.  The old one holds
+//                writes still in progress, so this waits for each drum to be
+//                free of writers.  If an older journal was never retired the
+//                current one just goes on (replaying extra records is safe).
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_rotate( void ) {
+
+	// Local variables
+	int fd, i, ret = 0;
+
+	// Nothing to do without a journal
+	if ( __atomic_load_n(&smsa_journal_fd, __ATOMIC_ACQUIRE) == -1 ) {
+		return( 0 );
+	}
+
+	// Sync what the old one has, then swap in the new one
+	pthread_mutex_lock( &smsa_journal_lock );
+	while ( smsa_journal_syncing ) {
+		pthread_cond_wait( &smsa_journal_synced, &smsa_journal_lock );
+	}
+	if ( smsa_journal_write(smsa_journal_fd, smsa_journal_buf, smsa_journal_used) == 0 ) {
+		smsa_journal_used = 0;
+		smsa_journal_durable = smsa_journal_appended;
+		pthread_cond_broadcast( &smsa_journal_synced );
+		if ( access(smsa_journal_old, F_OK) == -1 ) {
+			if ( (rename(smsa_journal_file, smsa_journal_old) == -1) ||
+					((fd = open(smsa_journal_file, O_CREAT|O_TRUNC|O_WRONLY, S_IRWXU)) == -1) ||
+					(smsa_journal_sync_directory() != 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Failure starting journal [%s], error=[%s]",
+						smsa_journal_file, strerror(errno) );
+				ret = -1;
+			} else {
+				close( smsa_journal_fd );
+				__atomic_store_n( &smsa_journal_fd, fd, __ATOMIC_RELEASE );
+			}
+		}
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock( &smsa_journal_lock );
+
+	// Wait out the writes in progress (not if unmounting, it holds the drums)
+	for ( i=0; (i<SMSA_DISK_ARRAY_SIZE) && (ret == 0); i++ ) {
+		while ( pthread_rwlock_tryrdlock(&smsa_drum_locks[i]) != 0 ) {
+			if ( ! __atomic_load_n(&smsa_checkpoint_running, __ATOMIC_ACQUIRE) ) {
+				return( -1 );
+			}
+			sched_yield();
+		}
+		pthread_rwlock_unlock( &smsa_drum_locks[i] );
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_retire
+// Description  : Drop the journal a checkpoint covers
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_journal_retire( void ) {
+
+	// Only while journaling (it may not have been replayed otherwise)
+	if ( __atomic_load_n(&smsa_journal_fd, __ATOMIC_ACQUIRE) != -1 ) {
+		unlink( smsa_journal_old );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_close
+// Description  : Stop journaling, dropping the journal if the array was
+//                stored (else it is synced for the next mount to replay)
+//
+// Inputs       : stored - the array was stored
+// Outputs      : none
+
+void smsa_journal_close( int stored ) {
+
+	// Nothing to do without a journal
+	if ( smsa_journal_fd == -1 ) {
+		return;
+	}
+	if ( stored ) {
+		unlink( smsa_journal_old );
+		unlink( smsa_journal_file );
+	} else {
+		smsa_journal_write( smsa_journal_fd, smsa_journal_buf, smsa_journal_used );
+	}
+	close( smsa_journal_fd );
+	smsa_journal_fd = -1;
+	free( smsa_journal_buf );
+	free( smsa_journal_spare );
+	smsa_journal_buf = smsa_journal_spare = NULL;
+	smsa_journal_used = smsa_journal_size = smsa_journal_spare_size = 0;
+	logMessage( LOG_INFO_LEVEL, "Closed journal [%s]", smsa_journal_file );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_sync_directory
+// Description  : Sync the directory holding the journal, so a new journal
+//                file survives a crash
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_journal_sync_directory( void ) {
+
+	// Local variables
+	char path[PATH_MAX];
+	int fd, ret;
+
+	snprintf( path, sizeof(path), "%s", smsa_journal_file );
+	if ( (fd = open(dirname(path), O_RDONLY|O_DIRECTORY)) == -1 ) {
+		return( -1 );
+	}
+	ret = fsync( fd );
+	close( fd );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_checksum
+// Description  : Fold bytes into a journal checksum (FNV-1a), enough to tell
+//                a whole record from a torn one
+//
+// Inputs       : buf - the bytes
+//                len - the number of bytes
+//                sum - the checksum so far (SMSA_JOURNAL_SEED to start)
+// Outputs      : the checksum
+
+uint32_t smsa_journal_checksum( const unsigned char *buf, size_t len, uint32_t sum ) {
+
+	// Local variables
+	size_t i;
+
+	for ( i=0; i<len; i++ ) {
+		sum = (sum ^ buf[i]) * 16777619U;
+	}
+	return( sum );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decode_SMSA_operation
+// Description  : This function decodes a disk operation from a buffer for
+//                receiving from the disk layer.
+//
+// Inputs       : dop - structure to place operation contents on
+//                op - the operation structure
+//                block - the disk block
+// Outputs      : 0 if successful test, -1 if failure
+
+int decode_SMSA_operation( SMSA_OPERATION *dop, uint32_t op, unsigned char *block ) {
+
+	/*
+	 * SMSA operation bit layout
+	 *
+	 * 	0-5		- command number (6-bits)
+	 * 	6-9		- drum identifier (4-bits)
+	 * 	10-31	- block address (22-bits, the high 14 are zero
+	 * 			  in the default geometry)
+	 *
+	 */
+
+	// Do the bit manipulations
+	dop->cmd = (op>>26);		// The type of operation being performed
+	dop->did = (op>>22)&0xf;	// This is the drum to be written to/read from
+	dop->bid = SMSA_BLOCKID(op);	// This is the block address to read/write
+
+	// Check for legal values
+	if ( dop->cmd >= SMSA_MAX_COMMAND ) {
+		logMessage( LOG_ERROR_LEVEL, "Decoded operation illegal [%lu->%u]", op, dop->cmd );
+		smsa_error_number = SMSA_BAD_OPCODE;
+		return( -1 );
+	}
+
+	// Check for legal disk
+	if ( dop->did >= smsa_geometry.drums ) {
+		logMessage( LOG_ERROR_LEVEL, "Decoded drum id illegal [%lu->%u]", op, dop->did );
+		smsa_error_number = SMSA_BAD_DRUM_ID;
+		return( -1 );
+	}
+
+	// Check for legal block address
+	if ( dop->bid >= smsa_geometry.blocks ) {
+		logMessage( LOG_ERROR_LEVEL, "Decoded block id illegal [%lu->%u]", op, dop->bid );
+		smsa_error_number = SMSA_BAD_BLOCK_ID;
+		return( -1 );
+	}
+
+	// Set the block for processing
+	if ( block != NULL ) {
+		dop->len = smsa_geometry.block_size;
+		dop->blk = block;
+	} else {
+		dop->len = 0;
+		dop->blk = NULL;
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : encode_SMSA_operation
+// Description  : This function encodes a disk operation in a buffer for
+//                passing to the disk layer.
+//
+// Inputs       : cmd - the command to be created
+//                did - the drum identifier
+//                bid - the block identifier
+// Outputs      : the encoded operation value or 0 on failure
+
+uint32_t encode_SMSA_operation( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+
+	// Check for legal command
+	if ( cmd >= SMSA_MAX_COMMAND ) {
 		logMessage( LOG_ERROR_LEVEL, "Encoding illegal operation  [%u]", cmd );
 		smsa_error_number = SMSA_BAD_OPCODE;
 		return( 0 );
 	}
 
 	// Check for legal disk
-	if ( did >= SMSA_DISK_ARRAY_SIZE ) {
+	if ( did >= smsa_geometry.drums ) {
 		logMessage( LOG_ERROR_LEVEL, "Encoding illegal drum id [%u]", did );
 		smsa_error_number = SMSA_BAD_DRUM_ID;
 		return( 0 );
 	}
 
 	// Check for legal block address
-	if ( bid >= SMSA_MAX_BLOCK_ID ) {
+	if ( bid >= smsa_geometry.blocks ) {
 		logMessage( LOG_ERROR_LEVEL, "Encoding illegal block id [%u]", bid );
 		smsa_error_number = SMSA_BAD_BLOCK_ID;
 		return( 0 );
@@ -701,35 +1960,182 @@ uint32_t encode_SMSA_operation( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BL
 	return( op );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_current
+// Description  : This function checks if a block holds data, it has to have
+//                been written since its drum was last formatted
+//
+// Inputs       : did - the drum identifier
+//                bid - the block identifier
+// Outputs      : 1 if the block holds data, 0 if it reads as zeros
+
+int block_current( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+
+	// Never written, or written in an older generation of the drum
+	if ( __atomic_load_n(&SMSA_EXTENT(did,bid), __ATOMIC_ACQUIRE) == NULL ) {
+		return( 0 );
+	}
+	return( (smsa_block_stamps[did] == NULL) ||
+		(__atomic_load_n(&smsa_block_stamps[did][bid], __ATOMIC_ACQUIRE) ==
+			__atomic_load_n(&smsa_drum_generation[did], __ATOMIC_ACQUIRE)) );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : block_address
-// Description  : This function calculates the address of a block
+// Description  : This function calculates the address of a block to read
+//                (the zero extent if the block holds no data)
 //
 // Inputs       : did - the drum identifier
 //                bid - the block identifier
 // Outputs      : the pointer to the block in memory
 
-unsigned char * block_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+const unsigned char * block_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+
+	// Get extent address, then add offset of the block in it
+	if ( ! block_current(did, bid) ) {
+		return( smsa_zero_extent );
+	}
+	return( SMSA_EXTENT(did,bid) + ((size_t)(bid & (SMSA_EXTENT_BLOCKS-1)) << smsa_geometry.block_shift) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_write_address
+// Description  : This function calculates the address of a block to write,
+//                allocating its extent if this is the first write to it and
+//                stamping it with the generation of the drum
+//
+// Inputs       : did - the drum identifier
+//                bid - the block identifier
+//                partial - the write keeps some of the block (so a block
+//                          from an older generation has to be zeroed)
+// Outputs      : the pointer to the block in memory, NULL if failure
+
+unsigned char * block_write_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, int partial ) {
+
+	// Local variables
+	unsigned char *ptr = __atomic_load_n( &SMSA_EXTENT(did,bid), __ATOMIC_ACQUIRE ), *ext;
+	SMSA_SIGNATURE_CACHE *ent;
+	uint32_t gen;
+
+	// Allocate the extent if needed, whoever installs one first wins
+	if ( ptr == NULL ) {
+		if ( (ext = calloc(1, SMSA_EXTENT_SIZE)) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Unable to allocate extent [%u/%u]", did, bid >> smsa_extent_shift );
+			return( NULL );
+		}
+		if ( __atomic_compare_exchange_n(&SMSA_EXTENT(did,bid), &ptr, ext, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+			__sync_fetch_and_add( &smsa_extent_count, 1 );
+			ptr = ext;
+		} else {
+			free( ext );
+		}
+	}
+	ptr += (size_t)(bid & (SMSA_EXTENT_BLOCKS-1)) << smsa_geometry.block_shift;
+
+	// Its signature is about to change (writers hold the drum alone)
+	if ( (smsa_signatures[did] != NULL) && ((ent = __atomic_load_n(&SMSA_SIGNATURES(did,bid), __ATOMIC_ACQUIRE)) != NULL) ) {
+		__atomic_store_n( &ent[bid & (SMSA_EXTENT_BLOCKS-1)].tag, 0, __ATOMIC_RELEASE );
+	}
 
-	// Get drum address, then add offset of
-	unsigned char *ptr = smsa_disk_array[did];
-	uint32_t offset = (bid*SMSA_BLOCK_SIZE);
-	ptr += offset;
+	// Catch the block up with the drum (zeroed if it is kept in part)
+	if ( smsa_block_stamps[did] != NULL ) {
+		gen = __atomic_load_n( &smsa_drum_generation[did], __ATOMIC_ACQUIRE );
+		if ( smsa_block_stamps[did][bid] != gen ) {
+			if ( partial ) {
+				memset( ptr, 0x0, smsa_geometry.block_size );
+			}
+			__atomic_store_n( &smsa_block_stamps[did][bid], gen, __ATOMIC_RELEASE );
+		}
+	}
 	return( ptr );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_signature
+// Description  : This function gets the signature of a block, from the
+//                cache if it has not been written since it was last signed.
+//                Signers share the drum, so the cache is filled with atomic
+//                stores (any two fill in the same signature).
+//
+// Inputs       : did - the drum identifier
+//                bid - the block identifier
+//                sig - where to put the signature
+//                slen - the size of sig (set to the signature length)
+// Outputs      : 0 if successful, -1 if failure
+
+int block_signature( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, unsigned char *sig, uint32_t *slen ) {
+
+	// Local variables
+	SMSA_SIGNATURE_CACHE *ent, *ext;
+	uint32_t words[SMSA_SIGNATURE_WORDS];
+	uint64_t tag;
+	int i;
+
+	// Sign it outright if there is no keeping the signature
+	if ( (smsa_signature_length == 0) || (*slen < smsa_signature_length) || (smsa_signatures[did] == NULL) ) {
+		return( generate_md5_signature((unsigned char *)block_address(did,bid), smsa_geometry.block_size, sig, slen) );
+	}
+
+	// Blocks that read as zeros all have the same signature
+	*slen = smsa_signature_length;
+	if ( ! block_current(did, bid) ) {
+		memcpy( sig, smsa_zero_signature, smsa_signature_length );
+		return( 0 );
+	}
+
+	// Find its entry, the first signature in an extent allocates them
+	if ( (ent = __atomic_load_n(&SMSA_SIGNATURES(did,bid), __ATOMIC_ACQUIRE)) == NULL ) {
+		if ( (ext = calloc(SMSA_EXTENT_BLOCKS, sizeof(SMSA_SIGNATURE_CACHE))) == NULL ) {
+			return( generate_md5_signature((unsigned char *)block_address(did,bid), smsa_geometry.block_size, sig, slen) );
+		}
+		if ( __atomic_compare_exchange_n(&SMSA_SIGNATURES(did,bid), &ent, ext, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+			ent = ext;
+		} else {
+			free( ext );
+		}
+	}
+	ent += bid & (SMSA_EXTENT_BLOCKS-1);
+
+	// Use it if signed in this generation, else sign and keep it
+	tag = SMSA_SIGNATURE_TAG( __atomic_load_n(&smsa_drum_generation[did], __ATOMIC_ACQUIRE) );
+	if ( __atomic_load_n(&ent->tag, __ATOMIC_ACQUIRE) == tag ) {
+		for ( i=0; i<SMSA_SIGNATURE_WORDS; i++ ) {
+			words[i] = __atomic_load_n( &ent->sig[i], __ATOMIC_RELAXED );
+		}
+		memcpy( sig, words, smsa_signature_length );
+		return( 0 );
+	}
+	if ( generate_md5_signature((unsigned char *)block_address(did,bid), smsa_geometry.block_size, sig, slen) ) {
+		return( -1 );
+	}
+	memset( words, 0x0, sizeof(words) );
+	memcpy( words, sig, smsa_signature_length );
+	for ( i=0; i<SMSA_SIGNATURE_WORDS; i++ ) {
+		__atomic_store_n( &ent->sig[i], words[i], __ATOMIC_RELAXED );
+	}
+	__atomic_store_n( &ent->tag, tag, __ATOMIC_RELEASE );
+	return( 0 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : opperation_cycle_cost
-// Description  : This function calculates the cycle cost of an operation
+// Description  : This function calculates the cycle cost of an operation.
+//                The physical heads are shared, so a session pays for moving
+//                them back to its own position if another moved them away.
 //
-// Inputs       : cmd - the operatio to perform
+// Inputs       : sess - the session performing the operation
+//                cmd - the operatio to perform
 //                did - the drum identifier
 //                bid - the block identifier
+//                count - the number of blocks (range commands)
 // Outputs      : the pointer to the block in memory
 
-int operation_cycle_cost( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid ) {
+int operation_cycle_cost( SMSA_SESSION *sess, SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count ) {
 
     // Local variables
     int cost = 0;
@@ -745,22 +2151,20 @@ int operation_cycle_cost( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID
 	    cost = 10000;
 	    break;
 
-	case SMSA_SEEK_DRUM: // See to a new drum
-	    cost = SMSA_DIFF(SMSA_ROW(smsa_drum_head),SMSA_ROW(did));
-            cost = SMSA_DIFF(SMSA_COL(smsa_drum_head),SMSA_COL(did));
-	    cost *= 1000;
+	case SMSA_SEEK_DRUM: // See to a new drum (the arm moves, not the read head)
+	    cost = arm_move_cost( did );
 	    break;
     
 	case SMSA_SEEK_BLOCK: // Seek to a disk address in the current drum
-	    cost = SMSA_DIFF(smsa_read_head,bid)*10;
+	    cost = head_move_cost( sess->drum, bid, 0 );
 	    break;
 
 	case SMSA_DISK_READ: // Read from the disk
-	    cost = 50;
+	    cost = head_move_cost( sess->drum, sess->block, 1 ) + 50;
 	    break;
 
 	case SMSA_DISK_WRITE: // Write to the disk
-	    cost = 200;
+	    cost = head_move_cost( sess->drum, sess->block, 1 ) + 200;
 	    break;
 
 	case SMSA_GET_STATE: // Get the current disk state (unimplemented)
@@ -773,9 +2177,20 @@ int operation_cycle_cost( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID
 	    break;
 
 	case SMSA_BLOCK_SIGN: // Generate a signature for a block (and output to log)
+	case SMSA_SIGN_RANGE: // Sign consecutive blocks (no head moves)
 	    cost = 0;
 	    break;
 
+	case SMSA_READ_RANGE: // Read consecutive blocks (seek there, then read)
+	case SMSA_WRITE_RANGE: // Write consecutive blocks (seek there, then write)
+	    cost = head_move_cost( did, bid, count );
+	    cost += count * ((cmd == SMSA_READ_RANGE) ? 50 : 200);
+	    break;
+
+	case SMSA_WRITE_AT: // Write bytes within a block (seek there, then write)
+	    cost = head_move_cost( did, bid, 1 ) + 200;
+	    break;
+
 	default: logMessage( LOG_ERROR_LEVEL, "OP Illegal disk command (cost) [%u]", cmd );
 	    cost = -1;
 	    break;
@@ -785,3 +2200,148 @@ int operation_cycle_cost( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID
     return( cost );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arm_move_cost
+// Description  : This function moves the arm over a drum, returning the cost
+//
+// Inputs       : did - the drum identifier
+// Outputs      : the cycles the move takes
+
+int arm_move_cost( SMSA_DRUM_ID did ) {
+
+    // Local variables
+    uint32_t from = __atomic_exchange_n( &smsa_arm_drum, did, __ATOMIC_RELAXED );
+    int cost;
+
+    cost = SMSA_DIFF(SMSA_ROW(from),SMSA_ROW(did));
+    cost = SMSA_DIFF(SMSA_COL(from),SMSA_COL(did));
+    return( cost * 1000 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : head_move_cost
+// Description  : This function brings the arm and the read head of a drum to
+//                a block, then past the blocks moved, returning the cost
+//
+// Inputs       : did - the drum identifier
+//                bid - the block identifier
+//                count - the blocks read or written there
+// Outputs      : the cycles the move takes
+
+int head_move_cost( SMSA_DRUM_ID did, uint32_t bid, uint32_t count ) {
+
+    // Local variables
+    uint32_t from;
+
+    // Nothing to move on a drum that is not there
+    if ( did >= SMSA_DISK_ARRAY_SIZE ) {
+	return( 0 );
+    }
+    from = __atomic_exchange_n( &smsa_arm_blocks[did], bid+count, __ATOMIC_RELAXED );
+    return( arm_move_cost(did) + SMSA_DIFF(from,bid)*10 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : operation_drum_lock
+// Description  : This function takes the lock of the drum an operation works
+//                on, shared if it only reads the drum (mounting and
+//                unmounting take all of them, seeks none)
+//
+// Inputs       : sess - the session performing the operation
+//                cmd - the operation to perform
+//                did - the drum identifier (of the ranged commands)
+// Outputs      : the lock taken, to pass to operation_drum_unlock
+
+int operation_drum_lock( SMSA_SESSION *sess, SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did ) {
+
+    // Local variables
+    int i, shared = 0;
+
+    // Work out the drum and how it is used
+    switch (cmd) {
+
+	case SMSA_MOUNT: // The whole array
+	case SMSA_UNMOUNT:
+	    for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
+		pthread_rwlock_wrlock( &smsa_drum_locks[i] );
+	    }
+	    return( SMSA_DISK_ARRAY_SIZE );
+
+	case SMSA_DISK_READ: // The drum under the session's head
+	    shared = 1;
+	case SMSA_DISK_WRITE:
+	case SMSA_FORMAT_DRUM:
+	    did = sess->drum;
+	    break;
+
+	case SMSA_BLOCK_SIGN: // The drum named in the op
+	case SMSA_READ_RANGE:
+	case SMSA_SIGN_RANGE:
+	    shared = 1;
+	case SMSA_WRITE_RANGE:
+	case SMSA_WRITE_AT:
+	    break;
+
+	default: // Nothing on the array
+	    return( -1 );
+    }
+
+    // Take the drum's lock (a bad drum fails without one)
+    if ( did >= SMSA_DISK_ARRAY_SIZE ) {
+	return( -1 );
+    }
+    if ( shared ) {
+	pthread_rwlock_rdlock( &smsa_drum_locks[did] );
+    } else {
+	pthread_rwlock_wrlock( &smsa_drum_locks[did] );
+    }
+    return( did );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : operation_drum_unlock
+// Description  : This function releases what operation_drum_lock took
+//
+// Inputs       : lock - the lock taken
+// Outputs      : none
+
+void operation_drum_unlock( int lock ) {
+
+    // Local variables
+    int i;
+
+    if ( lock == SMSA_DISK_ARRAY_SIZE ) {
+	for ( i=SMSA_DISK_ARRAY_SIZE-1; i>=0; i-- ) {
+	    pthread_rwlock_unlock( &smsa_drum_locks[i] );
+	}
+    } else if ( lock >= 0 ) {
+	pthread_rwlock_unlock( &smsa_drum_locks[lock] );
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_library_init
+// Description  : This function sets up the virtual hardware initial state
+//                (once, by whichever thread gets there first)
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_library_init( void ) {
+
+    // Local variables
+    int i;
+
+    smsa_mount_state  = 0;
+    smsa_error_number = SMSA_NO_ERROR;
+    memset( smsa_disk_array, 0x0, sizeof(smsa_disk_array) );
+    for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
+	pthread_rwlock_init( &smsa_drum_locks[i], NULL );
+    }
+}
+
@@ -15,14 +15,20 @@
 #include <stdint.h>
 
 // Defines
-#define SMSA_DISK_ARRAY_SIZE	16
-#define SMSA_DISK_SIZE			65536
-#define SMSA_BLOCK_SIZE			256
-#define SMSA_MAX_BLOCK_ID		(SMSA_DISK_SIZE/SMSA_BLOCK_SIZE)
+#define SMSA_DISK_ARRAY_SIZE	16	// Most drums (and the default)
+#define SMSA_DISK_SIZE			65536	// Default bytes in a drum
+#define SMSA_BLOCK_SIZE			256	// Default (and smallest) bytes in a block
+#define SMSA_MAX_BLOCK_ID		(SMSA_DISK_SIZE/SMSA_BLOCK_SIZE)	// Default blocks in a drum
+#define SMSA_MAX_DRUM_BLOCKS	(1<<22)	// Most blocks in a drum (the op word has 22 bits)
+#define SMSA_MAX_BLOCK_SIZE		16384	// Largest block (one range operation's worth)
+#define SMSA_MAX_RANGE_BLOCKS	64	// Most blocks moved by one range operation
+#define SMSA_MAX_RANGE_BYTES	(SMSA_MAX_RANGE_BLOCKS*SMSA_BLOCK_SIZE)	// Most bytes moved by one
+#define SMSA_SIGNATURE_SIZE		16	// Bytes in a block signature (the first of its digest)
+#define SMSA_MAX_SIGN_BLOCKS	(SMSA_MAX_RANGE_BYTES/SMSA_SIGNATURE_SIZE)	// Most blocks signed by one range operation
 #define SMSA_DISK_FILE 			"smsa_data.dat"
 
 // Workload related defines
-#define MAX_SMSA_VIRTUAL_ADDRESS (SMSA_DISK_ARRAY_SIZE*SMSA_DISK_SIZE)
+#define MAX_SMSA_VIRTUAL_ADDRESS ((uint64_t)smsa_geometry.drums << smsa_geometry.drum_shift)
 #define SMSA_WORKLOAD_READ	"READ"
 #define SMSA_WORKLOAD_WRITE	"WRITE"
 #define SMSA_WORKLOAD_MOUNT	"MOUNT"
@@ -33,7 +39,12 @@
 // Extracting op code definitions
 #define SMSA_OPCODE(op) (op >> 26)
 #define SMSA_DRUMID(op) ((op >> 22)&0xf)
-#define SMSA_BLOCKID(op) ((op & 0xff)
+#define SMSA_BLOCKID(op) ((op) & (SMSA_MAX_DRUM_BLOCKS-1))
+
+// A partial block write carries the byte offset in the block (2 bytes,
+// network order) ahead of the bytes, its argument is the number of bytes
+#define SMSA_WRITE_AT_HEADER 2
+#define SMSA_WRITE_AT_OFFSET(blk) ((uint16_t)(((blk)[0] << 8) | (blk)[1]))
 
 // Type definitions
 
@@ -41,7 +52,24 @@
 typedef unsigned char SMSA_DRUM_ID;
 
 // The drum address 
-typedef unsigned short SMSA_BLOCK_ID;
+typedef uint32_t SMSA_BLOCK_ID;
+
+// The geometry of the array, picked when the server starts (the defaults
+// above unless told otherwise) and handed to clients at mount
+typedef struct {
+	uint32_t	drums;		// Number of drums (up to SMSA_DISK_ARRAY_SIZE)
+	uint32_t	blocks;		// Blocks in a drum (a power of 2)
+	uint32_t	block_size;	// Bytes in a block (a power of 2)
+	uint32_t	block_shift;	// log2 of block_size
+	uint32_t	drum_shift;	// log2 of the bytes in a drum
+	uint32_t	range_blocks;	// Most blocks moved by one range operation
+} SMSA_GEOMETRY;
+
+// The heads of a session with the array, each client moves its own
+typedef struct {
+	SMSA_DRUM_ID	drum;		// The drum the session's head is on
+	uint32_t	block;		// The read position on the drum
+} SMSA_SESSION;
 
 // The operations the disk can perform
 typedef enum {
@@ -54,7 +82,11 @@ typedef enum {
 	SMSA_GET_STATE		= 6,  // Get the current disk state (UNIMPLEMENTED)
 	SMSA_FORMAT_DRUM	= 7,  // Format the current drum (zeros)
 	SMSA_BLOCK_SIGN		= 8,  // Generate a signature for a block (and output to log)
-	SMSA_MAX_COMMAND	= 9,  // The largest value of a command (+1)
+	SMSA_READ_RANGE		= 9,  // Read consecutive blocks starting at drum/block
+	SMSA_WRITE_RANGE	= 10, // Write consecutive blocks starting at drum/block
+	SMSA_WRITE_AT		= 11, // Write bytes within the block at drum/block
+	SMSA_SIGN_RANGE		= 12, // Sign consecutive blocks starting at drum/block (returning the signatures)
+	SMSA_MAX_COMMAND	= 13, // The largest value of a command (+1)
 } SMSA_DISK_COMMAND;
 
 // These are the disk error levels
@@ -76,19 +108,37 @@ typedef enum {
 
 //
 // Global data
-extern SMSA_ERROR_LEVEL smsa_error_number;
+extern __thread SMSA_ERROR_LEVEL smsa_error_number;
+extern char *smsa_disk_file;
+extern int smsa_disk_store;
+extern int smsa_disk_mmap;
+extern int smsa_checkpoint_interval;
+extern char *smsa_journal_file;
+extern SMSA_GEOMETRY smsa_geometry;
 //
 // Disk interface
 
 int smsa_operation( uint32_t op, unsigned char *block );
 	// This is the (*only*) interface to the disk array
 
+int smsa_operation_ex( uint32_t op, uint16_t arg, unsigned char *block );
+	// The same, for commands that take an argument (range block count)
+
+int smsa_session_operation( SMSA_SESSION *sess, uint32_t op, uint16_t arg, unsigned char *block );
+	// The same, moving the heads of a session (safe from many threads)
+
 int SMSABlockSign( SMSA_DRUM_ID drum, SMSA_BLOCK_ID block );
 	// Generate a signature for a particular block
 
 // 
 // Utility Functions
 
+int smsa_set_geometry( uint32_t drums, uint32_t blocks, uint32_t block_size );
+	// Change the geometry of the array (while it is not mounted)
+
+int smsa_journal_commit( void );
+	// Make the changes journaled so far durable (one sync for all of them)
+
 unsigned long smsa_get_cycle_count( void );
 	// Return the cycle count
 
@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+#  File          : smsa_bench.sh
+#  Description   : Runs the workloads against a local server and prints the
+#                  wall clock times side by side, either for each transport
+#                  or (-n) for each server engine as the number of
+#                  concurrent clients grows.  With -S the drums are also
+#                  spread over <shards> local server processes, standing
+#                  in for separate hosts, and with -R the reads over
+#                  <replicas> replicas of the server.
+#
+#  Usage         : ./smsa_bench.sh [-r <runs>] [-p <depth>] [-n <counts>] [-S <shards>] [-R <replicas>] [workload ...]
+#
+
+RUNS=3
+CLIENT_FLAGS=()
+COUNTS=
+SHARDS=
+REPLICAS=
+SOCK=/tmp/smsa_bench.$$.sock
+
+while getopts "r:p:n:S:R:" ch; do
+	case $ch in
+	r) RUNS=$OPTARG ;;
+	p) CLIENT_FLAGS+=(-p "$OPTARG") ;;
+	n) COUNTS=$OPTARG ;;
+	S) SHARDS=$OPTARG ;;
+	R) REPLICAS=$OPTARG ;;
+	*) echo "usage: $0 [-r <runs>] [-p <depth>] [-n <counts>] [-S <shards>] [-R <replicas>] [workload ...]"; exit 1 ;;
+	esac
+done
+shift $((OPTIND-1))
+if [ -n "$COUNTS" ]; then
+	COLUMNS=(epoll uring)
+	[ $# -eq 0 ] && set -- simple.dat
+else
+	COLUMNS=(tcp unix shm)
+	[ $# -eq 0 ] && set -- simple.dat linear.dat random.dat refloc.dat
+fi
+[ -n "$SHARDS" ] && COLUMNS+=(shard$SHARDS)
+[ -n "$REPLICAS" ] && COLUMNS+=(repl$REPLICAS)
+WORKLOADS=("$@")
+
+# Flags for each column, server side then client side
+server_flags() {
+	case $1 in
+	unix|shm) echo "-u $SOCK" ;;
+	uring)    echo "-i" ;;
+	esac
+}
+client_flags() {
+	case $1 in
+	unix)  echo "-u $SOCK" ;;
+	shm)   echo "-u $SOCK -s" ;;
+	shard*) echo "-m $(shard_map)" ;;
+	repl*)  echo "-m 0-15=$SOCK$(replica_list +)" ;;
+	esac
+}
+
+# The drums of shard <i>, and the client map covering all of them
+shard_drums() {
+	echo "$(( $1 * 16 / SHARDS ))-$(( ($1 + 1) * 16 / SHARDS - 1 ))"
+}
+shard_map() {
+	local i map=
+	for ((i = 0; i < SHARDS; i++)); do
+		map+="${map:+,}$(shard_drums $i)=$SOCK.$i"
+	done
+	echo $map
+}
+
+# The replica sockets, each after <sep>
+replica_list() {
+	local i
+	for ((i = 0; i < REPLICAS; i++)); do
+		echo -n "$1$SOCK.r$i"
+	done
+}
+
+# Start the server(s) for a column, setting SERVERS to their pids
+start_servers() {
+	local i
+	SERVERS=()
+	if [[ $1 == shard* ]]; then
+		for ((i = 0; i < SHARDS; i++)); do
+			rm -f smsa_data.$$.$i
+			./smsasvr -u $SOCK.$i -d $(shard_drums $i) -f smsa_data.$$.$i -b 1024 -l /dev/null & SERVERS+=($!)
+		done
+	elif [[ $1 == repl* ]]; then
+		for ((i = 0; i < REPLICAS; i++)); do
+			./smsasvr -u $SOCK.r$i -f smsa_data.$$.r$i -b 1024 -l /dev/null & SERVERS+=($!)
+		done
+		sleep 0.3
+		rm -f smsa_data.dat
+		./smsasvr -u $SOCK $(replica_list " -r ") -b 1024 -l /dev/null & SERVERS+=($!)
+	else
+		rm -f smsa_data.dat
+		./smsasvr $(server_flags $1) -b 1024 -l /dev/null & SERVERS+=($!)
+	fi
+	sleep 0.3
+}
+
+# Time a workload run by <clients> concurrent clients, best of RUNS, in ms
+run() {
+	local column=$1 wload=$2 clients=$3 best= i j start end ms pids
+	for ((i = 0; i < RUNS; i++)); do
+		start_servers $column
+		start=$(date +%s%N)
+		pids=()
+		for ((j = 0; j < clients; j++)); do
+			./smsaclt $(client_flags $column) "${CLIENT_FLAGS[@]}" -l /dev/null $wload & pids+=($!)
+		done
+		wait "${pids[@]}"
+		end=$(date +%s%N)
+		kill -INT "${SERVERS[@]}"; wait "${SERVERS[@]}" 2>/dev/null
+		ms=$(( (end - start) / 1000000 ))
+		if [ -z "$best" ] || [ $ms -lt $best ]; then best=$ms; fi
+	done
+	echo $best
+}
+
+# Print one table row per workload (and client count)
+printf "%-14s" "workload"
+[ -n "$COUNTS" ] && printf "%8s" "clients"
+for c in "${COLUMNS[@]}"; do printf "%10s" "$c(ms)"; done
+printf "\n"
+for w in "${WORKLOADS[@]}"; do
+	for n in ${COUNTS:-1}; do
+		printf "%-14s" "$w"
+		[ -n "$COUNTS" ] && printf "%8s" "$n"
+		for c in "${COLUMNS[@]}"; do printf "%10s" "$(run $c $w $n)"; done
+		printf "\n"
+	done
+done
+rm -f $SOCK $SOCK.* smsa_data.$$.*
@@ -11,22 +11,62 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 // Project Include Files
 #include <smsa_network.h>
+#include <smsa_shm.h>
 #include <smsa.h>
+#include <smsa_internal.h>
 
 // Global variables
-int server_socket = -1;
+int pipeline_depth = 0;				// Maximum requests in flight per server (0 = not pipelined)
+int pipeline_error = 0;				// Set if an in flight request failed
+int smsa_client_version = SMSA_NET_VERSION_2;	// Protocol to ask for at mount
+int smsa_client_encode = 1;			// Ask to send blocks encoded (protocol 2)
+unsigned char client_dbuf[SMSA_MAX_RANGE_BYTES]; // Decoded reply blocks
+int smsa_client_shm = 0;			// Move unix socket connections to shared memory rings
+int smsa_client_nodelay = 1;			// Send small frames at once (TCP_NODELAY)
+int smsa_client_cork = 0;			// Cork the TCP socket while a batch is written
+int smsa_client_connections = 1;		// Connections to each server, its drums striped over them
+SMSA_CLIENT_SHARD client_shards[SMSA_MAX_SHARDS]; // The servers the drums are spread over
+int client_nshards = 0;				// Number of servers (0 = the default one, set at mount)
+int client_striped = 0;				// Set once the connection pools are laid out
+SMSA_CLIENT_SHARD *client_route[SMSA_DISK_ARRAY_SIZE]; // The server owning each drum
+SMSA_CLIENT_SHARD client_replicas[SMSA_MAX_REPLICAS]; // Replicas of the servers, for reads
+int client_nreplicas = 0;			// Number of replicas
+SMSA_DRUM_ID client_drum = 0;			// The drum the head is on (where head relative ops go)
+int client_geometry_known = 0;			// A server told us the geometry of the array (this mount)
 
 // Functional Prototypes
-int client_connect();
-int client_disconnect();
-int send_packet( int, uint32_t, unsigned char * );
-int receive_packet( int, uint32_t *, int16_t *, unsigned char * ); 
+int client_send_op( SMSA_CLIENT_SHARD *, uint32_t, uint16_t, unsigned char * );
+int client_request( SMSA_CLIENT_SHARD *, uint32_t, uint16_t, unsigned char *, uint16_t, uint16_t );
+int client_replica_read( SMSA_CLIENT_SHARD *, uint32_t, uint16_t, unsigned char * );
+int client_track_head( SMSA_CLIENT_SHARD *, uint32_t, uint16_t );
+void client_track_seq( SMSA_CLIENT_SHARD *, uint32_t, int16_t );
+void client_stripe( void );
+int client_mount( SMSA_CLIENT_SHARD *, uint32_t );
+int client_geometry( unsigned char * );
+void client_shard_init( SMSA_CLIENT_SHARD *, char *, char *, int );
+int client_shard_endpoint( SMSA_CLIENT_SHARD *, char * );
+int client_connect( SMSA_CLIENT_SHARD * );
+int client_disconnect( SMSA_CLIENT_SHARD * );
+int client_attach_shm( SMSA_CLIENT_SHARD * );
+int send_packet( SMSA_CLIENT_SHARD *, uint32_t, uint16_t, uint32_t, uint16_t, uint16_t, unsigned char *, int );
+int receive_packet( SMSA_CLIENT_SHARD *, uint32_t *, int16_t *, uint32_t *, unsigned char ** );
+void release_packet( SMSA_CLIENT_SHARD * );
+int pipeline_operation( SMSA_CLIENT_SHARD *, uint32_t, uint16_t, unsigned char * );
+int pipeline_collect( SMSA_CLIENT_SHARD * );
+int client_send_flush( SMSA_CLIENT_SHARD * );
+int client_fill( SMSA_CLIENT_SHARD *, int );
+void client_reset_buffers( SMSA_CLIENT_SHARD * );
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -34,7 +74,7 @@ int receive_packet( int, uint32_t *, int16_t *, unsigned char * );
 // Description  : This the client operation that sends a request to the SMSA
 //                server.   It will:
 //
-//                1) if mounting make a connection to the server 
+//                1) if mounting make a connection to the server
 //                2) send any request to the server, returning results
 //                3) if unmounting, will close the connection
 //
@@ -43,29 +83,306 @@ int receive_packet( int, uint32_t *, int16_t *, unsigned char * );
 // Outputs      : 0 if successful, -1 if failure
 
 int smsa_client_operation( uint32_t op, unsigned char *block ) {
-	int16_t ret;
-	uint32_t rop;
+	return smsa_client_operation_ex( op, 0, block );		// No argument
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_client_operation_ex
+// Description  : This the client operation for commands that carry an
+// 		argument (the block count of the range commands), the
+// 		argument travels in the return field of the request.  When
+// 		the drums are spread over several servers the request goes
+// 		to the one owning its drum (the head's drum for head relative
+// 		commands), mount and unmount go to all of them.  Reads go to
+// 		a replica of that server, if it has any.
+//
+// Inputs       : op - the operation code for the command
+// 		  arg - the argument for the command
+//                block - the block(s) to be read/writen from
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_client_operation_ex( uint32_t op, uint16_t arg, unsigned char *block ) {
+	SMSA_CLIENT_SHARD *sh;
+	SMSA_DRUM_ID drum;
+	int cmd = SMSA_OPCODE(op), i, j, mounted = 0, ret = 0;
+
+	if ( cmd == SMSA_MOUNT ) {					// If mount, connect to every server
+		if ( client_nshards == 0 ) {				// Just the one server
+			client_shard_init( &client_shards[0], smsa_unix_path, SMSA_DEFAULT_IP, 0 );
+			for (i = 0; i < SMSA_DISK_ARRAY_SIZE; i++) {
+				client_route[i] = &client_shards[0];
+			}
+			client_nshards = 1;
+		}
+		if ( ! client_striped ) {				// Open the connection pools
+			client_stripe();
+			client_striped = 1;
+		}
+		pipeline_error = 0;
+		client_drum = 0;
+		client_geometry_known = 0;
+		for (i = 0; i < client_nshards; i++) {
+			if ( client_mount( &client_shards[i], op ) == -1 ) {
+				while ( i-- > 0 ) {			// Don't leave half of it mounted
+					client_disconnect( &client_shards[i] );
+					for (j = 0; j < client_shards[i].nreplicas; j++) {
+						if ( client_shards[i].replicas[j]->sock != -1 ) {
+							client_disconnect( client_shards[i].replicas[j] );
+						}
+					}
+				}
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if ( cmd == SMSA_UNMOUNT ) {					// If unmount, tell every server
+		for (i = 0; i < client_nshards; i++) {
+			sh = &client_shards[i];
+			if ( sh->sock == -1 ) {
+				continue;
+			}
+			mounted++;
+			if ( client_send_op( sh, op, arg, block ) == -1 ) {
+				ret = -1;
+			}
+			for (j = 0; j < sh->nreplicas; j++) {		// And its replicas
+				if ( sh->replicas[j]->sock != -1 ) {
+					client_request( sh->replicas[j], op, 0, NULL, 0, 0 );
+				}
+			}
+		}
+		return ( mounted > 0 ) ? ret : -1;			// Fail if nothing was mounted
+	}
 
-	if ( SMSA_OPCODE(op) == 0x0 ) {					// If mount
-		if ( (server_socket = client_connect()) == -1 ) {	// Connect to client
+	drum = client_drum;
+	if ( (cmd == SMSA_SEEK_DRUM) ||					// Commands naming a drum move the head
+			(cmd == SMSA_READ_RANGE) || (cmd == SMSA_WRITE_RANGE) || (cmd == SMSA_WRITE_AT) ) {
+		client_drum = drum = SMSA_DRUMID(op);
+	} else if ( (cmd == SMSA_BLOCK_SIGN) || (cmd == SMSA_SIGN_RANGE) ) {	// (signing leaves it where it is)
+		drum = SMSA_DRUMID(op);
+	}
+	if ( (sh = client_route[drum]) == NULL || sh->sock == -1 ) {
+		return -1;						// Not mounted
+	}
+
+	if ( sh->nreplicas > 0 ) {					// Reads may go to a replica
+		if ( client_replica_read( sh, op, arg, block ) == 0 ) {
+			return 0;
+		}
+		if ( client_track_head( sh, op, arg ) == -1 ) {
 			return -1;
 		}
 	}
 
-	if ( send_packet( server_socket, op, block ) == -1 ) {	// Send info to server
+	return client_send_op( sh, op, arg, block );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_send_op
+// Description  : This function sends a request to one server, queueing it if
+// 		pipelining.
+//
+// Inputs       : sh - the server to send it to
+// 		  op - the operation code for the command
+// 		  arg - the argument for the command
+//                block - the block(s) to be read/writen from
+// Outputs      : 0 (or what the server returned) if successful, -1 if failure
+
+int client_send_op( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg, unsigned char *block ) {
+	if ( pipeline_depth > 0 ) {					// If pipelining, queue the request
+		return pipeline_operation( sh, op, arg, block );
+	}
+
+	return client_request( sh, op, arg, block, 0, 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_replica_read
+// Description  : This function sends a read to the next replica of a server
+// 		as a read range (naming the block, the replica's head is not
+// 		the server's).  The replica only answers once it has applied
+// 		the newest write the server acknowledged to us, so a read
+// 		never misses our own writes.  A read that must follow writes
+// 		still in flight stays with the server.
+//
+// Inputs       : sh - the server the read is for
+// 		  op - the operation code for the command
+// 		  arg - the argument for the command
+//                block - the block(s) to read into
+// Outputs      : 0 if a replica answered, -1 if the server has to
+
+int client_replica_read( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg, unsigned char *block ) {
+	SMSA_CLIENT_SHARD *rep = NULL;
+	uint32_t drum, blk;
+	int i;
+
+	if ( SMSA_OPCODE(op) == SMSA_DISK_READ ) {			// Where the head is
+		drum = sh->head_drum;
+		blk = sh->head_block;
+		arg = 1;
+	} else if ( SMSA_OPCODE(op) == SMSA_READ_RANGE ) {		// Where it says
+		drum = SMSA_DRUMID(op);
+		blk = SMSA_BLOCKID(op);
+	} else {
+		return -1;
+	}
+	if ( sh->writes > 0 || sh->version < SMSA_NET_VERSION_2 || blk >= smsa_geometry.blocks ) {
 		return -1;
 	}
 
-	if ( receive_packet( server_socket, &rop, &ret, block ) == -1 ) { // Receive info from server
+	for (i = 0; i < sh->nreplicas && rep == NULL; i++) {		// Take turns
+		rep = sh->replicas[sh->next_replica];
+		sh->next_replica = (sh->next_replica + 1) % sh->nreplicas;
+		if ( rep->sock == -1 || rep->version < SMSA_NET_VERSION_2 ) {
+			rep = NULL;
+		}
+	}
+	if ( rep == NULL ) {
+		return -1;
+	}
+
+	if ( client_request( rep, encode_SMSA_operation(SMSA_READ_RANGE, drum, blk), arg, block, SMSA_NET_FLAG_AFTER, sh->seq ) != 0 ) {
+		return -1;						// Behind (or gone), ask the server
+	}
+
+	sh->head_drum = drum;						// Where the server's head would be
+	sh->head_block = blk + arg;
+	sh->moved = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_track_head
+// Description  : This function follows the head of a server with replicas,
+// 		so reads sent to a replica can say where they read.  When a
+// 		replica read moved the head, the server is told where it is
+// 		before a command relative to it.
+//
+// Inputs       : sh - the server
+// 		  op - the operation code of the command about to be sent
+// 		  arg - the argument of the command
+// Outputs      : 0 if successful, -1 if failure
+
+int client_track_head( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg ) {
+	int cmd = SMSA_OPCODE(op);
+
+	if ( sh->moved && (cmd == SMSA_SEEK_BLOCK || cmd == SMSA_DISK_READ || cmd == SMSA_DISK_WRITE ||
+			cmd == SMSA_FORMAT_DRUM || cmd == SMSA_GET_STATE) ) {
+		sh->moved = 0;						// Put the server's head there
+		if ( client_send_op( sh, encode_SMSA_operation(SMSA_SEEK_DRUM, sh->head_drum, 0), 0, NULL ) == -1 ) {
+			return -1;
+		}
+		if ( sh->head_block < smsa_geometry.blocks &&
+				client_send_op( sh, encode_SMSA_operation(SMSA_SEEK_BLOCK, 0, sh->head_block), 0, NULL ) == -1 ) {
+			return -1;
+		}
+	}
+
+	switch ( cmd ) {						// Where the command leaves it
+		case SMSA_SEEK_DRUM:
+			sh->head_drum = SMSA_DRUMID(op);
+			sh->head_block = 0;
+			break;
+		case SMSA_SEEK_BLOCK:
+			sh->head_block = SMSA_BLOCKID(op);
+			break;
+		case SMSA_DISK_READ:
+		case SMSA_DISK_WRITE:
+			sh->head_block++;
+			break;
+		case SMSA_FORMAT_DRUM:
+			sh->head_drum = 0;
+			sh->head_block = 0;
+			break;
+		case SMSA_READ_RANGE:
+		case SMSA_WRITE_RANGE:
+			sh->head_drum = SMSA_DRUMID(op);
+			sh->head_block = SMSA_BLOCKID(op) + arg;
+			break;
+		case SMSA_WRITE_AT:
+			sh->head_drum = SMSA_DRUMID(op);
+			sh->head_block = SMSA_BLOCKID(op) + 1;
+			break;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_track_seq
+// Description  : This function notes the replication sequence number a
+// 		server gave a write, the newest one is what replica reads
+// 		must follow (only its low 16 bits travel, compared modulo).
+//
+// Inputs       : sh - the server
+// 		  op - the operation code of the request answered
+// 		  ret - what the server returned
+// Outputs      : none
+
+void client_track_seq( SMSA_CLIENT_SHARD *sh, uint32_t op, int16_t ret ) {
+	if ( smsa_replicated_op( op ) && ret != -1 && (int16_t)(sh->rseq - sh->seq) > 0 ) {
+		sh->seq = sh->rseq;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_request
+// Description  : This function sends a request to one server and waits for
+// 		its reply.  A connection that fails is closed.
+//
+// Inputs       : sh - the server to send it to
+// 		  op - the operation code for the command
+// 		  arg - the argument for the command
+//                block - the block(s) to be read/writen from
+// 		  flags - the request flags (SMSA_NET_FLAG_AFTER)
+// 		  seq - the write a read must follow
+// Outputs      : what the server returned if successful, -1 if failure
+
+int client_request( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg, unsigned char *block, uint16_t flags, uint16_t seq ) {
+	unsigned char *data;
+	int16_t ret;
+	uint32_t rop, id, rid;
+	int rdbytes, rc;
+
+	id = sh->next_id++;
+	if ( send_packet( sh, op, arg, id, flags, seq, block, smsa_request_bytes( op, arg ) ) == -1 ||
+			(rc = receive_packet( sh, &rop, &ret, &rid, &data )) == -1 ) {
+		client_disconnect( sh );				// Send and receive info
 		return -1;
 	}
+	rdbytes = smsa_reply_bytes( op, arg );
+	if ( rc > 0 ) {							// Copy out what was read
+		if ( block == NULL || rc > rdbytes ) {
+			rc = -1;
+		} else {
+			memcpy( block, data, rc );
+		}
+	}
+	release_packet( sh );
 
-	if ( op != rop ) {						// Check if info received is the same
+	if ( rc == -1 || op != rop || id != rid ) {			// Check if info received is the same
 		return -1;
 	}
+	client_track_seq( sh, op, ret );
+
+	if ( SMSA_OPCODE(op) == SMSA_MOUNT && ret != -1 ) {		// The answer is the protocol granted
+		sh->version = ( (ret & SMSA_NET_VERSION_MASK) >= SMSA_NET_VERSION_2 ) ? SMSA_NET_VERSION_2 : SMSA_NET_VERSION_1;
+		sh->encoding = ( sh->version >= SMSA_NET_VERSION_2 ) && ( ret & SMSA_NET_FEATURE_ENCODE );
+		if ( (ret & SMSA_NET_FEATURE_GEOMETRY) && client_geometry( block ) == -1 ) {
+			return -1;					// (and the array laid out as it says)
+		}
+		ret = 0;
+	}
 
 	if ( SMSA_OPCODE(op) == SMSA_UNMOUNT ) {			// Check if unmount
-		if (client_disconnect() == -1) {			// Disconnect from server
+		if (client_disconnect( sh ) == -1) {			// Disconnect from server
 			return -1;
 		}
 	}
@@ -75,122 +392,741 @@ int smsa_client_operation( uint32_t op, unsigned char *block ) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_connect
-// Description  : This function will connect to a SMSA server at SMSA_DEFAUL_IP 
-// 		and SMSA_DEFAULT_PORT and return a socket for the connection.
+// Function     : client_mount
+// Description  : This function connects to one server and mounts the array
+// 		there, asking for the protocol (and encoding) to use.  Its
+// 		replicas are mounted too, reads just skip any that are down.
+//
+// Inputs       : sh - the server to mount
+// 		  op - the mount operation code
+// Outputs      : 0 if successful, -1 if failure
+
+int client_mount( SMSA_CLIENT_SHARD *sh, uint32_t op ) {
+	unsigned char geo[SMSA_NET_GEOMETRY_SIZE];
+	uint16_t arg = 0;
+	int i;
+
+	sh->version = SMSA_NET_VERSION_1;				// Until the server says otherwise
+	sh->encoding = 0;
+	if ( client_connect( sh ) == -1 ) {				// Connect to server
+		return -1;
+	}
+	sh->count = 0;							// Nothing in flight yet
+	memset( sh->busy, 0x0, sizeof(sh->busy) );
+	sh->next_id = sh->reply_id = 0;
+
+	if ( smsa_client_version > SMSA_NET_VERSION_1 ) {		// Ask for a protocol (encoding, geometry)
+		arg = smsa_client_version | ( smsa_client_encode ? SMSA_NET_FEATURE_ENCODE : 0 ) | SMSA_NET_FEATURE_GEOMETRY;
+	}
+	if ( client_request( sh, op, arg, geo, 0, 0 ) == -1 ) {
+		if ( sh->sock != -1 ) {
+			client_disconnect( sh );
+		}
+		return -1;
+	}
+	sh->seq = 0;							// Nothing written yet
+	sh->writes = 0;
+	sh->head_drum = 0;
+	sh->head_block = 0;
+	sh->moved = 0;
+
+	for (i = 0; i < sh->nreplicas; i++) {				// Reads go to the replicas that are up
+		if ( sh->replicas[i]->sock == -1 ) {			// (shared by a connection pool)
+			client_mount( sh->replicas[i], op );
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_geometry
+// Description  : This function takes up the geometry of the array a server
+// 		answered a mount with.  The first server of a mount sets it,
+// 		the others (and replicas) must agree.
+//
+// Inputs       : buf - the geometry from the mount reply
+// Outputs      : 0 if successful, -1 if failure
+
+int client_geometry( unsigned char *buf ) {
+	uint32_t drums, blocks, block_size;
+
+	smsa_unpack_geometry( buf, &drums, &blocks, &block_size );
+	if ( client_geometry_known ) {					// Check it against the first
+		if ( drums != smsa_geometry.drums || blocks != smsa_geometry.blocks ||
+				block_size != smsa_geometry.block_size ) {
+			return -1;
+		}
+		return 0;
+	}
+	if ( smsa_set_geometry( drums, blocks, block_size ) == -1 ) {	// Or lay the array out that way
+		return -1;
+	}
+	client_geometry_known = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_client_set_shards
+// Description  : This function spreads the drums over several servers.  The
+// 		map is a comma separated list of drum ranges and the server
+// 		owning them, a unix socket path or host[:port], e.g.
+// 		"0-7=/tmp/a.sock,8-15=127.0.0.1:16785".  Every drum must be
+// 		owned by exactly one server.  Replicas of a server follow it
+// 		after a '+' ("0-15=/tmp/p.sock+/tmp/r1.sock+/tmp/r2.sock").
+//
+// Inputs       : map - the shard map (taken apart in place)
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_client_set_shards( char *map ) {
+	SMSA_CLIENT_SHARD *sh;
+	char *entry, *endpoint, *replica, *save;
+	int first, last, i, n;
+
+	for (i = 0; i < client_nshards; i++) {				// Not while mounted
+		if ( client_shards[i].sock != -1 ) {
+			return -1;
+		}
+	}
+	client_nshards = client_nreplicas = client_striped = 0;
+	memset( client_route, 0x0, sizeof(client_route) );
+
+	for ( entry = strtok_r( map, ",", &save ); entry != NULL; entry = strtok_r( NULL, ",", &save ) ) {
+		if ( (endpoint = strchr( entry, '=' )) == NULL || client_nshards == SMSA_MAX_SHARDS ) {
+			return -1;
+		}
+		*endpoint++ = '\0';
+		if ( (n = sscanf( entry, "%d-%d", &first, &last )) == 1 ) {	// A single drum
+			last = first;
+		}
+		if ( n < 1 || first < 0 || last < first || last >= SMSA_DISK_ARRAY_SIZE ) {
+			return -1;
+		}
+
+		sh = &client_shards[client_nshards++];
+		if ( (replica = strchr( endpoint, '+' )) != NULL ) {	// Its replicas follow
+			*replica++ = '\0';
+		}
+		if ( client_shard_endpoint( sh, endpoint ) == -1 ) {
+			return -1;
+		}
+		while ( replica != NULL ) {
+			if ( client_nreplicas == SMSA_MAX_REPLICAS ) {
+				return -1;
+			}
+			endpoint = replica;
+			if ( (replica = strchr( endpoint, '+' )) != NULL ) {
+				*replica++ = '\0';
+			}
+			sh->replicas[sh->nreplicas] = &client_replicas[client_nreplicas++];
+			if ( client_shard_endpoint( sh->replicas[sh->nreplicas++], endpoint ) == -1 ) {
+				return -1;
+			}
+		}
+
+		for (i = first; i <= last; i++) {			// Route its drums to it
+			if ( client_route[i] != NULL ) {
+				return -1;				// Owned twice
+			}
+			client_route[i] = sh;
+		}
+	}
+
+	for (i = 0; i < SMSA_DISK_ARRAY_SIZE; i++) {			// Nothing left without a server
+		if ( client_route[i] == NULL ) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_stripe
+// Description  : This function lays out a pool of connections to each server,
+// 		dealing its drums over them in turn.  A drum always uses the
+// 		same connection (the server keeps the heads per connection),
+// 		so requests for one drum stay in order while different drums
+// 		proceed in parallel.  A pool shares the server's replicas.
 //
 // Inputs       : none
-// Outputs      : socket if successful, -1 if failure
+// Outputs      : none
+
+void client_stripe( void ) {
+	SMSA_CLIENT_SHARD *sh, *pool[SMSA_DISK_ARRAY_SIZE];
+	int servers = client_nshards, i, d, n, made;
+
+	for (i = 0; i < servers; i++) {
+		sh = &client_shards[i];
+		pool[0] = sh;
+		for (d = 0, n = 0, made = 1; d < SMSA_DISK_ARRAY_SIZE; d++) {
+			if ( client_route[d] != sh ) {
+				continue;
+			}
+			if ( n == made && made < smsa_client_connections ) {	// Another connection to it
+				pool[made] = &client_shards[client_nshards++];
+				client_shard_init( pool[made], sh->path, (sh->host[0] != '\0') ? sh->host : NULL, sh->port );
+				memcpy( pool[made]->replicas, sh->replicas, sizeof(sh->replicas) );
+				pool[made]->nreplicas = sh->nreplicas;
+				made++;
+			}
+			client_route[d] = pool[n];
+			n = (n + 1) % smsa_client_connections;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_shard_endpoint
+// Description  : This function sets up the state for a server given as a
+// 		unix socket path (it has a '/') or host[:port].
+//
+// Inputs       : sh - the server state
+// 		  endpoint - where the server is (taken apart in place)
+// Outputs      : 0 if successful, -1 if failure
+
+int client_shard_endpoint( SMSA_CLIENT_SHARD *sh, char *endpoint ) {
+	char *colon;
+	int port = 0;							// (the -P port, when not given)
+
+	if ( strchr( endpoint, '/' ) != NULL ) {			// A unix socket
+		client_shard_init( sh, endpoint, NULL, 0 );
+		return 0;
+	}
+
+	if ( (colon = strchr( endpoint, ':' )) != NULL ) {		// A TCP server
+		*colon = '\0';
+		if ( sscanf( colon+1, "%d", &port ) != 1 ) {
+			return -1;
+		}
+	}
+	client_shard_init( sh, NULL, (*endpoint != '\0') ? endpoint : SMSA_DEFAULT_IP, port );
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_shard_init
+// Description  : This function sets up the (not yet connected) state for one
+// 		server.
+//
+// Inputs       : sh - the server state
+// 		  path - the unix socket of the server (NULL for TCP)
+// 		  host - the address of the server (TCP)
+// 		  port - the port of the server (TCP, 0 for smsa_tcp_port)
+// Outputs      : none
+
+void client_shard_init( SMSA_CLIENT_SHARD *sh, char *path, char *host, int port ) {
+	memset( sh, 0x0, sizeof(SMSA_CLIENT_SHARD) );
+	sh->path = path;
+	if ( host != NULL ) {
+		strncpy( sh->host, host, sizeof(sh->host)-1 );
+	}
+	sh->port = port;
+	sh->sock = -1;
+	sh->doorbell = -1;
+	sh->version = SMSA_NET_VERSION_1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_client_set_pipeline
+// Description  : This function sets how many requests the client may have in
+// 		flight at once.  With a depth of 0 every operation waits for its
+// 		reply before returning (the default).
+//
+// Inputs       : depth - the maximum number of outstanding requests
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_client_set_pipeline( int depth ) {
+	if ( depth < 0 || depth > SMSA_MAX_PIPELINE_DEPTH ) {		// Check boundaries
+		return -1;
+	}
+
+	if ( smsa_client_flush() == -1 ) {				// Don't strand anything in flight
+		return -1;
+	}
 
-int client_connect() {
+	pipeline_depth = depth;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pipeline_operation
+// Description  : This function sends a request without waiting for its reply.
+// 		Each request in flight holds a slot, which its reply finds by
+// 		request id (protocol 2, in any order) or by coming next
+// 		(protocol 1, in order).  A read waits only for its own reply, an
+// 		unmount for all of them.
+//
+// Inputs       : sh - the server to send it to
+// 		  op - the operation code for the command
+// 		  arg - the argument for the command
+//                block - the block(s) to be read/writen from
+// Outputs      : 0 (or the read result) if successful, -1 if failure
+
+int pipeline_operation( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg, unsigned char *block ) {
+	int ret, slot, rdbytes = smsa_reply_bytes( op, arg );
+
+	if ( sh->count == pipeline_depth ) {				// Make room for the request
+		if ( pipeline_collect( sh ) == -1 ) {
+			return -1;
+		}
+	}
+	for (slot = 0; sh->busy[slot]; slot++);				// Take a free slot
+
+	sh->ids[slot] = sh->next_id++;
+	if ( send_packet( sh, op, arg, sh->ids[slot], 0, 0, block, smsa_request_bytes( op, arg ) ) == -1 ) {
+		return -1;						// Send info to server
+	}
+	sh->busy[slot] = 1;						// Remember where the reply goes
+	sh->ops[slot] = op;
+	sh->blocks[slot] = block;
+	sh->sizes[slot] = rdbytes;
+	sh->count++;
+	if ( smsa_replicated_op( op ) ) {				// Replica reads wait for these
+		sh->writes++;
+	}
+
+	if ( SMSA_OPCODE(op) == SMSA_UNMOUNT ) {			// Check if unmount
+		if ( (ret = smsa_client_flush()) == 0 && client_disconnect( sh ) == -1 ) {
+			return -1;					// Disconnect from server
+		}
+		return ret;
+	}
+
+	if ( rdbytes == 0 ) {
+		return 0;						// Nobody is waiting on this one
+	}
+
+	while ( sh->busy[slot] ) {					// Wait for the result
+		if ( pipeline_collect( sh ) == -1 ) {
+			return -1;
+		}
+	}
+
+	if ( pipeline_error ) {						// Report (and clear) any failure
+		pipeline_error = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pipeline_collect
+// Description  : This function receives one reply from a server and settles
+// 		the request in flight it belongs to.
+//
+// Inputs       : sh - the server to receive from
+// Outputs      : 0 if successful, -1 if failure (the connection is unusable)
+
+int pipeline_collect( SMSA_CLIENT_SHARD *sh ) {
+	unsigned char *data;
+	uint32_t rop, id;
+	int16_t ret;
+	int len, slot;
+
+	if ( (len = receive_packet( sh, &rop, &ret, &id, &data )) == -1 ) {
+		sh->count = sh->writes = 0;				// Connection is unusable
+		memset( sh->busy, 0x0, sizeof(sh->busy) );
+		return -1;
+	}
+
+	for (slot = 0; slot < SMSA_MAX_PIPELINE_DEPTH; slot++) {	// Find whose reply it is
+		if ( sh->busy[slot] && sh->ids[slot] == id ) {
+			break;
+		}
+	}
+	if ( slot == SMSA_MAX_PIPELINE_DEPTH ) {			// Nobody asked for it
+		release_packet( sh );
+		sh->count = sh->writes = 0;
+		memset( sh->busy, 0x0, sizeof(sh->busy) );
+		return -1;
+	}
+
+	if ( rop != sh->ops[slot] || ret == -1 ) {			// Check if info received is the same
+		pipeline_error = 1;
+	}
+	if ( len > 0 ) {						// Copy out what was read
+		if ( sh->blocks[slot] == NULL || len > sh->sizes[slot] ) {
+			pipeline_error = 1;
+		} else {
+			memcpy( sh->blocks[slot], data, len );
+		}
+	}
+	release_packet( sh );
+	if ( smsa_replicated_op( sh->ops[slot] ) ) {
+		client_track_seq( sh, sh->ops[slot], ret );
+		sh->writes--;
+	}
+
+	sh->busy[slot] = 0;
+	sh->count--;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_client_flush
+// Description  : This function collects the replies for every request still in
+// 		flight, on every server.  A failure of any of them is reported
+// 		here.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_client_flush( void ) {
+	int i;
+
+	for (i = 0; i < client_nshards; i++) {				// Collect every reply
+		while ( client_shards[i].count > 0 ) {
+			if ( pipeline_collect( &client_shards[i] ) == -1 ) {
+				return -1;
+			}
+		}
+	}
+
+	if ( pipeline_error ) {						// Report (and clear) any failure
+		pipeline_error = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_connect
+// Description  : This function will connect to a SMSA server at its address
+// 		and port (or its unix socket, when it has one).
+//
+// Inputs       : sh - the server to connect to
+// Outputs      : 0 if successful, -1 if failure
+
+int client_connect( SMSA_CLIENT_SHARD *sh ) {
 	int sock;
 	struct sockaddr_in my_struct;
+	struct sockaddr_un my_unix;
+
+	// Same host, skip the TCP/IP stack
+	if ( sh->path != NULL ) {
+		memset( &my_unix, 0x0, sizeof(my_unix) );
+		my_unix.sun_family = AF_UNIX;
+		strncpy( my_unix.sun_path, sh->path, sizeof(my_unix.sun_path)-1 );
+		if ( ( sock = socket(AF_UNIX, SOCK_STREAM, 0) ) == -1 ) {
+			return -1;
+		}
+		if ( connect( sock, (const struct sockaddr *) &my_unix, sizeof(my_unix) ) == -1 ) {
+			close( sock );
+			return -1;
+		}
+		sh->sock = sock;
+		client_reset_buffers( sh );
+		sh->tcp = 0;
+		if ( smsa_client_shm && client_attach_shm( sh ) == -1 ) {	// Move to the rings
+			close( sock );
+			sh->sock = -1;
+			return -1;
+		}
+		return 0;
+	}
 
 	// Prepare connection information
 	my_struct.sin_family = AF_INET;
-	my_struct.sin_port = htons(SMSA_DEFAULT_PORT);
-	if ( inet_aton( (char *) SMSA_DEFAULT_IP, &(my_struct.sin_addr) ) == 0 ) {
+	my_struct.sin_port = htons( (sh->port > 0) ? sh->port : smsa_tcp_port );
+	if ( inet_aton( sh->host, &(my_struct.sin_addr) ) == 0 ) {
 		return -1;
 	}
-	
+
 	// Receive a proper socket
 	if ( ( sock = socket(AF_INET, SOCK_STREAM, 0) ) == -1 ) {
 		return -1;
 	}
-	
+
 	// Send prepared information to server and establish a connection
 	if ( connect( sock, (const struct sockaddr *) &my_struct, sizeof(struct sockaddr) ) == -1 ) {
+		close( sock );
+		return -1;
+	}
+
+	// Frames are batched here, so Nagle only adds delay
+	if ( setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &smsa_client_nodelay, sizeof(int) ) == -1 ) {
+		close( sock );
 		return -1;
 	}
+	sh->sock = sock;
+	client_reset_buffers( sh );
+	sh->tcp = 1;
 
-	return sock;
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_disconnect
-// Description  : This function will disconnect the client from the server
-// 			using the server_socket socket.
+// Function     : client_attach_shm
+// Description  : This function moves a unix socket connection onto shared
+// 		memory rings.  The segment and the doorbell that wakes the
+// 		server are passed over the socket, which afterwards only
+// 		tells each side the other is still there.
 //
-// Inputs       : none
+// Inputs       : sh - the server connection
 // Outputs      : 0 if successful, -1 if failure
 
-int client_disconnect() {
-	if (close( server_socket ) == -1) {	// Close the server connection
+int client_attach_shm( SMSA_CLIENT_SHARD *sh ) {
+	SMSA_SHM_SEGMENT *seg;
+	int fds[2], attached;
+	unsigned char hdr[SMSA_NET_HEADER_SIZE];
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	uint16_t len = htons(SMSA_NET_HEADER_SIZE), arg = 0;
+	uint32_t op = htonl(SMSA_NET_SHM_ATTACH), rop, rid;
+	int16_t ret;
+
+	if ( (seg = smsa_shm_create( &fds[0] )) == NULL ) {		// Make the rings
+		return -1;
+	}
+	if ( (fds[1] = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC )) == -1 ) {
+		smsa_shm_unmap( seg );
+		close( fds[0] );
+		return -1;
+	}
+
+	memcpy( &hdr[0], &len, 2 );					// The attach request
+	memcpy( &hdr[2], &op, 4 );
+	memcpy( &hdr[6], &arg, 2 );
+	iov.iov_base = hdr;
+	iov.iov_len = SMSA_NET_HEADER_SIZE;
+	memset( &msg, 0x0, sizeof(msg) );				// Carrying both handles
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR( &msg );
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy( CMSG_DATA(cmsg), fds, sizeof(fds) );
+
+	attached = sendmsg( sh->sock, &msg, 0 ) == SMSA_NET_HEADER_SIZE &&	// Send it, wait for the answer
+		receive_packet( sh, &rop, &ret, &rid, NULL ) == 0 && rop == SMSA_NET_SHM_ATTACH && ret == 0;
+	release_packet( sh );
+	close( fds[0] );						// The mapping stays
+	if ( ! attached ) {
+		smsa_shm_unmap( seg );
+		close( fds[1] );
 		return -1;
 	}
-	server_socket = -1;			// Good Practice
 
+	sh->shm = seg;
+	sh->doorbell = fds[1];
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_disconnect
+// Description  : This function will disconnect the client from a server.
+//
+// Inputs       : sh - the server connection
+// Outputs      : 0 if successful, -1 if failure
+
+int client_disconnect( SMSA_CLIENT_SHARD *sh ) {
+	int rc = 0;
+
+	if ( sh->shm != NULL ) {		// Drop the rings
+		smsa_shm_unmap( sh->shm );
+		close( sh->doorbell );
+		sh->shm = NULL;
+		sh->doorbell = -1;
+	}
+	if (close( sh->sock ) == -1) {		// Close the server connection
+		rc = -1;
+	}
+	sh->sock = -1;				// Good Practice
+	sh->count = sh->writes = 0;
+	client_reset_buffers( sh );		// Nothing carries over
+
+	return rc;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : send_packet
-// Description  : This function will send 
+// Description  : This function will send a request to a server.  On a
+// 		socket the frame is only queued, the queue goes out in one
+// 		writev when a reply is needed (see client_send_flush).
 //
-// Inputs       : int sock - socket to the server connection.
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
 // 		  uint32_t op - opcode of the operation to be sent.
-// 		  unsigned char *block - block to be sent to the server.
+// 		  uint16_t arg - argument of the operation (in the return field).
+// 		  uint32_t id - the request id (protocol 2 only).
+// 		  uint16_t flags - the request flags (protocol 2 only).
+// 		  uint16_t seq - the write a read must follow (protocol 2 only).
+// 		  unsigned char *block - block(s) to be sent to the server.
+// 		  int blkbytes - how many bytes of block to send (0 for none).
 // Outputs      : 0 if successful, -1 if failure
 
-int send_packet( int sock, uint32_t op, unsigned char *block ) {
-	uint16_t len;			// Length of our package
-	unsigned char hdr[264];		// To store package data
-	uint16_t ret = 0;
+int send_packet( SMSA_CLIENT_SHARD *sh, uint32_t op, uint16_t arg, uint32_t id, uint16_t flags, uint16_t seq, unsigned char *block, int blkbytes ) {
+	uint16_t len;				// Length of our package
+	unsigned char *hdr;
+	int hdrlen = SMSA_NET_HEADER_BYTES(sh->version), enclen;
 
-	len = SMSA_NET_HEADER_SIZE;	// Initialize package to be only HDR size (8)
+	if ( sh->shm != NULL ) {		// Build it right in a request slot
+		while ( (hdr = smsa_ring_slot( &sh->shm->requests )) == NULL ) {
+			if ( smsa_client_flush() == -1 ) {	// Full, only while pipelined
+				return -1;
+			}
+		}
+	} else {
+		if ( sh->nsend == SMSA_MAX_PIPELINE_DEPTH ||	// Make room in the queue
+				((pipeline_depth > 0 || sh->encoding) && sh->slen + blkbytes > SMSA_CONN_BUFFER_SIZE) ) {
+			if ( client_send_flush( sh ) == -1 ) {
+				return -1;
+			}
+		}
+		hdr = sh->hdrs[sh->nsend];
 
-	if ( block != NULL ) {		// If we are using the block i.e. writing
-		len += SMSA_BLOCK_SIZE; // Then increase the length of the package
+		if ( sh->encoding && blkbytes > 0 &&		// Encode it, if that is shorter
+				(enclen = smsa_encode_blocks( &sh->sbuf[sh->slen], block, blkbytes )) != -1 ) {
+			block = &sh->sbuf[sh->slen];
+			blkbytes = enclen;
+			sh->slen += enclen;
+			flags |= SMSA_NET_FLAG_ENCODED;
+		}
 	}
-	
+
+	len = hdrlen + blkbytes;		// Header (8, or 16) plus whatever we are writing
+
 	// Put data in network format
 	len = htons(len);
 	op = htonl(op);
-	ret = htons(ret);
+	arg = htons(arg);
+	id = htonl(id);
+	seq = htons(seq);
 
 	// Copy the data into the array were sending
 	memcpy( &hdr[0], &len, 2);
 	memcpy( &hdr[2], &op, 4);
-	memcpy( &hdr[6], &ret, 2);
-
-	if ( block != NULL ) {					// If we are using the block
-		memcpy( &hdr[8], block, SMSA_BLOCK_SIZE );	// Copy the block into our array
+	memcpy( &hdr[6], &arg, 2);
+	if ( hdrlen > SMSA_NET_HEADER_SIZE ) {	// Protocol 2 id, flags and sequence number
+		memcpy( &hdr[8], &id, 4);
+		len = htons(flags);
+		memcpy( &hdr[12], &len, 2);
+		memcpy( &hdr[14], &seq, 2);
+	}
 
-		if( write(sock, &hdr[0], 264) == -1) {
-			return -1;
+	if ( sh->shm != NULL ) {				// Hand it to the server
+		if ( blkbytes > 0 ) {
+			memcpy( &hdr[hdrlen], block, blkbytes );	// Copy the block into the slot
 		}
+		smsa_ring_publish( &sh->shm->requests, sh->doorbell );
 		return 0;
 	}
 
-	if ( write(sock, &hdr[0], 8) == -1) {
-		return -1;
+	sh->iov[sh->niov].iov_base = hdr;			// Queue the header
+	sh->iov[sh->niov++].iov_len = hdrlen;
+	sh->nsend++;
+	if ( blkbytes > 0 ) {					// And the block
+		if ( pipeline_depth > 0 && !(flags & SMSA_NET_FLAG_ENCODED) ) {	// The caller moves on before it goes out
+			memcpy( &sh->sbuf[sh->slen], block, blkbytes );
+			block = &sh->sbuf[sh->slen];
+			sh->slen += blkbytes;
+		}
+		sh->iov[sh->niov].iov_base = block;
+		sh->iov[sh->niov++].iov_len = blkbytes;
 	}
 
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_send_flush
+// Description  : This function writes the queued frames to a server with
+// 		as few writev calls as the socket allows, corked (if asked)
+// 		so a batch leaves in full segments.
+//
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
+// Outputs      : 0 if successful, -1 if failure
+
+int client_send_flush( SMSA_CLIENT_SHARD *sh ) {
+	struct iovec *iov = sh->iov;
+	int niov = sh->niov, on = 1, off = 0, rc = 0;
+	ssize_t n;
+
+	if ( sh->niov == 0 ) {					// Nothing queued
+		return 0;
+	}
+
+	if ( sh->tcp && smsa_client_cork ) {			// Hold partial segments back
+		setsockopt( sh->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on) );
+	}
+
+	while ( niov > 0 ) {
+		if ( (n = writev( sh->sock, iov, niov )) == -1 ) {
+			rc = -1;
+			break;
+		}
+		while ( niov > 0 && (size_t) n >= iov->iov_len ) {	// Skip what went out
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if ( niov > 0 ) {				// Partly written
+			iov->iov_base = (unsigned char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	if ( sh->tcp && smsa_client_cork ) {			// Push out the tail
+		setsockopt( sh->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off) );
+	}
+
+	sh->niov = sh->nsend = sh->slen = 0;
+	return rc;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : receive_packet
-// Description  : This function will receive the data from the server
+// Description  : This function will receive the next reply from a server,
+// 		leaving it where it is until release_packet.  On a socket
+// 		replies are parsed out of the receive buffer, which each read
+// 		fills with as much as has arrived (often several replies).
 //
-// Inputs       : int sock - socket used for connection.
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
 // 		  uint32_t *op - opcode to be received. (by reference)
 // 		  int16_t *ret - what the server returns. (by reference)
-// 		  unsigned char *block - The block to be received rom the server.
-// 		  			(if needed)
-// Outputs      : 0 if successful, -1 if failure
+// 		  uint32_t *id - the id of the request answered. (by reference)
+// 		  unsigned char **data - set to the block(s) received (if wanted)
+// Outputs      : number of block bytes received if successful, -1 if failure
 
-int receive_packet( int sock, uint32_t *op, int16_t *ret, unsigned char *block ) {
-	uint16_t len;					// To store the length
-	unsigned char hdr[SMSA_NET_HEADER_SIZE];	// To store the received array
-	
+int receive_packet( SMSA_CLIENT_SHARD *sh, uint32_t *op, int16_t *ret, uint32_t *id, unsigned char **data ) {
+	uint16_t len, flags = 0;			// To store the length
+	unsigned char *hdr;
+	int hdrlen = SMSA_NET_HEADER_BYTES(sh->version), rc;
 
-	// Receive data into our array from the server
-	if ( read( sock, &hdr[0], SMSA_NET_HEADER_SIZE ) == -1 ) {
-		return -1;
+	if ( sh->shm != NULL ) {				// The reply sits in a slot
+		if ( (hdr = smsa_ring_wait( &sh->shm->responses, sh->sock )) == NULL ) {
+			return -1;
+		}
+	} else {
+		if ( client_send_flush( sh ) == -1 ) {		// The server needs the requests first
+			return -1;
+		}
+		if ( client_fill( sh, hdrlen ) == -1 ) {	// Get at least a header
+			return -1;
+		}
+		hdr = &sh->rbuf[sh->rpos];
 	}
 
 	// Decompose the array into the needed variables and put in network format
@@ -200,13 +1136,108 @@ int receive_packet( int sock, uint32_t *op, int16_t *ret, unsigned char *block )
 	*op = ntohl( *op );
 	memcpy( ret, &hdr[6], 2);
 	*ret = ntohs(*ret);
+	if ( hdrlen > SMSA_NET_HEADER_SIZE ) {			// Protocol 2 says which request
+		memcpy( id, &hdr[8], 4);
+		*id = ntohl( *id );
+		memcpy( &flags, &hdr[12], 2);
+		flags = ntohs( flags );
+		memcpy( &sh->rseq, &hdr[14], 2);		// (and where a write falls in replication)
+		sh->rseq = ntohs( sh->rseq );
+	} else {						// Protocol 1 answers in order
+		*id = sh->reply_id;
+		sh->rseq = 0;
+	}
 
-	if ( len > SMSA_NET_HEADER_SIZE ) {				// If len is larger than 8 (i.e. read) then we must
-		if ( read( sock, &block[0], SMSA_BLOCK_SIZE ) == -1 ) {	// Obtain the block too
+	if ( len < hdrlen || len > SMSA_NET_MAX_PACKET ) {	// Garbled stream
+		return -1;
+	}
+
+	if ( sh->shm == NULL ) {				// Get the rest of the frame
+		if ( client_fill( sh, len ) == -1 ) {
 			return -1;
 		}
-		return 0;
+		hdr = &sh->rbuf[sh->rpos];			// The fill may have moved it
+	}
+
+	if ( hdrlen == SMSA_NET_HEADER_SIZE ) {
+		sh->reply_id++;
+	}
+	sh->rframe = len;					// Held until released
+	if ( data != NULL ) {
+		*data = &hdr[hdrlen];
+	}
+	if ( flags & SMSA_NET_FLAG_ENCODED ) {			// Expand encoded blocks
+		if ( (rc = smsa_decode_blocks( client_dbuf, sizeof(client_dbuf), &hdr[hdrlen], len - hdrlen )) == -1 ) {
+			return -1;
+		}
+		if ( data != NULL ) {
+			*data = client_dbuf;
+		}
+		return rc;
+	}
+	return len - hdrlen;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_packet
+// Description  : This function is done with the reply receive_packet found,
+// 		giving its slot or buffer space back.
+//
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
+// Outputs      : none
+
+void release_packet( SMSA_CLIENT_SHARD *sh ) {
+	if ( sh->rframe == 0 ) {				// Nothing held
+		return;
+	}
+	if ( sh->shm != NULL ) {				// Done with the slot
+		smsa_ring_consume( &sh->shm->responses );
+	} else if ( (sh->rpos += sh->rframe) == sh->rlen ) {	// Done with the frame
+		sh->rpos = sh->rlen = 0;
+	}
+	sh->rframe = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_fill
+// Description  : This function will keep reading until the receive buffer
+// 		holds at least need unparsed bytes.  Each read takes whatever
+// 		has arrived, so one system call usually covers several replies.
+//
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
+// 		  int need - number of unparsed bytes wanted.
+// Outputs      : 0 if successful, -1 if failure
+
+int client_fill( SMSA_CLIENT_SHARD *sh, int need ) {
+	int n;
+
+	while ( sh->rlen - sh->rpos < need ) {
+		if ( sh->rpos + need > SMSA_CONN_BUFFER_SIZE ) {	// Move the partial frame to the front
+			memmove( sh->rbuf, &sh->rbuf[sh->rpos], sh->rlen - sh->rpos );
+			sh->rlen -= sh->rpos;
+			sh->rpos = 0;
+		}
+		if ( (n = read( sh->sock, &sh->rbuf[sh->rlen], SMSA_CONN_BUFFER_SIZE - sh->rlen )) <= 0 ) {
+			return -1;					// Error or closed connection
+		}
+		sh->rlen += n;
 	}
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_reset_buffers
+// Description  : This function empties the framing buffers for a new (or a
+// 		closed) connection.
+//
+// Inputs       : SMSA_CLIENT_SHARD *sh - the server connection.
+// Outputs      : none
+
+void client_reset_buffers( SMSA_CLIENT_SHARD *sh ) {
+	sh->rpos = sh->rlen = sh->rframe = 0;
+	sh->niov = sh->nsend = sh->slen = 0;
+}
@@ -14,6 +14,7 @@
 #include <smsa_driver.h>
 #include <cmpsc311_log.h>
 #include <stdio.h> // not sure if needed
+#include <string.h>
 #include <smsa_network.h>
 
 // Defines
@@ -94,74 +95,54 @@ int smsa_vread( SMSA_VIRTUAL_ADDRESS addr, uint32_t len, unsigned char *buf ) {
        	if ( (off = get_current_offset( addr ) ) == -1) {
 		return -1;
 	}
-	int indc;							// An indicator for previous operation caching.
-									// 0 for cached 1 for no cache
 
-
-	// *Take care of edge case*
+	unsigned char run[SMSA_MAX_RANGE_BYTES];			// Blocks fetched by one range read
+	int bs = smsa_geometry.block_size;
 	unsigned char *tptr = NULL;
-	tptr = smsa_get_cache_line(drm, blk);				// Look if the entry is cached
-
-	if (tptr == NULL) {						// If it isn't
-		smsa_client_operation(get_opcode(0x2, drm, blk), NULL);	// Seek drum
-		smsa_client_operation(get_opcode(0x3, drm, blk), NULL);	// Seek block
-
-		tptr = malloc(256);					// Request Heap memory
-		smsa_client_operation(get_opcode(0x4, drm, blk), tptr); 	// Read into temp -> Will seek to next blk
-		smsa_put_cache_line(drm, blk, tptr);			// Cache the data
-		indc = 1;						// Update indicator for next step
-	} else {
-		smsa_client_operation(get_opcode(0x2, drm, blk), NULL);	// Only Seek for drum [This is handled in a weird way for optimization]
-		indc = 0;						// Update inidcator
-	}
-
-	int i = off;						// index assigned to offset
-	int rb = 0;						// To keep track of bytes read
-	while (i < 256 && rb < len) {
-		buf[rb] = tptr[i];				// fill buffer with temp's data
-		i++;
-		rb++;
-	}
-	blk++;							// Increment the block
-	
-	// *Took care of edge case*
-	
+	uint32_t rb = 0;						// To keep track of bytes read
+	int i, n, cnt, need;
 
-	// Take care of the regular case
 	while (rb < len) {						// Loop until the read bytes are less than the length of buffer
-		if (blk == 256) {					// Check if we reach end of drum
+		if (blk == smsa_geometry.blocks) {			// Check if we reach end of drum
 			drm++;						// Increment drum
-			if (drm > 15) {					// Check if we reach end of array
+			if (drm >= smsa_geometry.drums) {		// Check if we reach end of array
 				return -1;
 			}
 			blk = 0;					// Reset blcok
+		}
 
-			smsa_client_operation(get_opcode(0x2, drm, blk), NULL);// Seek to the new incremented drum
+		tptr = smsa_get_cache_line(drm, blk);			// Look if entry is cached
+		if (tptr != NULL) {					// If it is, just copy it out
+			n = copy_block_bytes(&buf[rb], tptr, off, len - rb);
+			rb += n;
+			off = 0;
+			blk++;
+			continue;
 		}
 
-		tptr = smsa_get_cache_line(drm, blk);			// Look if entry is cached	
+		// Gather the run of uncached blocks we still need (within the drum)
+		need = (off + (len - rb) + bs - 1) / bs;
+		cnt = 1;
+		while (cnt < need && cnt < smsa_geometry.range_blocks && blk + cnt < smsa_geometry.blocks &&
+				smsa_get_cache_line(drm, blk + cnt) == NULL) {
+			cnt++;
+		}
 
-		if (tptr == NULL) {					// If it isn't
-			if (indc == 0 || blk == 0) {
-				smsa_client_operation(get_opcode(0x3, drm, blk), NULL);// Seek block
-			}
-			tptr = malloc(256);					// Ask OS for 256 memory bytes to cache the block
-			smsa_client_operation(get_opcode(0x4, drm, blk), tptr);	// Read into temp
-			smsa_put_cache_line(drm, blk, tptr);			// cache the block
-			indc = 1;						// Update indicator
-		}	else {
-			indc = 0;						// If it is update the incrementer
+		// Fetch the whole run with a single request
+		if (smsa_client_operation_ex(get_opcode(SMSA_READ_RANGE, drm, blk), cnt, run) == -1) {
+			return -1;
 		}
 
-		i = 0;							// Set i back to 0
-		
-		while (i < 256 && rb < len) {
-			buf[rb] = tptr[i];				// Each byte in temp to the buffer
-			i++;
-			rb++;						// Increment our read bytes
+		for (i = 0; i < cnt; i++) {				// Cache each block and hand it back
+			tptr = malloc(bs);
+			memcpy(tptr, &run[i * bs], bs);
+			smsa_put_cache_line(drm, blk + i, tptr);
+
+			n = copy_block_bytes(&buf[rb], &run[i * bs], off, len - rb);
+			rb += n;
+			off = 0;
 		}
-		
-		blk++;							// Increment local block count
+		blk += cnt;						// Step past the run
 	}
 
 	return ( 0 );
@@ -192,75 +173,108 @@ int smsa_vwrite( SMSA_VIRTUAL_ADDRESS addr, uint32_t len, unsigned char *buf )
 		return -1;
 	}
 
-	// * Take care of edge case *
-	int i = off;						// Set the index to the block offset
-	int wb = 0;						// To keep track of bytes written
-
-	unsigned char *tptr = NULL;				
+	unsigned char run[SMSA_MAX_RANGE_BYTES];			// Blocks sent by one range write
+	int bs = smsa_geometry.block_size;
+	unsigned char *tptr = NULL;
+	uint32_t wb = 0;						// To keep track of bytes written
+	int i, n, cnt;
 
-	tptr = smsa_get_cache_line(drm, blk);			// See if entry is cached
+	while (wb < len) {
+		if (blk == smsa_geometry.blocks) { 			// Check if drum is filled up
+			drm++;						// Step to next drum
+			if (drm >= smsa_geometry.drums) {		// Check if stepped off smsa
+				return -1;
+			}
+			blk = 0; 					// Reset the block
+		}
 
-	if (tptr == NULL) {					// If it isn't
-		smsa_client_operation(get_opcode(0x2, drm, blk), NULL);	// Seek to current drum
-		smsa_client_operation(get_opcode(0x3, drm, blk), NULL); 	// Seek to current block
+		// Part of a block we don't have cached, just send the new bytes
+		// (after where they go in the block)
+		n = bs - off;
+		if (n > len - wb) {
+			n = len - wb;
+		}
+		if (n < bs && smsa_get_cache_line(drm, blk) == NULL) {
+			run[0] = off >> 8;
+			run[1] = off & 0xff;
+			memcpy(&run[SMSA_WRITE_AT_HEADER], &buf[wb], n);
+			if (smsa_client_operation_ex(get_opcode(SMSA_WRITE_AT, drm, blk), n, run) == -1) {
+				return -1;
+			}
+			wb += n;
+			blk++;
+			off = 0;
+			continue;
+		}
 
-		tptr = malloc(256);					// Ask OS for 256 bytes in heap
-		smsa_client_operation(get_opcode(0x4, drm, blk), tptr);	// Read into temp
-		smsa_put_cache_line(drm, blk, tptr);			// Put the ptr into cache
-		
-		smsa_client_operation(get_opcode(0x3, drm, blk), NULL);	// Seek back to the block
-	} else {
-		smsa_client_operation(get_opcode(0x2, drm, blk), NULL);	// Seek to drum
-		smsa_client_operation(get_opcode(0x3, drm, blk), NULL); 	// Seek to block
-	}
+		// How many blocks this run covers (within the drum)
+		cnt = (off + (len - wb) + bs - 1) / bs;
+		if (cnt > smsa_geometry.range_blocks) {
+			cnt = smsa_geometry.range_blocks;
+		}
+		if (cnt > smsa_geometry.blocks - blk) {
+			cnt = smsa_geometry.blocks - blk;
+		}
+		if (cnt > 1 && off + (len - wb) < cnt * bs && smsa_get_cache_line(drm, blk + cnt - 1) == NULL) {
+			cnt--;						// Leave a partly written last block to the above
+		}
 
-	while (i < 256 && wb < len) {				// Loop until we read as many bytes as buffer length
-		tptr[i] = buf[wb];				// Assign each byte in buffer to temp
-		i++;
-		wb++;						// Increment the count of written bytes
-	}
-	
-	smsa_client_operation(get_opcode(0x5, drm, blk), tptr); 	// Dump data to smsa
-	blk++;							// Increment local count of blocks
-	// * Took care of edge case *
-	
+		for (i = 0; i < cnt; i++) {				// Lay the new bytes over the old blocks
+			unsigned char *dst = &run[i * bs];
+			int start = (i == 0) ? off : 0;
 
-	// Take care of the regular rest
-	while (wb < len) {
-		if (blk == 256) { 				// Check if drum is filled up
-			drm++;					// Step to next drum
-			if (drm > 15) {				// Check if stepped off smsa
-				return -1;
+			n = bs - start;
+			if (n > len - wb) {
+				n = len - wb;
+			}
+			if (n < bs) {					// Partly written, keep the rest of the (cached) block
+				memcpy(dst, smsa_get_cache_line(drm, blk + i), bs);
 			}
-			blk = 0; 				// Reset the block
-			smsa_client_operation(get_opcode(0x2, drm, blk), NULL);	// Seek to the next drum
-			smsa_client_operation(get_opcode(0x3, drm, blk), NULL);	// Seek to block 0
+			memcpy(&dst[start], &buf[wb], n);
+			wb += n;
 		}
 
-		tptr = smsa_get_cache_line(drm, blk);		// Fetch drm and blk to see if they're in the cache
-		
-		if (tptr == NULL) {					// If they aren't, do this
-			tptr = malloc(256);				// Obtain 256 data from memory
-			smsa_client_operation(get_opcode(0x4, drm, blk), tptr);// backup the data into the ptr
-			smsa_put_cache_line(drm, blk, tptr);		// Put data in the drum
-			smsa_client_operation(get_opcode(0x3, drm, blk), NULL);// Seek back only for block
+		// Dump the whole run to smsa with a single request
+		if (smsa_client_operation_ex(get_opcode(SMSA_WRITE_RANGE, drm, blk), cnt, run) == -1) {
+			return -1;
 		}
 
-		i = 0;						 // Reset index
-		while ( i < 256 && wb < len ) {			 // Loop until we read enough bytes
-			tptr[i] = buf[wb];			 // Assign each byte in buffer to temp
-			i++;
-			wb++;					 // Increment the amount of bytes read
+		for (i = 0; i < cnt; i++) {				// Keep the cache up to date
+			if ((tptr = smsa_get_cache_line(drm, blk + i)) == NULL) {
+				tptr = malloc(bs);
+				smsa_put_cache_line(drm, blk + i, tptr);
+			}
+			memcpy(tptr, &run[i * bs], bs);
 		}
 
-		smsa_client_operation(get_opcode(0x5, drm, blk), tptr); // Dump temp to smsa
-
-		blk++;
+		blk += cnt;						// Step past the run
+		off = 0;
 	}
 
 	return ( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_block_bytes
+// Description  : Will copy the wanted part of a block out to a buffer
+//
+// Inputs       : dst - where to copy to
+//                blk - the block to copy from
+//                off - where in the block to start
+//                left - the number of bytes still wanted
+// Outputs      : the number of bytes copied
+
+int copy_block_bytes( unsigned char *dst, unsigned char *blk, int off, uint32_t left ) {
+	int n = smsa_geometry.block_size - off;			// Rest of the block
+
+	if (n > left) {						// Or less, if that's all we want
+		n = left;
+	}
+	memcpy(dst, &blk[off], n);
+
+	return n;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -271,9 +285,9 @@ int smsa_vwrite( SMSA_VIRTUAL_ADDRESS addr, uint32_t len, unsigned char *buf )
 // Outputs      : -1 if failure or the drum ID if successful
 
 int get_current_drum( SMSA_VIRTUAL_ADDRESS addr ) {
-	int dummy = (addr >> 16);		// Shift right by 16 to get the first four signnificant bits
+	uint64_t dummy = (addr >> smsa_geometry.drum_shift);	// Shift right past the block and offset bits
 
-	if (dummy > 15 || dummy < 0) {	// Check boundaries
+	if (dummy >= smsa_geometry.drums) {	// Check boundaries
 		return -1;
 	}
 
@@ -289,11 +303,9 @@ int get_current_drum( SMSA_VIRTUAL_ADDRESS addr ) {
 // Outputs      : -1 if failure or the block ID if successful
 
 int get_current_block( SMSA_VIRTUAL_ADDRESS addr ) {
-	int dummy = addr & 0x0FF00; 	// Mask the address to get the first 16
+	int dummy = (addr >> smsa_geometry.block_shift) & (smsa_geometry.blocks - 1); 	// Shift off the offset, mask off the drum
 
-	dummy = dummy >> 8;		// Shift right by 8 to get the middle 8
-	
-	if (dummy > 255 || dummy < 0) {	// Check boundaries
+	if (dummy >= smsa_geometry.blocks || dummy < 0) {	// Check boundaries
 		return -1;
 	}
 
@@ -309,9 +321,9 @@ int get_current_block( SMSA_VIRTUAL_ADDRESS addr ) {
 // Outputs      : -1 if failure or the offset if successful
 
 int get_current_offset( SMSA_VIRTUAL_ADDRESS addr ) {
-	int dummy = addr & 0xFF;	// Mask the address to obtain the first 8
+	int dummy = addr & (smsa_geometry.block_size - 1);	// Mask the address to obtain the offset bits
 	
-	if (dummy > 255 || dummy < 0) {	// Check boundaries
+	if (dummy >= smsa_geometry.block_size || dummy < 0) {	// Check boundaries
 		return -1;
 	
 	}
@@ -325,28 +337,28 @@ int get_current_offset( SMSA_VIRTUAL_ADDRESS addr ) {
 // Description  : Will combine the three inputs into opcode that could 
 // 			communicate with smsa.
 //
-// Inputs       : command - 0 through 9 instructions that tell smsa what to do
+// Inputs       : command - 0 through 10 instructions that tell smsa what to do
 // 		  drumID - The drum ID if needed
 // 		  blockID - the block ID if needed
 // Outputs      : -1 if failure or funcitonal opcode if successful
 
 uint32_t get_opcode( int command, int drumID, int blockID ) {
-	if (command > 9 || command < 0) {	// Check boundaries
+	if (command >= SMSA_MAX_COMMAND || command < 0) {	// Check boundaries
 		return -1;
 	} else {	
 		command = command << 26;	// Shift to the first 6 bits
 	}
 
-	if (drumID < 0 || drumID > 15) {	// Check boundaries
+	if (drumID < 0 || drumID >= smsa_geometry.drums) {	// Check boundaries
 		return -1;
 	} else {
 		drumID = drumID << 22;		// Shift to 7 to 10 bits
 		command = command | drumID;	// Combine the two
 	}
-	if (blockID < 0 || blockID > 255) {	// Check boundaries
+	if (blockID < 0 || blockID >= smsa_geometry.blocks) {	// Check boundaries
 		return -1;
 	} else {
-		command = command | blockID;	// Combine to be the last 8 bits
+		command = command | blockID;	// Combine to be the last 22 bits
 	}
 
 	return command;				// Return final value
@@ -366,19 +378,19 @@ int load_workload_file( void ) {
 		printf("INFO: File smsa_data.dat does not exit : Continuing without loading\n");
 		return ( 0 );
 	}
-	unsigned char temp[SMSA_BLOCK_SIZE]; 		// will use to load up files
+	unsigned char temp[SMSA_MAX_BLOCK_SIZE]; 	// will use to load up files
 
 	smsa_client_operation(get_opcode(0x2, 0, 0), NULL); 	// Seek drum 0
 	smsa_client_operation(get_opcode(0x3, 0, 0), NULL); 	// Seek blck 0
 	int blk = 0;
 	int drm = 0;
-	while (drm < 16) {
-		fread(temp, sizeof(temp[0]), (sizeof(temp) / sizeof(temp[0])), fhandle);	// Read temp from file
+	while (drm < smsa_geometry.drums) {
+		fread(temp, sizeof(temp[0]), smsa_geometry.block_size, fhandle);			// Read temp from file
 		smsa_client_operation(get_opcode(0x5, drm, blk), temp); 				// Write temp to smsa
 		blk++;										// Increment local block
-		if (blk == 256) {								// Check if stepped off block
+		if (blk == smsa_geometry.blocks) {								// Check if stepped off block
 			drm++;									// Increment local drum
-			if (drm > 15) {								// Check if stepped off array
+			if (drm >= smsa_geometry.drums) {								// Check if stepped off array
 				break;
 			}
 			blk = 0;								// reset block
@@ -405,21 +417,21 @@ int save_workload_file ( void ) {
 	if ((fhandle = fopen("smsa_data.dat", "wb")) == NULL) {				// Open file for write
 		return -1;
 	}
-	unsigned char temp[SMSA_BLOCK_SIZE]; 						// will use to load up files
+	unsigned char temp[SMSA_MAX_BLOCK_SIZE]; 					// will use to load up files
 	int drm = 0;
 	int blk = 0;
 
 	smsa_client_operation(get_opcode(0x2, 0, 0), NULL); 					// seek to drm 0
 	smsa_client_operation(get_opcode(0x3, 0, 0), NULL); 					// seek to blk 0
 	
-	while (drm < 16) {
+	while (drm < smsa_geometry.drums) {
 		smsa_client_operation(get_opcode(0x4, drm, blk), temp); 			// Read blk to temp
 		blk++;									// increment local blk
-		fwrite(temp, sizeof(temp[0]), sizeof(temp)/sizeof(temp[0]), fhandle);	// Dump blk into file
-		if (blk == 256) {							// Check if stepped off drum
+		fwrite(temp, sizeof(temp[0]), smsa_geometry.block_size, fhandle);	// Dump blk into file
+		if (blk == smsa_geometry.blocks) {							// Check if stepped off drum
 			drm++;								// Increment local drum
 			blk = 0;							// Reset block
-			if (drm > 15) {							// Check if stepped off smsa
+			if (drm >= smsa_geometry.drums) {							// Check if stepped off smsa
 				break;
 			}
 			smsa_client_operation(get_opcode(0x2, drm, blk), NULL); 		// seek to new drm
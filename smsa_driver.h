@@ -22,7 +22,7 @@
 
 //
 // Type Definitions
-typedef uint32_t SMSA_VIRTUAL_ADDRESS; // SMSA Driver Virtual Addresses
+typedef uint64_t SMSA_VIRTUAL_ADDRESS; // SMSA Driver Virtual Addresses (drum, block, offset)
 
 
 // Interfaces
@@ -70,6 +70,19 @@ int smsa_vread( SMSA_VIRTUAL_ADDRESS addr, uint32_t len, unsigned char *buf );
 
 int smsa_vwrite( SMSA_VIRTUAL_ADDRESS addr, uint32_t len, unsigned char *buf );
 
+////////////////////////////////////////////////////////////////////////////////
+////
+//// Function     : copy_block_bytes
+//// Description  : Will copy the wanted part of a block out to a buffer
+////
+//// Inputs       : dst - where to copy to
+////                blk - the block to copy from
+////                off - where in the block to start
+////                left - the number of bytes still wanted
+//// Outputs      : the number of bytes copied
+
+int copy_block_bytes( unsigned char *dst, unsigned char *blk, int off, uint32_t left );
+
 ////////////////////////////////////////////////////////////////////////////////
 ////
 //// Function     : get_current_drum
@@ -106,7 +119,7 @@ int get_current_offset( SMSA_VIRTUAL_ADDRESS addr );
 //// Description  : Will combine the three inputs into opcode that could 
 ////                      communicate with smsa.
 ////
-//// Inputs       : command - 0 through 9 instructions that tell smsa what to do
+//// Inputs       : command - 0 through 10 instructions that tell smsa what to do
 ////                drumID - The drum ID if needed
 ////                blockID - the block ID if needed
 //// Outputs      : -1 if failure or funcitonal opcode if successful
@@ -18,28 +18,78 @@ typedef struct {
 	SMSA_DISK_COMMAND	cmd;	// The type of operation being performed
 	SMSA_DRUM_ID		did;	// This is the drum to be written to/read from
 	SMSA_BLOCK_ID		bid;	// This is the address to read/write
-	unsigned short		len;	// Number of bytes to be read/written
+	uint32_t		len;	// Number of bytes to be read/written
 	unsigned char		*blk;	// The buffer to place read or write data
 } SMSA_OPERATION; 
 
+#define SMSA_SIGNATURE_DIGEST 20	// Bytes of the digest a signature is cut from (SHA1, CMPSC311_HASH_TYPE)
+#define SMSA_SIGNATURE_WORDS ((SMSA_SIGNATURE_DIGEST+3)/4)	// Words of a cached signature (the whole digest, as logged)
+
+// SMSA cached block signature
+typedef struct {
+	uint64_t		tag;	// SMSA_SIGNATURE_TAG(generation) signed in, 0 if not signed
+	uint32_t		sig[SMSA_SIGNATURE_WORDS];	// The signature (as logged)
+} SMSA_SIGNATURE_CACHE;
+
+// SMSA journal record, the bytes written follow it
+typedef struct {
+	uint32_t		magic;	// SMSA_JOURNAL_MAGIC (where a record starts)
+	uint8_t			cmd;	// SMSA_DISK_WRITE or SMSA_FORMAT_DRUM
+	uint8_t			did;	// The drum
+	uint16_t		off;	// The first byte written in the block
+	uint32_t		bid;	// The block written
+	uint16_t		len;	// The number of bytes written
+	uint16_t		unused;	// (padding, zero)
+	uint32_t		sum;	// Checksum of the record (sum as zero) and bytes
+} SMSA_JOURNAL_RECORD;
+
 //
 // Disk interface (internals)
 
 // SMSA Command functions
-int SMSAMountArray( void );
-int SMSAUnmountArray( void );
-int SMSASeekDrum( SMSA_DRUM_ID did );
-int SMSASeekBlock( SMSA_BLOCK_ID blk );
-int SMSAReadBlock( unsigned char *block );
-int SMSAWriteBlock( unsigned char *block );
-int SMSAFormatDrum( void );
+int SMSAMountArray( SMSA_SESSION *sess );
+int SMSAUnmountArray( SMSA_SESSION *sess );
+int SMSASeekDrum( SMSA_SESSION *sess, SMSA_DRUM_ID did );
+int SMSASeekBlock( SMSA_SESSION *sess, SMSA_BLOCK_ID blk );
+int SMSAReadBlock( SMSA_SESSION *sess, unsigned char *block );
+int SMSAWriteBlock( SMSA_SESSION *sess, unsigned char *block );
+int SMSAFormatDrum( SMSA_SESSION *sess );
+int SMSAReadBlocks( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *buf );
+int SMSAWriteBlocks( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *buf );
+int SMSAWriteAt( SMSA_SESSION *sess, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t off, uint16_t len, unsigned char *buf );
+int SMSASignBlocks( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count, unsigned char *sigs );
 
 // Utility functions
 int SMSAStoreArray( void );
 int SMSALoadArray( void );
+int SMSAMapArray( void );
+int SMSAUnmapArray( void );
+void SMSAReleaseArray( void );
+int SMSACheckpointArray( void );
+void mark_blocks_dirty( SMSA_DRUM_ID did, uint32_t bid, uint32_t count );
+int smsa_start_checkpoints( void );
+void smsa_stop_checkpoints( void );
+void *smsa_checkpoint_main( void *arg );
+int smsa_journal_open( void );
+int smsa_journal_replay( const char *path, off_t *good );
+int smsa_journal_append( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t off, uint16_t len, const unsigned char *data );
+int smsa_journal_write( int fd, unsigned char *buf, size_t len );
+int smsa_journal_rotate( void );
+void smsa_journal_retire( void );
+void smsa_journal_close( int stored );
+int smsa_journal_sync_directory( void );
+uint32_t smsa_journal_checksum( const unsigned char *buf, size_t len, uint32_t sum );
 int decode_SMSA_operation( SMSA_OPERATION *dop, uint32_t op, unsigned char *block );
 uint32_t encode_SMSA_operation( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID addr );
-unsigned char * block_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid );
-int operation_cycle_cost( SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid );
+int block_current( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid );
+const unsigned char * block_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid );
+unsigned char * block_write_address( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, int partial );
+int block_signature( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, unsigned char *sig, uint32_t *slen );
+int operation_cycle_cost( SMSA_SESSION *sess, SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, uint16_t count );
+int arm_move_cost( SMSA_DRUM_ID did );
+int head_move_cost( SMSA_DRUM_ID did, uint32_t bid, uint32_t count );
+int operation_drum_lock( SMSA_SESSION *sess, SMSA_DISK_COMMAND cmd, SMSA_DRUM_ID did );
+void operation_drum_unlock( int lock );
+void smsa_library_init( void );
 
 #endif
@@ -0,0 +1,280 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_network.c
+//  Description   : This is the protocol support shared by the client and the
+//                  server sides of the SMSA communication protocol.
+//
+//   Author        : Hayder Sharhan
+//   Last Modified : Tue Dec 10 2013
+//
+
+// Include Files
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Project Include Files
+#include <smsa.h>
+#include <smsa_network.h>
+
+//
+// Global data
+
+char *smsa_unix_path = NULL;	// Unix socket to use instead of TCP (NULL = TCP)
+int smsa_tcp_port = SMSA_DEFAULT_PORT;	// TCP port of the server
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replicated_op
+// Description  : Check if an operation changes the array, so a primary
+//                forwards it to its replicas
+//
+// Inputs       : op - the opcode of the request
+// Outputs      : 1 if it changes the array, 0 if not
+
+int smsa_replicated_op( uint32_t op ) {
+	return( (SMSA_OPCODE(op) == SMSA_DISK_WRITE) || (SMSA_OPCODE(op) == SMSA_WRITE_RANGE) ||
+		(SMSA_OPCODE(op) == SMSA_WRITE_AT) || (SMSA_OPCODE(op) == SMSA_FORMAT_DRUM) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_request_bytes
+// Description  : Work out how many block bytes a request must carry
+//
+// Inputs       : op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : the number of block bytes needed by the request
+
+int smsa_request_bytes( uint32_t op, uint16_t arg ) {
+
+	// Writes carry their blocks (a partial one its offset, then the bytes),
+	// everything else nothing
+	switch ( SMSA_OPCODE(op) ) {
+		case SMSA_DISK_WRITE:
+			return( smsa_geometry.block_size );
+		case SMSA_WRITE_RANGE:
+			return( (arg <= smsa_geometry.range_blocks) ? arg << smsa_geometry.block_shift : 0 );
+		case SMSA_WRITE_AT:
+			return( (arg <= smsa_geometry.block_size) ? SMSA_WRITE_AT_HEADER+arg : 0 );
+		default:
+			return( 0 );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_reply_bytes
+// Description  : Work out how many block bytes go back with a response
+//
+// Inputs       : op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : the number of block bytes in the response
+
+int smsa_reply_bytes( uint32_t op, uint16_t arg ) {
+
+	// Reads return their blocks, signatures their digests, a mount that asks
+	// for it the geometry, everything else just a return code
+	switch ( SMSA_OPCODE(op) ) {
+		case SMSA_MOUNT:
+			return( (arg & SMSA_NET_FEATURE_GEOMETRY) ? SMSA_NET_GEOMETRY_SIZE : 0 );
+		case SMSA_DISK_READ:
+			return( smsa_geometry.block_size );
+		case SMSA_READ_RANGE:
+			return( smsa_reply_fits(op, arg) ? arg << smsa_geometry.block_shift : 0 );
+		case SMSA_SIGN_RANGE:
+			return( smsa_reply_fits(op, arg) ? arg*SMSA_SIGNATURE_SIZE : 0 );
+		default:
+			return( 0 );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_reply_fits
+// Description  : Check the response to a request fits a packet (a range
+//                moves or signs no more than SMSA_MAX_RANGE_BYTES worth)
+//
+// Inputs       : op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : 1 if smsa_reply_bytes covers the response, 0 if not
+
+int smsa_reply_fits( uint32_t op, uint16_t arg ) {
+
+	switch ( SMSA_OPCODE(op) ) {
+		case SMSA_READ_RANGE:
+			return( arg <= smsa_geometry.range_blocks );
+		case SMSA_SIGN_RANGE:
+			return( arg <= SMSA_MAX_SIGN_BLOCKS );
+		default:
+			return( 1 );
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_encode_blocks
+// Description  : Encode whole blocks for the wire.  Each block becomes a tag
+//                followed by its data:
+//
+//                SMSA_NET_ENC_FILL - one byte, every byte of the block
+//                SMSA_NET_ENC_RLE  - a run count, then (length-1, byte) pairs
+//                SMSA_NET_ENC_RAW  - the block as is
+//
+// Inputs       : out - where to put the encoding (room for blkbytes)
+//                blocks - the block(s)
+//                blkbytes - the number of bytes in blocks
+// Outputs      : the encoded length, -1 if no shorter than the block(s) (or
+//                not whole blocks)
+
+int smsa_encode_blocks( unsigned char *out, unsigned char *blocks, int blkbytes ) {
+	unsigned char *blk;
+	int i, j, o = 0, runs, fill, start, bs = smsa_geometry.block_size;
+
+	if ( blkbytes % bs != 0 ) {				// Part of a block goes as is
+		return( -1 );
+	}
+
+	for (i = 0; i < blkbytes; i += bs) {
+		blk = &blocks[i];
+		for (runs = 1, fill = 1, start = 0, j = 1; j < bs; j++) {	// Count the runs (256 bytes at most)
+			if ( blk[j] != blk[start] || j - start == 256 ) {
+				fill = fill && ( blk[j] == blk[start] );
+				runs++;
+				start = j;
+			}
+		}
+
+		if ( fill ) {						// The usual memset block
+			if ( o + 2 >= blkbytes ) {
+				return( -1 );
+			}
+			out[o++] = SMSA_NET_ENC_FILL;
+			out[o++] = blk[0];
+		} else if ( runs <= 255 && 2 + 2*runs <= bs ) {		// Runs are shorter
+			if ( o + 2 + 2*runs >= blkbytes ) {
+				return( -1 );
+			}
+			out[o++] = SMSA_NET_ENC_RLE;
+			out[o++] = runs;
+			for (start = 0, j = 1; j <= bs; j++) {
+				if ( j == bs || blk[j] != blk[start] || j - start == 256 ) {
+					out[o++] = j - start - 1;
+					out[o++] = blk[start];
+					start = j;
+				}
+			}
+		} else {						// Nothing to gain
+			if ( o + 1 + bs >= blkbytes ) {
+				return( -1 );
+			}
+			out[o++] = SMSA_NET_ENC_RAW;
+			memcpy( &out[o], blk, bs );
+			o += bs;
+		}
+	}
+
+	return( o );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_decode_blocks
+// Description  : Decode blocks encoded by smsa_encode_blocks
+//
+// Inputs       : out - where to put the block(s)
+//                maxbytes - the room in out
+//                in - the encoding
+//                inlen - the number of bytes in the encoding
+// Outputs      : the number of block bytes decoded, -1 if malformed
+
+int smsa_decode_blocks( unsigned char *out, int maxbytes, unsigned char *in, int inlen ) {
+	int i = 0, o = 0, runs, len, bs = smsa_geometry.block_size;
+
+	while ( i < inlen ) {
+		if ( o + bs > maxbytes ) {				// No room for another
+			return( -1 );
+		}
+		switch ( in[i++] ) {
+			case SMSA_NET_ENC_FILL:
+				if ( i + 1 > inlen ) {
+					return( -1 );
+				}
+				memset( &out[o], in[i++], bs );
+				break;
+
+			case SMSA_NET_ENC_RLE:
+				if ( i + 1 > inlen || i + 1 + 2*in[i] > inlen ) {
+					return( -1 );
+				}
+				for (runs = in[i++], len = 0; runs > 0; runs--, i += 2) {
+					if ( len + in[i] + 1 > bs ) {
+						return( -1 );
+					}
+					memset( &out[o+len], in[i+1], in[i] + 1 );
+					len += in[i] + 1;
+				}
+				if ( len != bs ) {		// Runs must cover the block
+					return( -1 );
+				}
+				break;
+
+			case SMSA_NET_ENC_RAW:
+				if ( i + bs > inlen ) {
+					return( -1 );
+				}
+				memcpy( &out[o], &in[i], bs );
+				i += bs;
+				break;
+
+			default:
+				return( -1 );
+		}
+		o += bs;
+	}
+
+	return( o );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_pack_geometry
+// Description  : Put the geometry of the array in a mount reply, the drums,
+//                blocks in a drum and bytes in a block (each 4 bytes in
+//                network order)
+//
+// Inputs       : buf - where to put it (SMSA_NET_GEOMETRY_SIZE bytes)
+// Outputs      : none
+
+void smsa_pack_geometry( unsigned char *buf ) {
+	uint32_t val[3];
+
+	val[0] = htonl( smsa_geometry.drums );
+	val[1] = htonl( smsa_geometry.blocks );
+	val[2] = htonl( smsa_geometry.block_size );
+	memcpy( buf, val, SMSA_NET_GEOMETRY_SIZE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_unpack_geometry
+// Description  : Take the geometry of the array out of a mount reply
+//
+// Inputs       : buf - the geometry (SMSA_NET_GEOMETRY_SIZE bytes)
+//                drums - set to the number of drums
+//                blocks - set to the blocks in a drum
+//                block_size - set to the bytes in a block
+// Outputs      : none
+
+void smsa_unpack_geometry( unsigned char *buf, uint32_t *drums, uint32_t *blocks, uint32_t *block_size ) {
+	uint32_t val[3];
+
+	memcpy( val, buf, SMSA_NET_GEOMETRY_SIZE );
+	*drums = ntohl( val[0] );
+	*blocks = ntohl( val[1] );
+	*block_size = ntohl( val[2] );
+}
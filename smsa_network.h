@@ -12,25 +12,237 @@
 
 // Include Files
 #include <stdint.h>
+#include <sys/uio.h>
 
 // Project Include Files
+#include <smsa.h>
 
 // Defines
 #define SMSA_MAX_BACKLOG 5
 #define SMSA_NET_HEADER_SIZE (sizeof(uint16_t)+sizeof(uint32_t)+sizeof(uint16_t))
+#define SMSA_NET_HEADER_V2_SIZE (SMSA_NET_HEADER_SIZE+sizeof(uint32_t)+2*sizeof(uint16_t))
+#define SMSA_NET_HEADER_BYTES(v) (((v) >= SMSA_NET_VERSION_2) ? SMSA_NET_HEADER_V2_SIZE : SMSA_NET_HEADER_SIZE)
+#define SMSA_NET_VERSION_1 1
+#define SMSA_NET_VERSION_2 2
+#define SMSA_NET_FLAG_ORDERED 0x0001
+#define SMSA_NET_FLAG_ENCODED 0x0002
+#define SMSA_NET_FLAG_AFTER 0x0004
+#define SMSA_NET_VERSION_MASK 0x00ff
+#define SMSA_NET_FEATURE_ENCODE 0x0100
+#define SMSA_NET_FEATURE_REPLICA 0x0200
+#define SMSA_NET_FEATURE_GEOMETRY 0x0400
+#define SMSA_NET_GEOMETRY_SIZE (3*sizeof(uint32_t))
+#define SMSA_NET_ENC_FILL 0
+#define SMSA_NET_ENC_RLE 1
+#define SMSA_NET_ENC_RAW 2
 #define SMSA_DEFAULT_IP "127.0.0.1"
 #define SMSA_DEFAULT_PORT 16784
+#define SMSA_DEFAULT_UNIX_PATH "/tmp/smsa.sock"
+#define SMSA_MAX_PIPELINE_DEPTH 64
+#define SMSA_NET_MAX_PACKET (SMSA_NET_HEADER_V2_SIZE+SMSA_MAX_RANGE_BYTES)
+#define SMSA_CONN_BUFFER_SIZE (2*SMSA_NET_MAX_PACKET)
+#define SMSA_MAX_EVENTS 256
+#define SMSA_SERVER_QUANTUM 16
+#define SMSA_MAX_WEIGHTS 32
+#define SMSA_MAX_WEIGHT 64
+#define SMSA_MAX_CONN_INFLIGHT (2*SMSA_MAX_PIPELINE_DEPTH)
+#define SMSA_MAX_SHARDS SMSA_DISK_ARRAY_SIZE
+#define SMSA_MAX_REPLICAS 8
+#define SMSA_REPL_MAX_LAG 16384
 
 //
 // Type Definitions
 
+// A request handed to a drum worker
+typedef struct smsa_job {
+    struct smsa_connection  *conn;      // The connection the request came in on
+    uint32_t                 op;        // The opcode of the request
+    uint16_t                 arg;       // The argument of the request
+    uint32_t                 id;        // The request id (protocol 2)
+    uint16_t                 flags;     // The request flags (protocol 2)
+    uint16_t                 seq;       // Replication sequence number (wanted by a read, given to a write)
+    int                      version;   // The protocol the reply goes out in
+    SMSA_DRUM_ID             from;      // The drum the connection's head was on
+    SMSA_DRUM_ID             drum;      // The drum the request works on
+    int16_t                  ret;       // The result of the operation
+    int                      done;      // The operation has been performed
+    int                      rdbytes;   // Number of block bytes in the reply
+    struct smsa_job         *next;      // Next job in the worker queue
+    struct smsa_job         *cnext;     // Next job of the connection
+    unsigned char            data[];    // The request/reply block(s)
+} SMSA_JOB;
+
+// The server side state of a client connection
+typedef struct smsa_connection {
+    int                      sock;      // The socket for the connection
+    char                     name[32];  // The client address (for logging)
+    unsigned char           *rbuf;      // Received bytes not yet processed
+    int                      rlen;      // Number of bytes in rbuf
+    unsigned char           *wbuf;      // Responses not yet sent
+    int                      wlen;      // Number of bytes in wbuf
+    int                      woff;      // Number of bytes of wbuf already sent
+    int                      reserved;  // Bytes of wbuf promised to the batch being gathered
+    int                      readable;  // The socket may have more to read
+    int                      mounted;   // Client has the array mounted
+    int                      version;   // Protocol negotiated at mount
+    int                      encoding;  // Read blocks go out encoded (negotiated at mount)
+    int                      replication; // The client is our primary, feeding us its writes
+    SMSA_DRUM_ID             drum;      // The drum the client's head is on
+    uint32_t                 heads[SMSA_DISK_ARRAY_SIZE]; // Read head of each drum
+    SMSA_JOB                *jobs;      // Requests not yet answered, in order
+    SMSA_JOB                *jobs_tail;
+    int                      njobs;     // Number of jobs in the list
+    int                      inflight;  // Number of jobs with the workers
+    int                      blocked;   // Waiting for the workers to go idle
+    int                      closed;    // Closed, free when the workers are done
+    struct smsa_connection  *bnext;     // Next connection waiting for idle
+    struct smsa_shm_segment *shm;       // Shared memory rings (NULL if on the socket)
+    int                      doorbell;  // Rung by the client when the server sleeps
+    int                      passed[2]; // Handles passed by the client to attach
+    struct smsa_connection  *snext;     // Next connection using rings
+    int                      slot;      // io_uring registered buffer slot (-1 if none)
+    int                      pending;   // io_uring operations in flight
+    int                      reading;   // io_uring read in flight
+    int                      rpos;      // io_uring bytes of rbuf already processed
+    int                      hangup;    // io_uring read saw the stream end
+    int                      writing;   // io_uring write in flight
+    int                      queued;    // Connection is on the ready list
+    int                      weight;    // Quanta it gets each round (fair queueing)
+    int                      deficit;   // Blocks of work it may still do this round
+    uint64_t                 since;     // When it joined the ready list (usecs)
+    uint64_t                 served;    // Requests answered
+    uint64_t                 turns;     // Turns in which requests were answered
+    uint64_t                 waited;    // Time those turns waited (usecs)
+    uint64_t                 max_wait;  // Longest wait for a turn (usecs)
+    uint64_t                 depth;     // Requests waiting at those turns
+    int                      max_depth; // Most requests waiting at a turn
+    struct smsa_connection  *next;      // Next connection on the ready list
+} SMSA_CONNECTION;
+
+// The client side of the connection to one server (a shard of the drums)
+typedef struct smsa_client_shard {
+    char                    *path;      // Unix socket of the server (NULL for TCP)
+    char                     host[64];  // TCP address and port of the server
+    int                      port;
+    int                      sock;      // The connection (-1 if not connected)
+    int                      tcp;       // The connection is TCP (the options apply)
+    int                      version;   // Protocol the server granted
+    int                      encoding;  // The server agreed to encoded blocks
+    uint32_t                 next_id;   // Id of the next request
+    uint32_t                 reply_id;  // Id of the next protocol 1 reply (in order)
+    int                      count;     // Requests in flight
+    int                      busy[SMSA_MAX_PIPELINE_DEPTH];   // The slot holds a request in flight
+    uint32_t                 ids[SMSA_MAX_PIPELINE_DEPTH];    // Ids of the requests in flight
+    uint32_t                 ops[SMSA_MAX_PIPELINE_DEPTH];    // Opcodes of the requests in flight
+    unsigned char           *blocks[SMSA_MAX_PIPELINE_DEPTH]; // Where their replies go
+    int                      sizes[SMSA_MAX_PIPELINE_DEPTH];  // How many reply bytes each expects
+    struct smsa_shm_segment *shm;       // Shared memory rings (NULL if on the socket)
+    int                      doorbell;  // Wakes the server when it sleeps
+    unsigned char            rbuf[SMSA_CONN_BUFFER_SIZE]; // Bytes read but not yet parsed
+    int                      rpos;      // Start of the unparsed bytes
+    int                      rlen;      // End of the unparsed bytes
+    int                      rframe;    // Length of the frame being looked at
+    uint16_t                 rseq;      // Replication sequence number of that frame
+    unsigned char            hdrs[SMSA_MAX_PIPELINE_DEPTH][SMSA_NET_HEADER_V2_SIZE]; // Headers of the queued frames
+    struct iovec             iov[2*SMSA_MAX_PIPELINE_DEPTH]; // The queued frames, header and block
+    int                      niov;      // Number of queued iovecs
+    int                      nsend;     // Number of queued frames
+    unsigned char            sbuf[SMSA_CONN_BUFFER_SIZE]; // Copies of queued blocks the caller may reuse
+    int                      slen;      // Bytes of sbuf used
+    uint16_t                 seq;       // Newest write the server acknowledged (low 16 bits)
+    int                      writes;    // Writes in flight
+    SMSA_DRUM_ID             head_drum; // Where the server's head is (kept when reading from replicas)
+    uint32_t                 head_block;
+    int                      moved;     // A replica read moved the head, seek before head relative ops
+    struct smsa_client_shard *replicas[SMSA_MAX_REPLICAS]; // Servers the reads are spread over
+    int                      nreplicas;
+    int                      next_replica; // The replica for the next read
+} SMSA_CLIENT_SHARD;
+
+//
+// Global Data
+extern int smsa_server_backlog;
+extern char *smsa_unix_path;
+extern int smsa_tcp_port;
+extern int smsa_client_shm;
+extern int smsa_client_nodelay;
+extern int smsa_client_cork;
+extern int smsa_client_connections;
+extern int smsa_client_version;
+extern int smsa_client_encode;
+extern int smsa_server_workers;
+extern uint32_t smsa_replica_seq;
+
 //
 // Funtional Prototypes
 
 int smsa_client_operation( uint32_t op, unsigned char *block );
     // This is the implementation of the client operation
 
+int smsa_client_operation_ex( uint32_t op, uint16_t arg, unsigned char *block );
+    // The client operation for commands that carry an argument
+
+int smsa_client_set_pipeline( int depth );
+    // Set the number of requests the client may have in flight (0 = none)
+
+int smsa_client_flush( void );
+    // Wait for the replies to all requests in flight
+
+int smsa_client_set_shards( char *map );
+    // Spread the drums over several servers ("first-last=endpoint,...")
+
 int smsa_server( void );
     // This is the implementation of the server application
 
+int smsa_start_workers( void );
+    // Start the drum workers, returns the completion event handle
+
+void smsa_stop_workers( void );
+    // Stop the drum workers
+
+void smsa_submit_job( SMSA_JOB *job );
+    // Queue a job on the worker that owns its drum
+
+SMSA_JOB *smsa_completed_jobs( void );
+    // Collect the jobs the workers have finished
+
+void smsa_execute_job( SMSA_JOB *job );
+    // Perform a job with the heads of its connection
+
+int smsa_add_replica( char *endpoint );
+    // Add a replica to forward writes to
+
+int smsa_start_replication( void );
+    // Connect to and mount the replicas, start forwarding
+
+void smsa_stop_replication( void );
+    // Forward what is left and unmount the replicas
+
+uint32_t smsa_replicate( uint32_t op, uint16_t arg, SMSA_DRUM_ID did, uint32_t bid, unsigned char *data );
+    // Queue a performed operation for the replicas, returning its sequence number
+
+int smsa_replicated_op( uint32_t op );
+    // Check if an operation changes the array (and goes to the replicas)
+
+int smsa_request_bytes( uint32_t op, uint16_t arg );
+    // The number of block bytes a request carries
+
+int smsa_reply_bytes( uint32_t op, uint16_t arg );
+    // The number of block bytes a response carries
+
+int smsa_reply_fits( uint32_t op, uint16_t arg );
+    // Check the response to a request fits a packet
+
+int smsa_encode_blocks( unsigned char *out, unsigned char *blocks, int blkbytes );
+    // Encode whole blocks for the wire, -1 if that would not save anything
+
+int smsa_decode_blocks( unsigned char *out, int maxbytes, unsigned char *in, int inlen );
+    // Decode blocks encoded by smsa_encode_blocks, -1 if malformed
+
+void smsa_pack_geometry( unsigned char *buf );
+    // Put the geometry of the array in a mount reply
+
+void smsa_unpack_geometry( unsigned char *buf, uint32_t *drums, uint32_t *blocks, uint32_t *block_size );
+    // Take the geometry of the array out of a mount reply
+
 #endif
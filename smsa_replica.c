@@ -0,0 +1,550 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_replica.c
+//  Description   : This is the replication of a primary SMSA server to its
+//                  replicas.  Every write and format the primary performs
+//                  gets a sequence number and is queued for each replica,
+//                  a sender thread per replica forwards them over an
+//                  ordinary (protocol 2) client connection.  Writes go as
+//                  write ranges and formats as a seek and a format, so
+//                  nothing depends on the heads of the replica connection.
+//                  The sequence number travels as the request id, and its
+//                  low 16 bits in the reply to the client that wrote, who
+//                  then reads from a replica only once it has caught up.
+//
+//   Author        : Hayder Sharhan
+//   Last Modified : Tue Dec 10 2013
+//
+
+// Include Files
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Project Include Files
+#include <smsa.h>
+#include <smsa_internal.h>
+#include <smsa_network.h>
+#include <smsa_server.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define SMSA_REPL_REPORT_SECS 1		// How often the lag is logged
+
+//
+// Type definitions
+
+// A forwarded operation
+typedef struct smsa_repl_entry {
+	uint32_t	seq;		// The sequence number (the request id)
+	uint32_t	op;		// The opcode sent to the replica
+	uint16_t	arg;		// Its argument
+	int		blkbytes;	// Number of block bytes it carries
+	struct smsa_repl_entry *next;	// Next entry in the queue
+	unsigned char	data[];		// The block(s)
+} SMSA_REPL_ENTRY;
+
+// A replica and the operations not yet forwarded to it
+typedef struct {
+	char		name[128];	// The endpoint (for logging)
+	char		*path;		// Unix socket of the replica (NULL for TCP)
+	char		host[64];	// TCP address and port of the replica
+	int		port;
+	int		sock;		// The connection to the replica
+	int		version;	// Protocol granted by the replica
+	pthread_t	thread;		// The sender thread
+	pthread_cond_t	wakeup;		// Signalled when operations are queued
+	SMSA_REPL_ENTRY	*head;		// Operations waiting to be sent
+	SMSA_REPL_ENTRY	*tail;
+	int		queued;		// Number of operations queued
+	uint32_t	acked;		// Newest sequence number the replica applied
+	uint32_t	maxlag;		// Largest lag seen
+	int		failed;		// The replica went away, stop queueing for it
+} SMSA_REPLICA;
+
+//
+// Global data
+
+uint32_t smsa_replica_seq = 0;			// Newest write applied from our primary
+static SMSA_REPLICA smsa_replicas[SMSA_MAX_REPLICAS]; // The replicas of this server
+static int smsa_nreplicas = 0;			// Number of replicas
+static uint32_t smsa_repl_seq = 0;		// Last sequence number handed out
+static int smsa_repl_stopping = 0;		// Set to have the senders drain and exit
+static pthread_mutex_t smsa_repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t smsa_repl_room = PTHREAD_COND_INITIALIZER; // Signalled as queues drain
+
+//
+// Functional Prototypes
+int smsa_replica_connect( SMSA_REPLICA *rep );
+int smsa_replica_request( SMSA_REPLICA *rep, uint32_t op, uint16_t arg, int16_t *ret, unsigned char *reply );
+int smsa_replica_send( SMSA_REPLICA *rep, SMSA_REPL_ENTRY *batch );
+void smsa_replica_queue( SMSA_REPLICA *rep, uint32_t seq, uint32_t op, uint16_t arg, unsigned char *data, int blkbytes );
+void *smsa_replica_main( void *arg );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_add_replica
+// Description  : Add a replica to forward writes to
+//
+// Inputs       : endpoint - a unix socket path or host[:port]
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_add_replica( char *endpoint ) {
+
+	// Local variables
+	SMSA_REPLICA *rep;
+	char *colon;
+
+	if ( smsa_nreplicas == SMSA_MAX_REPLICAS ) {
+		return( -1 );
+	}
+	rep = &smsa_replicas[smsa_nreplicas];
+	memset( rep, 0x0, sizeof(SMSA_REPLICA) );
+	strncpy( rep->name, endpoint, sizeof(rep->name)-1 );
+	rep->sock = -1;
+	rep->port = smsa_tcp_port;
+
+	// A path has a slash, anything else is a TCP address
+	if ( strchr(endpoint, '/') != NULL ) {
+		rep->path = endpoint;
+	} else {
+		strncpy( rep->host, endpoint, sizeof(rep->host)-1 );
+		if ( (colon = strchr(rep->host, ':')) != NULL ) {
+			*colon = '\0';
+			if ( sscanf(colon+1, "%d", &rep->port) != 1 ) {
+				return( -1 );
+			}
+		}
+		if ( rep->host[0] == '\0' ) {
+			strcpy( rep->host, SMSA_DEFAULT_IP );
+		}
+	}
+	smsa_nreplicas ++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_start_replication
+// Description  : Connect to the replicas, mount them and start a sender
+//                thread for each
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_start_replication( void ) {
+
+	// Local variables
+	SMSA_REPLICA *rep;
+	unsigned char geo[SMSA_NET_GEOMETRY_SIZE];
+	uint32_t drums, blocks, block_size;
+	int16_t ret;
+	int i;
+
+	for ( i=0; i<smsa_nreplicas; i++ ) {
+		rep = &smsa_replicas[i];
+		rep->version = SMSA_NET_VERSION_1;
+		pthread_cond_init( &rep->wakeup, NULL );
+
+		// Ask for protocol 2 (ids carry the sequence numbers) as a primary
+		if ( (smsa_replica_connect(rep) == -1) ||
+				(smsa_replica_request(rep, encode_SMSA_operation(SMSA_MOUNT, 0, 0),
+					SMSA_NET_VERSION_2|SMSA_NET_FEATURE_ENCODE|SMSA_NET_FEATURE_REPLICA|SMSA_NET_FEATURE_GEOMETRY,
+					&ret, geo) == -1) ||
+				((ret & SMSA_NET_VERSION_MASK) < SMSA_NET_VERSION_2) || !(ret & SMSA_NET_FEATURE_REPLICA) ||
+				!(ret & SMSA_NET_FEATURE_GEOMETRY) ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA unable to mount replica [%s]", rep->name );
+			return( -1 );
+		}
+
+		// It has to be laid out as we are, the writes name blocks
+		smsa_unpack_geometry( geo, &drums, &blocks, &block_size );
+		if ( (drums != smsa_geometry.drums) || (blocks != smsa_geometry.blocks) ||
+				(block_size != smsa_geometry.block_size) ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA replica [%s] geometry differs [%u drums, %u blocks of %u bytes]",
+					rep->name, drums, blocks, block_size );
+			return( -1 );
+		}
+		rep->version = SMSA_NET_VERSION_2;
+
+		if ( pthread_create(&rep->thread, NULL, smsa_replica_main, rep) != 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA unable to start replica sender [%s]", rep->name );
+			return( -1 );
+		}
+		logMessage( LOG_INFO_LEVEL, "Replicating to [%s]", rep->name );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_stop_replication
+// Description  : Forward whatever is still queued, then unmount the replicas
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_stop_replication( void ) {
+
+	// Local variables
+	SMSA_REPLICA *rep;
+	int16_t ret;
+	int i;
+
+	// Have the senders drain their queues and exit
+	pthread_mutex_lock( &smsa_repl_lock );
+	smsa_repl_stopping = 1;
+	for ( i=0; i<smsa_nreplicas; i++ ) {
+		pthread_cond_signal( &smsa_replicas[i].wakeup );
+	}
+	pthread_mutex_unlock( &smsa_repl_lock );
+
+	for ( i=0; i<smsa_nreplicas; i++ ) {
+		rep = &smsa_replicas[i];
+		if ( rep->thread == 0 ) {
+			continue;
+		}
+		pthread_join( rep->thread, NULL );
+		logMessage( LOG_INFO_LEVEL, "Replica [%s] at %u of %u (largest lag %u)", rep->name,
+				rep->acked, smsa_repl_seq, rep->maxlag );
+		if ( ! rep->failed ) {
+			smsa_replica_request( rep, encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), 0, &ret, NULL );
+		}
+		close( rep->sock );
+		rep->sock = -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replicate
+// Description  : Queue an operation the server just performed for every
+//                replica (if it changed the array).  The queues are bounded
+//                so the low 16 bits of a sequence number stay unambiguous,
+//                a full one holds the caller back until the replica catches
+//                up.
+//
+// Inputs       : op - the operation performed
+//                arg - its argument
+//                did - the drum the head was on before it
+//                bid - the block the head was on before it
+//                data - the block(s) it wrote
+// Outputs      : the sequence number given to it (0 if nothing was queued)
+
+uint32_t smsa_replicate( uint32_t op, uint16_t arg, SMSA_DRUM_ID did, uint32_t bid, unsigned char *data ) {
+
+	// Local variables
+	SMSA_REPLICA *rep;
+	uint32_t seq;
+	int i, full;
+
+	if ( (smsa_nreplicas == 0) || ! smsa_replicated_op(op) ) {
+		return( 0 );
+	}
+
+	pthread_mutex_lock( &smsa_repl_lock );
+
+	// Wait for room in every queue still being fed
+	do {
+		for ( i=0, full=0; i<smsa_nreplicas; i++ ) {
+			if ( !smsa_replicas[i].failed && (smsa_replicas[i].queued >= SMSA_REPL_MAX_LAG) ) {
+				full = 1;
+			}
+		}
+		if ( full ) {
+			pthread_cond_wait( &smsa_repl_room, &smsa_repl_lock );
+		}
+	} while ( full );
+
+	// Queue it, positioned explicitly
+	seq = ++smsa_repl_seq;
+	for ( i=0; i<smsa_nreplicas; i++ ) {
+		rep = &smsa_replicas[i];
+		if ( rep->failed ) {
+			continue;
+		}
+		switch ( SMSA_OPCODE(op) ) {
+		case SMSA_DISK_WRITE:
+			smsa_replica_queue( rep, seq, encode_SMSA_operation(SMSA_WRITE_RANGE, did, bid), 1, data, smsa_geometry.block_size );
+			break;
+		case SMSA_WRITE_RANGE:
+		case SMSA_WRITE_AT:
+			smsa_replica_queue( rep, seq, op, arg, data, smsa_request_bytes(op, arg) );
+			break;
+		case SMSA_FORMAT_DRUM:
+			smsa_replica_queue( rep, seq, encode_SMSA_operation(SMSA_SEEK_DRUM, did, 0), 0, NULL, 0 );
+			smsa_replica_queue( rep, seq, encode_SMSA_operation(SMSA_FORMAT_DRUM, 0, 0), 0, NULL, 0 );
+			break;
+		}
+		pthread_cond_signal( &rep->wakeup );
+	}
+
+	pthread_mutex_unlock( &smsa_repl_lock );
+	return( seq );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replica_queue
+// Description  : Append an operation to the queue of a replica (called with
+//                the replication lock held)
+//
+// Inputs       : rep - the replica
+//                seq - the sequence number of the operation
+//                op - the opcode to send
+//                arg - its argument
+//                data - the block(s) to send (NULL if none)
+//                blkbytes - the number of block bytes
+// Outputs      : none
+
+void smsa_replica_queue( SMSA_REPLICA *rep, uint32_t seq, uint32_t op, uint16_t arg, unsigned char *data, int blkbytes ) {
+
+	// Local variables
+	SMSA_REPL_ENTRY *ent;
+
+	ent = malloc( sizeof(SMSA_REPL_ENTRY) + blkbytes );
+	ent->seq = seq;
+	ent->op = op;
+	ent->arg = arg;
+	ent->blkbytes = blkbytes;
+	ent->next = NULL;
+	if ( blkbytes > 0 ) {
+		memcpy( ent->data, data, blkbytes );
+	}
+	if ( rep->tail != NULL ) {
+		rep->tail->next = ent;
+	} else {
+		rep->head = ent;
+	}
+	rep->tail = ent;
+	rep->queued ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replica_main
+// Description  : The sender thread of a replica, forwards the queued
+//                operations a pipeline at a time and logs the lag
+//
+// Inputs       : arg - the replica
+// Outputs      : NULL
+
+void *smsa_replica_main( void *arg ) {
+
+	// Local variables
+	SMSA_REPLICA *rep = arg;
+	SMSA_REPL_ENTRY *batch, *last, *ent;
+	struct timespec until;
+	uint32_t lag, seq, reported = 0;
+	int count, rc;
+
+	pthread_mutex_lock( &smsa_repl_lock );
+	while ( 1 ) {
+
+		// Wait for something to send, reporting the lag now and then
+		while ( (rep->head == NULL) && ! smsa_repl_stopping ) {
+			clock_gettime( CLOCK_REALTIME, &until );
+			until.tv_sec += SMSA_REPL_REPORT_SECS;
+			if ( (pthread_cond_timedwait(&rep->wakeup, &smsa_repl_lock, &until) == ETIMEDOUT) &&
+					(smsa_repl_seq != reported) ) {
+				reported = smsa_repl_seq;
+				logMessage( LOG_INFO_LEVEL, "Replica [%s] lag %u (largest %u)", rep->name,
+						smsa_repl_seq - rep->acked, rep->maxlag );
+			}
+		}
+		if ( rep->head == NULL ) {
+			break;
+		}
+
+		// Take up to a pipeline of operations
+		batch = last = rep->head;
+		for ( count=1; (count < SMSA_MAX_PIPELINE_DEPTH) && (last->next != NULL); count++ ) {
+			last = last->next;
+		}
+		rep->head = last->next;
+		if ( rep->head == NULL ) {
+			rep->tail = NULL;
+		}
+		last->next = NULL;
+		seq = last->seq;
+		lag = smsa_repl_seq - rep->acked;
+		if ( lag > rep->maxlag ) {
+			rep->maxlag = lag;
+		}
+		pthread_mutex_unlock( &smsa_repl_lock );
+
+		// Send them and wait for the replica to apply them
+		rc = rep->failed ? -1 : smsa_replica_send( rep, batch );
+		while ( (ent = batch) != NULL ) {
+			batch = ent->next;
+			free( ent );
+		}
+
+		pthread_mutex_lock( &smsa_repl_lock );
+		rep->queued -= count;
+		if ( rc == -1 ) {
+			if ( ! rep->failed ) {
+				logMessage( LOG_ERROR_LEVEL, "SMSA replica [%s] failed, no longer replicating to it", rep->name );
+			}
+			rep->failed = 1;
+		} else {
+			rep->acked = seq;
+		}
+		pthread_cond_broadcast( &smsa_repl_room );
+	}
+	pthread_mutex_unlock( &smsa_repl_lock );
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replica_send
+// Description  : Forward a batch of operations and collect the replies
+//
+// Inputs       : rep - the replica
+//                batch - the operations (linked through next)
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_replica_send( SMSA_REPLICA *rep, SMSA_REPL_ENTRY *batch ) {
+
+	// Local variables
+	unsigned char buf[SMSA_CONN_BUFFER_SIZE], *block;
+	SMSA_REPL_ENTRY *ent;
+	int len = 0, pos, count = 0, used, blkbytes;
+	uint32_t op, id;
+	uint16_t flags, seq;
+	int16_t ret;
+
+	// Pack them back to back, sending whenever the buffer is about full
+	for ( ent = batch; ent != NULL; ent = ent->next ) {
+		if ( len + SMSA_NET_MAX_PACKET > sizeof(buf) ) {
+			if ( send(rep->sock, buf, len, MSG_NOSIGNAL) != len ) {
+				return( -1 );
+			}
+			len = 0;
+		}
+		len += smsa_pack_packet( &buf[len], rep->version, ent->op, ent->arg, ent->seq,
+				SMSA_NET_FLAG_ENCODED, 0, (ent->blkbytes > 0) ? ent->data : NULL, ent->blkbytes );
+		count ++;
+	}
+	if ( (len > 0) && (send(rep->sock, buf, len, MSG_NOSIGNAL) != len) ) {
+		return( -1 );
+	}
+
+	// The replies carry no blocks, read until we have all of them
+	len = pos = 0;
+	while ( count > 0 ) {
+		if ( (used = smsa_parse_packet(&buf[pos], len-pos, rep->version, &op, &ret, &id, &flags, &seq,
+				&blkbytes, &block)) == -1 ) {
+			return( -1 );
+		}
+		if ( used > 0 ) {
+			if ( ret == -1 ) {
+				logMessage( LOG_ERROR_LEVEL, "SMSA replica [%s] failed operation %u [%u]", rep->name, id, op );
+			}
+			pos += used;
+			count --;
+			continue;
+		}
+		memmove( buf, &buf[pos], len-pos );
+		len -= pos;
+		pos = 0;
+		if ( (used = recv(rep->sock, &buf[len], sizeof(buf)-len, 0)) <= 0 ) {
+			return( -1 );
+		}
+		len += used;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replica_request
+// Description  : Send one request to a replica and wait for the reply
+//
+// Inputs       : rep - the replica
+//                op - the opcode
+//                arg - its argument
+//                ret - set to what the replica returned
+//                reply - where the block(s) of the reply go (NULL if none
+//                        are wanted, room for smsa_reply_bytes)
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_replica_request( SMSA_REPLICA *rep, uint32_t op, uint16_t arg, int16_t *ret, unsigned char *reply ) {
+
+	// Local variables
+	unsigned char buf[SMSA_NET_MAX_PACKET], *block;
+	int len, got = 0, used, blkbytes;
+	uint32_t rop, id;
+	uint16_t flags, seq;
+
+	len = smsa_pack_packet( buf, rep->version, op, arg, 0, 0, 0, NULL, 0 );
+	if ( send(rep->sock, buf, len, MSG_NOSIGNAL) != len ) {
+		return( -1 );
+	}
+	while ( (used = smsa_parse_packet(buf, got, rep->version, &rop, ret, &id, &flags, &seq, &blkbytes, &block)) == 0 ) {
+		if ( (len = recv(rep->sock, &buf[got], sizeof(buf)-got, 0)) <= 0 ) {
+			return( -1 );
+		}
+		got += len;
+	}
+	if ( (used > 0) && (reply != NULL) && (block != NULL) && (blkbytes <= smsa_reply_bytes(op, arg)) ) {
+		memcpy( reply, block, blkbytes );
+	}
+	return( ((used > 0) && (rop == op)) ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_replica_connect
+// Description  : Connect to a replica
+//
+// Inputs       : rep - the replica
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_replica_connect( SMSA_REPLICA *rep ) {
+
+	// Local variables
+	struct sockaddr_un uaddr;
+	struct sockaddr_in saddr;
+	int on = 1;
+
+	if ( rep->path != NULL ) {
+		memset( &uaddr, 0x0, sizeof(uaddr) );
+		uaddr.sun_family = AF_UNIX;
+		strncpy( uaddr.sun_path, rep->path, sizeof(uaddr.sun_path)-1 );
+		if ( (rep->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ) {
+			return( -1 );
+		}
+		if ( connect(rep->sock, (struct sockaddr *)&uaddr, sizeof(uaddr)) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA replica connect failed [%s] : [%s]", rep->name, strerror(errno) );
+			return( -1 );
+		}
+		return( 0 );
+	}
+
+	memset( &saddr, 0x0, sizeof(saddr) );
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(rep->port);
+	if ( (inet_aton(rep->host, &saddr.sin_addr) == 0) || ((rep->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) ) {
+		return( -1 );
+	}
+	if ( connect(rep->sock, (struct sockaddr *)&saddr, sizeof(saddr)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA replica connect failed [%s] : [%s]", rep->name, strerror(errno) );
+		return( -1 );
+	}
+	setsockopt( rep->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+	return( 0 );
+}
@@ -8,34 +8,72 @@
 //
 
 // Include Files
+#define _GNU_SOURCE
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <assert.h>
 
 // Project Include Files
 #include <smsa.h>
+#include <smsa_internal.h>
 #include <smsa_network.h>
+#include <smsa_server.h>
+#include <smsa_shm.h>
 #include <cmpsc311_log.h>
 
 // Global variables
 int smsa_server_shutdown    = 0;
+int smsa_server_backlog     = SMSA_MAX_BACKLOG;
 int client_socket	    = -1;
 unsigned char *client_ip    = NULL;
 unsigned short client_port  = 0;
+SMSA_CONNECTION *smsa_ready_head = NULL; // Connections with work to do, in turn
+SMSA_CONNECTION *smsa_ready_tail = NULL;
+SMSA_CONNECTION *smsa_blocked_head = NULL; // Connections waiting for the workers to go idle
+int smsa_mounted_clients = 0;		 // Clients that have the array mounted
+int smsa_jobs_inflight = 0;		 // Jobs handed to the drum workers
+int smsa_barrier_waiting = 0;		 // Array wide operations waiting for idle workers
+static int smsa_completion_marker;	 // Event data for worker completions
+int smsa_server_epfd = -1;		 // The event set of the server loop
+SMSA_CONNECTION *smsa_shm_head = NULL;	 // Connections using shared memory rings
+int smsa_server_first_drum = 0;		 // The drums this server owns (a shard of the array)
+int smsa_server_last_drum = SMSA_DISK_ARRAY_SIZE-1;
+char smsa_weight_clients[SMSA_MAX_WEIGHTS][32]; // Clients given a larger share (fair queueing)
+int smsa_weight_values[SMSA_MAX_WEIGHTS];
+int smsa_weight_count = 0;
 
 // Functional Prototypes
-int smsa_server_handle_connection( int sock );
-int smsa_recieve_packet( int sock, uint32_t *op, int16_t *ret, int *blkbytes, unsigned char *block ); 
-int smsa_send_packet( int sock, uint32_t op, int16_t ret, unsigned char *block );
-int smsa_read_bytes( int sock, int len, unsigned char *block );
-int smsa_send_bytes( int sock, int len, unsigned char *block );
-int smsa_wait_read( int sock );
-void smsa_signal_handler( int no );
+int smsa_server_accept( int server, int epfd );
+int smsa_server_service( SMSA_CONNECTION *conn );
+int smsa_server_service_shm( SMSA_CONNECTION *conn );
+int smsa_server_recv( SMSA_CONNECTION *conn, unsigned char *buf, int len );
+int smsa_server_attach( SMSA_CONNECTION *conn, unsigned char *out );
+void smsa_server_poll_rings( void );
+int smsa_server_mount_needed( SMSA_CONNECTION *conn, uint32_t op );
+int16_t smsa_server_negotiate( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, int16_t ret, unsigned char *reply );
+int smsa_server_owns( SMSA_CONNECTION *conn, uint32_t op, SMSA_DRUM_ID drum );
+int smsa_server_fits( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg );
+int smsa_server_perform( SMSA_CONNECTION *conn, SMSA_SESSION *sess, SMSA_REQUEST *req, unsigned char *out );
+int smsa_server_stale( SMSA_CONNECTION *conn, uint16_t flags, uint16_t seq );
+int smsa_server_cost( uint32_t op, uint16_t arg );
+uint64_t smsa_server_now( void );
+int smsa_flush_connection( SMSA_CONNECTION *conn );
+void smsa_block_connection( SMSA_CONNECTION *conn );
+void smsa_unblock_connection( SMSA_CONNECTION *conn );
+void smsa_release_blocked( void );
 
 //
 // Functions
@@ -43,7 +81,14 @@ void smsa_signal_handler( int no );
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : smsa_server
-// Description  : The main function SMSA server processing loop.
+// Description  : The main function SMSA server processing loop.  This is an
+//                edge-triggered epoll loop over non-blocking sockets, so any
+//                number of clients can be connected at once.  Connections
+//                with work to do take turns on a ready list (deficit round
+//                robin, see smsa_server_begin_turn).  With drum
+//                workers, requests are handed to the worker owning their
+//                drum and answered as the workers finish them (in order,
+//                unless the client negotiated protocol 2).
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
@@ -52,367 +97,1908 @@ int smsa_server( void ) {
 
     // Local variables
     struct sigaction new_action;
-    struct sockaddr_in saddr, caddr;
-    int server, client, optval;
+    struct epoll_event ev, events[SMSA_MAX_EVENTS];
+    SMSA_CONNECTION *conn;
+    int server, epfd, nev, i, more, cfd, rc;
+
+    // Connect to the replicas first, they get every change from the start
+    if ( smsa_start_replication() == -1 ) {
+	smsa_stop_replication();
+	return( -1 );
+    }
+
+    // The io_uring engine has its own loop
+    if ( smsa_server_uring ) {
+	rc = smsa_server_uring_loop();
+	smsa_stop_replication();
+	return( rc );
+    }
+
+    // Set the signal handler
+    new_action.sa_handler = smsa_signal_handler;
+    new_action.sa_flags = SA_NODEFER | SA_ONSTACK;
+    sigemptyset( &new_action.sa_mask );
+    sigaction( SIGINT, &new_action, NULL );
+
+    // Create the listening socket
+    if ( (server = smsa_server_listen()) == -1 ) {
+	return( -1 );
+    }
+
+    // Setup the event set, starting with the listening socket
+    if ( (epfd = epoll_create1(0)) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA epoll_create1() failed : [%s]", strerror(errno) );
+	smsa_error_number = SMSA_NET_ERROR;
+	close( server );
+	return( -1 );
+    }
+    smsa_server_epfd = epfd;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if ( epoll_ctl(epfd, EPOLL_CTL_ADD, server, &ev) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA epoll_ctl() failed : [%s]", strerror(errno) );
+	smsa_error_number = SMSA_NET_ERROR;
+	close( epfd );
+	close( server );
+	return( -1 );
+    }
+
+    // Start the drum workers, if any, and listen for their completions
+    if ( smsa_server_workers > 0 ) {
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &smsa_completion_marker;
+	if ( ((cfd = smsa_start_workers()) == -1) || (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) == -1) ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA unable to setup drum workers, aborting." );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    close( epfd );
+	    close( server );
+	    return( -1 );
+	}
+    }
+
+    // Wait until server is complete
+    smsa_server_shutdown = 0;
+    while ( ! smsa_server_shutdown ) {
+
+	// Wait for events, just poll if there are connections with work left
+	if ( (smsa_ready_head == NULL) && (smsa_shm_head != NULL) ) {
+	    smsa_server_poll_rings();
+	}
+	nev = epoll_wait( epfd, events, SMSA_MAX_EVENTS, (smsa_ready_head != NULL) ? 0 : -1 );
+	if ( nev == -1 ) {
+	    if ( errno == EINTR ) {
+		continue;
+	    }
+	    logMessage( LOG_ERROR_LEVEL, "SMSA server wait failued, aborting." );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    break;
+	}
+
+	// Note which connections have something to do
+	for ( i=0; i<nev; i++ ) {
+	    if ( (conn = events[i].data.ptr) == NULL ) {
+		if ( smsa_server_accept(server, epfd) == -1 ) {
+		    smsa_server_shutdown = 1;
+		}
+		continue;
+	    }
+	    if ( events[i].data.ptr == &smsa_completion_marker ) {
+		smsa_server_complete();
+		continue;
+	    }
+	    if ( events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR) ) {
+		conn->readable = 1;
+	    }
+	    smsa_ready_connection( conn );
+	}
+
+	// Give every ready connection one turn
+	for ( i = smsa_ready_count(); i > 0; i-- ) {
+	    conn = smsa_next_ready();
+	    if ( (more = smsa_server_service(conn)) == -1 ) {
+		smsa_close_connection( conn );
+	    } else if ( more ) {
+		smsa_ready_connection( conn );
+	    }
+	}
+    }
+
+    // Log and shutdowmn, return
+    logMessage( LOG_INFO_LEVEL, "Shutting down SMSA server ..." );
+    if ( smsa_server_workers > 0 ) {
+	smsa_stop_workers();
+	smsa_server_complete();
+    }
+    smsa_stop_replication();
+    while ( (conn = smsa_next_ready()) != NULL ) {
+	smsa_close_connection( conn );
+    }
+    close( epfd );
+    close( server );
+    if ( smsa_unix_path != NULL ) {
+	unlink( smsa_unix_path );
+    }
+    return( 0 );
+}
+
+//
+// Local Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_listen
+// Description  : Create the listening socket, on the TCP port or (when
+//                smsa_unix_path is set) a unix socket for local clients
+//
+// Inputs       : none
+// Outputs      : the listening socket, -1 if failure
+
+int smsa_server_listen( void ) {
+
+    // Local variables
+    struct sockaddr_in saddr;
+    struct sockaddr_un uaddr;
+    struct sockaddr *addr;
+    socklen_t addrlen;
+    int server, optval;
+
+    // Create the socket
+    if ( (server=socket((smsa_unix_path != NULL) ? AF_UNIX : AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0)) == -1 ) {
+	// Error out
+	logMessage( LOG_ERROR_LEVEL, "SMSA socket() create failed : [%s]", strerror(errno) );
+	smsa_error_number = SMSA_NET_ERROR;
+	return( -1 );
+    }
+
+    if ( smsa_unix_path != NULL ) {
+
+	// Setup the path, removing any left by an earlier server
+	memset( &uaddr, 0x0, sizeof(uaddr) );
+	uaddr.sun_family = AF_UNIX;
+	if ( strlen(smsa_unix_path) >= sizeof(uaddr.sun_path) ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA unix socket path too long [%s]", smsa_unix_path );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    close( server );
+	    return( -1 );
+	}
+	strcpy( uaddr.sun_path, smsa_unix_path );
+	unlink( smsa_unix_path );
+	addr = (struct sockaddr *)&uaddr;
+	addrlen = sizeof(uaddr);
+
+    } else {
+
+	// Setup so we can reuse the address
+	optval = 1;
+	if ( setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) != 0) {
+	    // Error out
+	    logMessage( LOG_ERROR_LEVEL, "SMSA set socket option create failed : [%s]", strerror(errno) );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    close( server );
+	    return( -1 );
+	}
+
+	// Setup address and bind the server to a particular port 
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(smsa_tcp_port);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr = (struct sockaddr *)&saddr;
+	addrlen = sizeof(saddr);
+    }
+
+    // Now bind to the server socket
+    if ( bind(server, addr, addrlen) == -1 ) {
+	// Error out
+	logMessage( LOG_ERROR_LEVEL, "SMSA bind() create failed : [%s]", strerror(errno) );
+	smsa_error_number = SMSA_NET_ERROR;
+	close( server );
+	return( -1 );
+    }
+    if ( smsa_unix_path != NULL ) {
+	logMessage( LOG_INFO_LEVEL, "Server bound and listening on [%s]", smsa_unix_path );
+    } else {
+	logMessage( LOG_INFO_LEVEL, "Server bound and listening on port [%d]", smsa_tcp_port );
+    }
+
+    // Listen for incoming connection
+    if ( listen( server, smsa_server_backlog ) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA listen() create failed : [%s]", strerror(errno) );
+	smsa_error_number = SMSA_NET_ERROR;
+	close( server );
+	return( -1 );
+    }
+    return( server );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_accept
+// Description  : Accept every pending connection and add it to the event set
+//
+// Inputs       : server - the listening socket
+//                epfd - the epoll instance
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_server_accept( int server, int epfd ) {
+
+    // Local variables
+    struct sockaddr_storage caddr;
+    struct sockaddr_in *inaddr = (struct sockaddr_in *)&caddr;
+    struct epoll_event ev;
+    SMSA_CONNECTION *conn;
     unsigned int inet_len;
+    int client;
+
+    // Keep accepting until there is nobody left waiting
+    while ( 1 ) {
+	inet_len = sizeof(caddr);
+	if ( (client = accept4(server, (struct sockaddr *)&caddr, &inet_len, SOCK_NONBLOCK)) == -1 ) {
+	    if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) ) {
+		return( 0 );
+	    }
+	    if ( (errno == EMFILE) || (errno == ENFILE) || (errno == ECONNABORTED) ) {
+		// Out of handles or the client went away, try again later
+		logMessage( LOG_WARNING_LEVEL, "SMSA server accept failed : [%s]", strerror(errno) );
+		return( 0 );
+	    }
+	    logMessage( LOG_ERROR_LEVEL, "SMSA server accept failued, aborting." );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    return( -1 );
+	}
+
+	// Setup the connection state and buffers
+	if ( ((conn = calloc(1, sizeof(SMSA_CONNECTION))) == NULL) ||
+		((conn->rbuf = malloc(SMSA_CONN_BUFFER_SIZE)) == NULL) ||
+		((conn->wbuf = malloc(SMSA_CONN_BUFFER_SIZE)) == NULL) ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA server out of memory for connection" );
+	    if ( conn != NULL ) {
+		free( conn->rbuf );
+		free( conn );
+	    }
+	    close( client );
+	    continue;
+	}
+	conn->sock = client;
+	conn->doorbell = conn->passed[0] = conn->passed[1] = conn->slot = -1;
+	conn->version = SMSA_NET_VERSION_1;
+	if ( caddr.ss_family == AF_INET ) {
+	    snprintf( conn->name, sizeof(conn->name), "%s/%d", inet_ntoa(inaddr->sin_addr), ntohs(inaddr->sin_port) );
+	    smsa_server_nodelay( client );
+	} else {
+	    snprintf( conn->name, sizeof(conn->name), "unix/%d", client );
+	}
+	conn->weight = smsa_server_weight( conn->name );
+
+	// Now watch it for input and output
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if ( epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) == -1 ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA epoll_ctl() failed : [%s]", strerror(errno) );
+	    smsa_close_connection( conn );
+	    continue;
+	}
+
+	// Log the creation of the new connection, it may already have data
+	logMessage( LOG_INFO_LEVEL, "Server new client connection [%s]", conn->name );
+	conn->readable = 1;
+	smsa_ready_connection( conn );
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_nodelay
+// Description  : Turn off Nagle on a TCP connection.  Responses are small
+//                and (with drum workers) finish one at a time, held back
+//                they wait on the delayed ack of a client that is batching
+//                its requests and has nothing to send.
+//
+// Inputs       : sock - the connection
+// Outputs      : none
+
+void smsa_server_nodelay( int sock ) {
+
+    // Local variables
+    int on = 1;
+
+    if ( setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ) {
+	logMessage( LOG_WARNING_LEVEL, "SMSA setsockopt(TCP_NODELAY) failed : [%s]", strerror(errno) );
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_service
+// Description  : Give a connection its turn.  Read as much as the client has
+//                sent (and there is room for), answer the complete requests
+//                its deficit covers in batches, and send what responses the
+//                socket takes.
+//
+// Inputs       : conn - the connection to service
+// Outputs      : 1 if there is more to do, 0 if not, -1 if closed or failed
+
+int smsa_server_service( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    SMSA_REQUEST batch[SMSA_SERVER_QUANTUM], *req;
+    unsigned char *block;
+    int rb, pos, used, blkbytes, served, count, cost;
+    uint64_t waited;
+    uint32_t op, id;
+    uint16_t flags, seq;
+    int16_t ret;
+
+    // Clients on shared memory are served from their rings
+    if ( conn->shm != NULL ) {
+	return( smsa_server_service_shm(conn) );
+    }
+
+    // Move any replies the workers finished to the send buffer
+    smsa_server_emit( conn );
+
+    // Read whatever the client has queued up
+    while ( conn->readable && (conn->rlen < SMSA_CONN_BUFFER_SIZE) ) {
+	if ( (rb = smsa_server_recv(conn, &conn->rbuf[conn->rlen], SMSA_CONN_BUFFER_SIZE-conn->rlen)) > 0 ) {
+	    conn->rlen += rb;
+	} else if ( rb == 0 ) {
+	    logMessage( LOG_INFO_LEVEL, "SMSA client socket closed on rd [%s]", conn->name );
+	    return( -1 );
+	} else if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+	    conn->readable = 0;
+	} else if ( errno != EINTR ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA receive failed : [%s]", strerror(errno) );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    return( -1 );
+	}
+    }
+
+    // Gather the complete requests while there is room for the responses
+    // and the deficit covers them, the workers take theirs as they come,
+    // inline ones are done in batches
+    waited = smsa_server_begin_turn( conn );
+    pos = served = count = 0;
+    while ( smsa_server_room(conn) &&
+	    ((used = smsa_parse_packet(&conn->rbuf[pos], conn->rlen-pos, conn->version, &batch[count].op, &ret, &batch[count].id,
+		&batch[count].flags, &batch[count].seq, &batch[count].blkbytes, &batch[count].block)) > 0) ) {
+	req = &batch[count];
+	req->arg = ret;
+	if ( (cost = smsa_server_afford(conn, req->op, req->arg)) == 0 ) {
+	    break;
+	}
+	if ( req->op == SMSA_NET_SHM_ATTACH ) {
+	    // Everything after this (and the batch before it) comes through the rings
+	    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+	    conn->wlen += smsa_server_attach( conn, &conn->wbuf[conn->wlen] );
+	    count = 0;
+	    pos += used;
+	    break;
+	} else if ( smsa_server_workers > 0 ) {
+	    if ( ! smsa_server_dispatch(conn, req->op, req->arg, req->id, req->flags, req->seq, req->blkbytes, req->block) ) {
+		break;
+	    }
+	} else if ( (count = smsa_server_gather(conn, batch, count)) == SMSA_SERVER_QUANTUM ) {
+	    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+	    count = 0;
+	}
+	conn->deficit -= cost;
+	pos += used;
+	served ++;
+    }
+    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+    if ( pos > 0 ) {
+	logMessage( LOG_INFO_LEVEL, "Received %d requests (%d bytes) on [%s]", served, pos, conn->name );
+    }
+    memmove( conn->rbuf, &conn->rbuf[pos], conn->rlen-pos );
+    conn->rlen -= pos;
+    smsa_server_emit( conn );
+
+    // Send the responses
+    if ( smsa_flush_connection(conn) == -1 ) {
+	return( -1 );
+    }
+
+    // A malformed request ends the connection
+    if ( smsa_parse_packet(conn->rbuf, conn->rlen, conn->version, &op, &ret, &id, &flags, &seq, &blkbytes, &block) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA received malformed packet on [%s]", conn->name );
+	smsa_error_number = SMSA_NET_ERROR;
+	return( -1 );
+    }
+    smsa_server_end_turn( conn, waited, served, smsa_server_waiting(conn->rbuf, conn->rlen, conn->version) );
+
+    // If output is backed up wait for the socket to drain (EPOLLOUT), else go
+    // again while there is input left
+    if ( conn->shm != NULL ) {
+	return( 1 );
+    }
+    if ( (conn->wlen > 0) || conn->blocked ) {
+	return( 0 );
+    }
+    return( (conn->readable && (conn->rlen < SMSA_CONN_BUFFER_SIZE)) ||
+	    (smsa_server_room(conn) && (smsa_parse_packet(conn->rbuf, conn->rlen, conn->version, &op, &ret, &id, &flags, &seq, &blkbytes, &block) > 0)) ||
+	    smsa_server_reply_ready(conn) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_service_shm
+// Description  : Give a shared memory connection its turn.  Requests are
+//                parsed where they sit in the request ring and (inline)
+//                answered straight into the response ring.  The socket only
+//                signals the client has gone away.
+//
+// Inputs       : conn - the connection to service
+// Outputs      : 1 if there is more to do, 0 if not, -1 if closed or failed
+
+int smsa_server_service_shm( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    unsigned char *slot, *block, byte;
+    int used, blkbytes, served, bytes, cost;
+    uint64_t count, waited;
+    uint32_t op, id;
+    uint16_t flags, seq;
+    int16_t ret;
+
+    // Clear the doorbell and check the client is still there
+    if ( conn->readable ) {
+	conn->readable = 0;
+	if ( (read(conn->doorbell, &count, sizeof(count)) == -1) && (errno != EAGAIN) ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA doorbell read failed : [%s]", strerror(errno) );
+	}
+	if ( (used = recv(conn->sock, &byte, 1, MSG_DONTWAIT)) == 0 ) {
+	    logMessage( LOG_INFO_LEVEL, "SMSA client socket closed on rd [%s]", conn->name );
+	    return( -1 );
+	} else if ( (used > 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA unexpected socket traffic on [%s]", conn->name );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    return( -1 );
+	}
+    }
+
+    // Process the requests waiting in the ring that the deficit covers
+    smsa_server_emit( conn );
+    waited = smsa_server_begin_turn( conn );
+    served = bytes = 0;
+    while ( smsa_server_room(conn) && ((slot = smsa_ring_peek(&conn->shm->requests)) != NULL) ) {
+	if ( (used = smsa_parse_packet(slot, SMSA_NET_MAX_PACKET, conn->version, &op, &ret, &id, &flags, &seq, &blkbytes, &block)) <= 0 ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA received malformed packet on [%s]", conn->name );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    return( -1 );
+	}
+	if ( (cost = smsa_server_afford(conn, op, ret)) == 0 ) {
+	    break;
+	}
+	if ( smsa_server_workers > 0 ) {
+	    if ( ! smsa_server_dispatch(conn, op, ret, id, flags, seq, blkbytes, block) ) {
+		break;
+	    }
+	} else {
+	    smsa_server_process_packet( conn, op, ret, id, flags, seq, blkbytes, block, smsa_ring_slot(&conn->shm->responses) );
+	    smsa_ring_publish( &conn->shm->responses, -1 );
+	}
+	smsa_ring_consume( &conn->shm->requests );
+	conn->deficit -= cost;
+	bytes += used;
+	served ++;
+    }
+    if ( served > 0 ) {
+	logMessage( LOG_INFO_LEVEL, "Received %d requests (%d bytes) on [%s]", served, bytes, conn->name );
+    }
+    smsa_server_end_turn( conn, waited, served, smsa_ring_count(&conn->shm->requests) );
+    smsa_server_emit( conn );
+
+    // Go again while there are requests (or replies) we can move
+    if ( conn->blocked ) {
+	return( 0 );
+    }
+    return( (smsa_server_room(conn) && (smsa_ring_peek(&conn->shm->requests) != NULL)) ||
+	    (smsa_server_reply_ready(conn) && (smsa_ring_slot(&conn->shm->responses) != NULL)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_recv
+// Description  : Receive bytes from a client, keeping any handles it passes
+//                along (a unix socket client attaching shared memory)
+//
+// Inputs       : conn - the connection
+//                buf - where to put the bytes
+//                len - the room in buf
+// Outputs      : the bytes received, 0 if closed, -1 if failure
+
+int smsa_server_recv( SMSA_CONNECTION *conn, unsigned char *buf, int len ) {
+
+    // Local variables
+    char cbuf[CMSG_SPACE(2*sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int rb, fds[2], nfd, i;
+
+    // Receive, with room for the handles
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset( &msg, 0x0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if ( (rb = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC)) <= 0 ) {
+	return( rb );
+    }
+
+    // Keep the latest handles passed (the memfd and the doorbell)
+    for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+	if ( (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ) {
+	    continue;
+	}
+	nfd = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy( fds, CMSG_DATA(cmsg), ((nfd < 2) ? nfd : 2) * sizeof(int) );
+	for ( i=0; i<2; i++ ) {
+	    if ( conn->passed[i] != -1 ) {
+		close( conn->passed[i] );
+	    }
+	    conn->passed[i] = (i < nfd) ? fds[i] : -1;
+	}
+    }
+    return( rb );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_attach
+// Description  : Move a connection onto the shared memory rings the client
+//                passed, its doorbell joins the event set
+//
+// Inputs       : conn - the connection
+//                out - where to assemble the response
+// Outputs      : the number of bytes in the response
+
+int smsa_server_attach( SMSA_CONNECTION *conn, unsigned char *out ) {
+
+    // Local variables
+    struct epoll_event ev;
+    int16_t ret = -1;
+
+    // Needs both handles, and nothing outstanding on the socket
+    if ( (conn->passed[0] == -1) || (conn->passed[1] == -1) || (conn->jobs != NULL) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA bad shared memory attach on [%s]", conn->name );
+    } else if ( (conn->shm = smsa_shm_map(conn->passed[0])) != NULL ) {
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = conn;
+	if ( epoll_ctl(smsa_server_epfd, EPOLL_CTL_ADD, conn->passed[1], &ev) == -1 ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA epoll_ctl() failed : [%s]", strerror(errno) );
+	    smsa_shm_unmap( conn->shm );
+	    conn->shm = NULL;
+	} else {
+	    conn->doorbell = conn->passed[1];
+	    conn->passed[1] = -1;
+	    conn->snext = smsa_shm_head;
+	    smsa_shm_head = conn;
+	    logMessage( LOG_INFO_LEVEL, "Client [%s] moved to shared memory", conn->name );
+	    ret = 0;
+	}
+    }
+
+    // The mapping holds the segment, the file is no longer needed
+    if ( conn->passed[0] != -1 ) {
+	close( conn->passed[0] );
+	conn->passed[0] = -1;
+    }
+    return( smsa_pack_packet(out, conn->version, SMSA_NET_SHM_ATTACH, ret, 0, 0, 0, NULL, 0) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_poll_rings
+// Description  : Before sleeping, poll the request rings a while (requests
+//                are often moments away), then tell each client to ring its
+//                doorbell as the server is going to sleep
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_server_poll_rings( void ) {
+
+    // Local variables
+    SMSA_CONNECTION *conn;
+    int i;
+
+    // Spin on the rings
+    for ( i=0; i<smsa_shm_spins; i++ ) {
+	for ( conn = smsa_shm_head; conn != NULL; conn = conn->snext ) {
+	    if ( !conn->blocked && (smsa_ring_peek(&conn->shm->requests) != NULL) ) {
+		smsa_ready_connection( conn );
+	    }
+	}
+	if ( smsa_ready_head != NULL ) {
+	    return;
+	}
+    }
+
+    // Arm the doorbells, catching anything that arrived meanwhile
+    for ( conn = smsa_shm_head; conn != NULL; conn = conn->snext ) {
+	if ( !conn->blocked && !smsa_ring_arm(&conn->shm->requests) ) {
+	    smsa_ready_connection( conn );
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_room
+// Description  : Check if a connection can take another request, inline
+//                requests need room for their response in the send buffer
+//                (past those of the batch being gathered), worker requests
+//                just a free slot.
+//
+// Inputs       : conn - the connection
+// Outputs      : 1 if there is room, 0 if not
+
+int smsa_server_room( SMSA_CONNECTION *conn ) {
+
+    // Check whichever limit applies
+    if ( smsa_server_workers > 0 ) {
+	return( conn->njobs < SMSA_MAX_CONN_INFLIGHT );
+    }
+    if ( conn->shm != NULL ) {
+	return( smsa_ring_slot(&conn->shm->responses) != NULL );
+    }
+    return( conn->wlen+conn->reserved+SMSA_NET_MAX_PACKET <= SMSA_CONN_BUFFER_SIZE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_add_weight
+// Description  : Give the clients at an address a weight, the quanta they
+//                get each round when the server is busy (every other client
+//                gets one).  The spec is <client>=<weight>, where the client
+//                is an IP address or "unix" for the unix socket clients.
+//
+// Inputs       : spec - the client and its weight
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_add_weight( char *spec ) {
+
+    // Local variables
+    char *eq = strchr( spec, '=' );
+    int weight;
+
+    // Check the spec and that there is room for it
+    if ( (eq == NULL) || (eq == spec) || (eq-spec >= sizeof(smsa_weight_clients[0])) ||
+	    (sscanf(eq+1, "%d", &weight) != 1) || (weight < 1) || (weight > SMSA_MAX_WEIGHT) ||
+	    (smsa_weight_count == SMSA_MAX_WEIGHTS) ) {
+	return( -1 );
+    }
+
+    // Add it to the table
+    memcpy( smsa_weight_clients[smsa_weight_count], spec, eq-spec );
+    smsa_weight_clients[smsa_weight_count][eq-spec] = 0x0;
+    smsa_weight_values[smsa_weight_count] = weight;
+    smsa_weight_count ++;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_weight
+// Description  : Find the weight of a newly accepted connection
+//
+// Inputs       : name - the connection name (its address/port)
+// Outputs      : the weight (1 unless given one)
+
+int smsa_server_weight( char *name ) {
+
+    // Local variables
+    int i, len;
+
+    // Match the address part of the name
+    for ( i=0; i<smsa_weight_count; i++ ) {
+	len = strlen( smsa_weight_clients[i] );
+	if ( (strncmp(name, smsa_weight_clients[i], len) == 0) && (name[len] == '/') ) {
+	    return( smsa_weight_values[i] );
+	}
+    }
+    return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_begin_turn
+// Description  : Start a connection's turn.  Connections share the server by
+//                deficit round robin: each turn adds a quantum per unit of
+//                weight to the connection's deficit, and each request it
+//                answers takes its cost (the blocks it moves) back out, so a
+//                client sweeping the array in big ranges waits its turn
+//                behind the small requests of everyone else.
+//
+// Inputs       : conn - the connection
+// Outputs      : how long it waited for the turn (usecs)
+
+uint64_t smsa_server_begin_turn( SMSA_CONNECTION *conn ) {
+    conn->deficit += SMSA_SERVER_QUANTUM*conn->weight;
+    return( smsa_server_now() - conn->since );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_afford
+// Description  : Check the deficit of a connection covers the next request.
+//                When no other connection is waiting for a turn, the rounds
+//                it would have to wait are skipped.
+//
+// Inputs       : conn - the connection
+//                op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : the cost of the request, 0 if it has to wait for a turn
+
+int smsa_server_afford( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg ) {
+
+    // Local variables
+    int cost = smsa_server_cost( op, arg );
+
+    if ( (cost > conn->deficit) && (smsa_ready_head == NULL) ) {
+	conn->deficit = cost;
+    }
+    return( (cost <= conn->deficit) ? cost : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_end_turn
+// Description  : End a connection's turn, adding to its queueing statistics
+//                (logged when it closes).  A connection with nothing left
+//                gives up the rest of its deficit.
+//
+// Inputs       : conn - the connection
+//                waited - how long it waited for the turn (usecs)
+//                served - the requests answered in the turn
+//                left - the complete requests left waiting
+// Outputs      : none
+
+void smsa_server_end_turn( SMSA_CONNECTION *conn, uint64_t waited, int served, int left ) {
+
+    // Keep the statistics of the turns that did something
+    if ( served > 0 ) {
+	conn->served += served;
+	conn->turns ++;
+	conn->waited += waited;
+	if ( waited > conn->max_wait ) {
+	    conn->max_wait = waited;
+	}
+	conn->depth += served+left;
+	if ( served+left > conn->max_depth ) {
+	    conn->max_depth = served+left;
+	}
+    }
+
+    // Nothing left, or no more saved up than the largest request needs
+    if ( left == 0 ) {
+	conn->deficit = 0;
+    } else if ( conn->deficit > SMSA_SERVER_QUANTUM*conn->weight+SMSA_MAX_RANGE_BLOCKS ) {
+	conn->deficit = SMSA_SERVER_QUANTUM*conn->weight+SMSA_MAX_RANGE_BLOCKS;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_waiting
+// Description  : Count the complete requests in a receive buffer
+//
+// Inputs       : buf - the received bytes
+//                avail - the number of bytes in buf
+//                version - the protocol of the connection
+// Outputs      : the number of complete requests
+
+int smsa_server_waiting( unsigned char *buf, int avail, int version ) {
+
+    // Local variables
+    unsigned char *block;
+    int used, blkbytes, count = 0;
+    uint32_t op, id;
+    uint16_t flags, seq;
+    int16_t ret;
+
+    // Walk the packets
+    while ( (used = smsa_parse_packet(buf, avail, version, &op, &ret, &id, &flags, &seq, &blkbytes, &block)) > 0 ) {
+	buf += used;
+	avail -= used;
+	count ++;
+    }
+    return( count );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_cost
+// Description  : Work out the cost of a request for fair queueing, the
+//                blocks it moves or signs (at least one, at most a range)
+//
+// Inputs       : op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : the cost
+
+int smsa_server_cost( uint32_t op, uint16_t arg ) {
+
+    // Local variables
+    int blocks = (smsa_request_bytes(op, arg)+smsa_reply_bytes(op, arg)+SMSA_BLOCK_SIZE-1) / SMSA_BLOCK_SIZE;
+
+    if ( SMSA_OPCODE(op) == SMSA_SIGN_RANGE ) {
+	blocks = arg;
+    }
+    if ( blocks < 1 ) {
+	return( 1 );
+    }
+    return( (blocks > SMSA_MAX_RANGE_BLOCKS) ? SMSA_MAX_RANGE_BLOCKS : blocks );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_now
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in microseconds
+
+uint64_t smsa_server_now( void ) {
+
+    // Local variables
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return( (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_process_packet
+// Description  : Perform a received request and assemble its response (a
+//                batch of one)
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+//                arg - the argument of the request (its return field)
+//                id - the request id (protocol 2)
+//                flags - the request flags (protocol 2)
+//                seq - the write a read must follow (SMSA_NET_FLAG_AFTER)
+//                blkbytes - the number of block bytes in the request
+//                block - the block(s) in the request (NULL if none)
+//                out - where to assemble the response
+// Outputs      : the number of bytes in the response
+
+int smsa_server_process_packet( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, uint32_t id, uint16_t flags, uint16_t seq, int blkbytes, unsigned char *block, unsigned char *out ) {
+
+    // Local variables
+    SMSA_REQUEST req = { op, arg, id, flags, seq, blkbytes, block };
+
+    return( smsa_server_execute_batch(conn, &req, 1, out) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_gather
+// Description  : Add the request parsed into the next entry of a batch,
+//                reserving room in the send buffer for its response
+//
+// Inputs       : conn - the connection the request came in on
+//                batch - the batch being gathered
+//                count - the number of requests already in it
+// Outputs      : the number of requests in the batch
+
+int smsa_server_gather( SMSA_CONNECTION *conn, SMSA_REQUEST *batch, int count ) {
+
+    // An encoded response is never larger than the plain one
+    conn->reserved += SMSA_NET_HEADER_V2_SIZE + smsa_reply_bytes( batch[count].op, batch[count].arg );
+    return( count + 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_execute_batch
+// Description  : Perform a batch of requests from a connection, assembling
+//                their responses back to back (they go out in one send).
+//                The client's heads are loaded into a session once for
+//                the batch and saved once after it.
+//
+// Inputs       : conn - the connection the requests came in on
+//                batch - the requests, in the order they arrived
+//                count - the number of requests
+//                out - where to assemble the responses
+// Outputs      : the number of bytes in the responses
+
+int smsa_server_execute_batch( SMSA_CONNECTION *conn, SMSA_REQUEST *batch, int count, unsigned char *out ) {
+
+    // Local variables
+    SMSA_SESSION sess;
+    int i, len = 0;
+
+    // Nothing gathered
+    if ( count == 0 ) {
+	return( 0 );
+    }
+
+    // Perform them with this client's heads
+    sess.drum = conn->drum;
+    sess.block = conn->heads[conn->drum];
+    for ( i=0; i<count; i++ ) {
+	len += smsa_server_perform( conn, &sess, &batch[i], &out[len] );
+    }
+    conn->drum = sess.drum;
+    conn->heads[conn->drum] = sess.block;
+    conn->reserved = 0;
+
+    // The writes are durable before their responses go out (one sync for
+    // all), they fail if they could not be made so
+    if ( smsa_journal_commit() != 0 ) {
+	smsa_server_fail_writes( batch, count, out );
+    }
+    return( len );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_fail_writes
+// Description  : Turn the responses to the changes in a batch into failures
+//                (when their journal records could not be committed)
+//
+// Inputs       : batch - the requests, in the order they arrived
+//                count - the number of requests
+//                out - the responses assembled for them, back to back
+// Outputs      : none
+
+void smsa_server_fail_writes( SMSA_REQUEST *batch, int count, unsigned char *out ) {
+
+    // Local variables
+    int16_t ret = htons( -1 );
+    uint16_t len;
+    int i, idx = 0;
+
+    // Each response starts with its length, the result follows the opcode
+    for ( i=0; i<count; i++ ) {
+	if ( smsa_replicated_op(batch[i].op) ) {
+	    memcpy( &out[idx+sizeof(uint16_t)+sizeof(uint32_t)], &ret, sizeof(ret) );
+	}
+	memcpy( &len, &out[idx], sizeof(len) );
+	idx += ntohs( len );
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_perform
+// Description  : Perform a request of a batch and assemble its response.
+//                The array stays mounted while any client has it mounted,
+//                so only the first mount and the last unmount reach it.
+//
+// Inputs       : conn - the connection the request came in on
+//                sess - the client's heads
+//                req - the request
+//                out - where to assemble the response
+// Outputs      : the number of bytes in the response
+
+int smsa_server_perform( SMSA_CONNECTION *conn, SMSA_SESSION *sess, SMSA_REQUEST *req, unsigned char *out ) {
+
+    // Local variables
+    unsigned char scratch[SMSA_MAX_RANGE_BYTES], *block = req->block;
+    SMSA_DRUM_ID drum;
+    uint32_t bid;
+    int16_t ret;
+    uint16_t rseq = 0;
+    int rdbytes, blkbytes = req->blkbytes, version = conn->version;
+
+    // Encoded writes are expanded into the scratch block, reads go to it,
+    // writes need all of their data
+    rdbytes = smsa_reply_bytes( req->op, req->arg );
+    if ( (block != NULL) && (req->flags & SMSA_NET_FLAG_ENCODED) ) {
+	blkbytes = smsa_decode_blocks( scratch, sizeof(scratch), block, blkbytes );
+	block = scratch;
+    }
+    if ( (block == NULL) || (rdbytes > blkbytes) ) {
+	block = scratch;
+    }
 
-    // Set the signal handler
-    new_action.sa_handler = smsa_signal_handler;
-    new_action.sa_flags = SA_NODEFER | SA_ONSTACK;
-    sigaction( SIGINT, &new_action, NULL );
+    // Where the batch left the client's heads
+    drum = sess->drum;
+    bid = sess->block;
+    if ( blkbytes < smsa_request_bytes(req->op, req->arg) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA request short of data [%u, %d bytes]", req->op, blkbytes );
+	ret = -1;
+    } else if ( ! smsa_reply_fits(req->op, req->arg) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA request reply too large [%u, arg %u]", req->op, req->arg );
+	ret = -1;
+    } else if ( ! smsa_server_owns(conn, req->op, drum) || smsa_server_stale(conn, req->flags, req->seq) ||
+	    ! smsa_server_fits(conn, req->op, req->arg) ) {
+	ret = -1;
+    } else if ( ! smsa_server_mount_needed(conn, req->op) ) {
+	ret = 0;
+    } else {
+	// Perform it, passing changes on to replicas
+	ret = smsa_session_operation( sess, req->op, req->arg, block );
+	if ( ret == 0 ) {
+	    rseq = smsa_replicate( req->op, req->arg, drum, bid, block );
+	}
+	if ( conn->replication && smsa_replicated_op(req->op) ) {
+	    smsa_replica_seq = req->id;
+	}
+    }
+    ret = smsa_server_negotiate( conn, req->op, req->arg, ret, block );
 
-    // Create the socket
-    if ( (server=socket(AF_INET, SOCK_STREAM, 0)) == -1 ) {
-	// Error out
-	logMessage( LOG_ERROR_LEVEL, "SMSA socket() create failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	return( -1 );
+    // Assemble the response, in the protocol the request came in
+    return( smsa_pack_packet(out, version, req->op, ret, req->id, smsa_server_reply_flags(conn), rseq, (rdbytes > 0) ? block : NULL, rdbytes) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_mount_needed
+// Description  : Track which clients have the array mounted, only the first
+//                mount and the last unmount are passed on to the array
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+// Outputs      : 1 if the operation must be performed, 0 if not
+
+int smsa_server_mount_needed( SMSA_CONNECTION *conn, uint32_t op ) {
+
+    // Count the mounts, a client only holds one
+    if ( SMSA_OPCODE(op) == SMSA_MOUNT ) {
+	if ( conn->mounted ) {
+	    return( 0 );
+	}
+	conn->mounted = 1;
+	memset( conn->heads, 0x0, sizeof(conn->heads) );
+	conn->drum = 0;
+	return( smsa_mounted_clients++ == 0 );
+    }
+    if ( SMSA_OPCODE(op) == SMSA_UNMOUNT ) {
+	if ( ! conn->mounted ) {
+	    return( 0 );
+	}
+	conn->mounted = 0;
+	return( --smsa_mounted_clients == 0 );
     }
 
-    // Setup so we can reuse the address
-    optval = 1;
-    if ( setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) != 0) {
-	// Error out
-	logMessage( LOG_ERROR_LEVEL, "SMSA set socket option create failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	close( server );
-	return( -1 );
+    // Everything else goes to the array
+    return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_owns
+// Description  : Check a request works on a drum this server owns, when the
+//                drums are spread over several servers (-d)
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+//                drum - the drum the client's head is on
+// Outputs      : 1 if the drum is ours (or none is involved), 0 if not
+
+int smsa_server_owns( SMSA_CONNECTION *conn, uint32_t op, SMSA_DRUM_ID drum ) {
+
+    // Local variables
+    int cmd = SMSA_OPCODE(op);
+
+    // Mounts are for every server, the rest work on a drum named in the
+    // request or the one the client's head is on
+    if ( (cmd == SMSA_MOUNT) || (cmd == SMSA_UNMOUNT) ) {
+	return( 1 );
+    }
+    if ( (cmd == SMSA_SEEK_DRUM) || (cmd == SMSA_BLOCK_SIGN) || (cmd == SMSA_READ_RANGE) || (cmd == SMSA_WRITE_RANGE) ||
+	    (cmd == SMSA_WRITE_AT) || (cmd == SMSA_SIGN_RANGE) ) {
+	drum = SMSA_DRUMID(op);
+    }
+    if ( (drum < smsa_server_first_drum) || (drum > smsa_server_last_drum) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA client [%s] asked for drum %d, served are %d-%d", conn->name,
+		drum, smsa_server_first_drum, smsa_server_last_drum );
+	return( 0 );
+    }
+    return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_fits
+// Description  : Check a client that mounts knows the geometry of the array,
+//                one that does not ask for it at mount (it predates it)
+//                assumes the default one
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+//                arg - the argument of the request
+// Outputs      : 1 if the client knows the geometry (or it is not a mount), 0 if not
+
+int smsa_server_fits( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg ) {
+
+    if ( (SMSA_OPCODE(op) == SMSA_MOUNT) && !(arg & SMSA_NET_FEATURE_GEOMETRY) &&
+	    ((smsa_geometry.drums != SMSA_DISK_ARRAY_SIZE) || (smsa_geometry.blocks != SMSA_MAX_BLOCK_ID) ||
+	     (smsa_geometry.block_size != SMSA_BLOCK_SIZE)) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA client [%s] does not know the array geometry, refusing mount", conn->name );
+	return( 0 );
     }
+    return( 1 );
+}
 
-    // Setup address and bind the server to a particular port 
-    saddr.sin_family = AF_INET;
-    saddr.sin_port = htons(SMSA_DEFAULT_PORT);
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_stale
+// Description  : Check if a read has to follow writes of our primary that
+//                have not reached us yet (the client then asks the primary).
+//                Only the low 16 bits of the sequence numbers travel, the
+//                primary keeps replicas less than half of that behind.
+//
+// Inputs       : conn - the connection the request came in on
+//                flags - the request flags
+//                seq - the write the read must follow (SMSA_NET_FLAG_AFTER)
+// Outputs      : 1 if the read would be stale, 0 if not
 
-    // Now bind to the server socket
-    if ( bind(server, (struct sockaddr *)&saddr, sizeof(struct sockaddr)) == -1 ) {
-	// Error out
-	logMessage( LOG_ERROR_LEVEL, "SMSA bind() create failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	close( server );
-	server = -1;
-	return( -1 );
+int smsa_server_stale( SMSA_CONNECTION *conn, uint16_t flags, uint16_t seq ) {
+
+    if ( (flags & SMSA_NET_FLAG_AFTER) && ((int16_t)(seq - (uint16_t)smsa_replica_seq) > 0) ) {
+	logMessage( LOG_INFO_LEVEL, "Client [%s] reads after write %u, applied %u", conn->name,
+		seq, smsa_replica_seq & 0xffff );
+	return( 1 );
     }
-    logMessage( LOG_INFO_LEVEL, "Server bound and listening on port [%d]", SMSA_DEFAULT_PORT );
+    return( 0 );
+}
 
-    // Listen for incoming connection
-    if ( listen( server, SMSA_MAX_BACKLOG ) == -1 ) {
-	logMessage( LOG_ERROR_LEVEL, "SMSA listen() create failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	close( server );
-	server = -1;
-	return( -1 );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_negotiate
+// Description  : Pick the protocol for a connection.  A mount asks for a
+//                version in its argument (0 from clients that predate
+//                protocol 2) and is answered with the version granted,
+//                along with the features (encoding, being our primary).
+//                Requests after the mount use it, until the unmount.  A
+//                mount asking for the geometry of the array gets it in the
+//                reply.
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+//                arg - the argument of the request
+//                ret - the result of the request
+//                reply - the block(s) of the reply
+// Outputs      : the result to return to the client
+
+int16_t smsa_server_negotiate( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, int16_t ret, unsigned char *reply ) {
+
+    // The geometry goes back whatever happened (smsa_reply_bytes has room)
+    if ( (SMSA_OPCODE(op) == SMSA_MOUNT) && (arg & SMSA_NET_FEATURE_GEOMETRY) ) {
+	smsa_pack_geometry( reply );
     }
 
-    // Wait until server is complete
-    smsa_server_shutdown = 0;
-    while ( ! smsa_server_shutdown ) {
+    // Failed requests change nothing
+    if ( ret == -1 ) {
+	return( ret );
+    }
 
-	// Select waiting for data
-	if ( smsa_wait_read( server ) == -1 ) {
-	    // error out
-	    logMessage( LOG_ERROR_LEVEL, "SMSA server wait failued, aborting." );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    close( server );
-	    server = -1;
-	    return( -1 );
+    // Grant up to protocol 2 (and block encoding with it), drop back to 1
+    // after the unmount
+    if ( (SMSA_OPCODE(op) == SMSA_MOUNT) && (arg > 0) ) {
+	conn->version = ((arg & SMSA_NET_VERSION_MASK) >= SMSA_NET_VERSION_2) ? SMSA_NET_VERSION_2 : SMSA_NET_VERSION_1;
+	conn->encoding = (conn->version >= SMSA_NET_VERSION_2) && (arg & SMSA_NET_FEATURE_ENCODE);
+	conn->replication = (conn->version >= SMSA_NET_VERSION_2) && (arg & SMSA_NET_FEATURE_REPLICA);
+	logMessage( LOG_INFO_LEVEL, "Client [%s] speaks protocol %d%s%s", conn->name, conn->version,
+		conn->encoding ? " (encoded blocks)" : "", conn->replication ? " (our primary)" : "" );
+	return( conn->version | (conn->encoding ? SMSA_NET_FEATURE_ENCODE : 0) |
+		(conn->replication ? SMSA_NET_FEATURE_REPLICA : 0) | (arg & SMSA_NET_FEATURE_GEOMETRY) );
+    }
+    if ( SMSA_OPCODE(op) == SMSA_UNMOUNT ) {
+	conn->version = SMSA_NET_VERSION_1;
+	conn->encoding = 0;
+	conn->replication = 0;
+    }
+    return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_dispatch
+// Description  : Hand a request to the worker owning its drum.  Operations
+//                on the whole array (mount, unmount, format) wait until the
+//                workers are idle and are then performed right here.
+//
+// Inputs       : conn - the connection the request came in on
+//                op - the opcode of the request
+//                arg - the argument of the request (its return field)
+//                id - the request id (protocol 2)
+//                flags - the request flags (protocol 2)
+//                seq - the write a read must follow (SMSA_NET_FLAG_AFTER)
+//                blkbytes - the number of block bytes in the request
+//                block - the block(s) in the request (NULL if none)
+// Outputs      : 1 if the request was taken, 0 if it has to wait
+
+int smsa_server_dispatch( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, uint32_t id, uint16_t flags, uint16_t seq, int blkbytes, unsigned char *block ) {
+
+    // Local variables
+    SMSA_JOB *job;
+    SMSA_SESSION sess;
+    int cmd = SMSA_OPCODE(op), barrier, wrbytes, rdbytes, failed = 0;
+
+    // Array wide operations go alone, and nothing passes one that is waiting
+    barrier = (cmd == SMSA_MOUNT) || (cmd == SMSA_UNMOUNT) || (cmd == SMSA_FORMAT_DRUM);
+    if ( conn->blocked || (smsa_barrier_waiting && !barrier) || (barrier && (smsa_jobs_inflight > 0)) ) {
+	if ( barrier ) {
+	    smsa_barrier_waiting = 1;
 	}
+	smsa_block_connection( conn );
+	return( 0 );
+    }
 
-	// Accept the connection
-	inet_len = sizeof(caddr);
-	if ( (client = accept( server, (struct sockaddr *)&caddr, &inet_len )) == -1 ) {
-	    // error out
-	    logMessage( LOG_ERROR_LEVEL, "SMSA server accept failued, aborting." );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    close( server );
-	    server = -1;
-	    return( -1 );
+    // Setup the job, it holds the request data and the reply (if there is no
+    // room for them the request just fails, if not even that it waits)
+    wrbytes = smsa_request_bytes( op, arg );
+    rdbytes = smsa_reply_bytes( op, arg );
+    if ( (job = calloc(1, sizeof(SMSA_JOB) + ((wrbytes > rdbytes) ? wrbytes : rdbytes))) == NULL ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA server out of memory for job [%u]", op );
+	if ( (job = calloc(1, sizeof(SMSA_JOB))) == NULL ) {
+	    return( 0 );
+	}
+	block = NULL;
+	wrbytes = rdbytes = 0;
+	failed = 1;
+    }
+    job->conn = conn;
+    job->op = op;
+    job->arg = arg;
+    job->id = id;
+    job->flags = flags;
+    job->version = conn->version;
+    job->from = conn->drum;
+    job->rdbytes = rdbytes;
+    if ( (block != NULL) && (flags & SMSA_NET_FLAG_ENCODED) ) {
+	blkbytes = smsa_decode_blocks( job->data, wrbytes, block, blkbytes );
+    } else if ( block != NULL ) {
+	memcpy( job->data, block, (blkbytes < wrbytes) ? blkbytes : wrbytes );
+    }
+
+    // Append to the connection's replies, in the order they arrived
+    job->cnext = NULL;
+    if ( conn->jobs_tail != NULL ) {
+	conn->jobs_tail->cnext = job;
+    } else {
+	conn->jobs = job;
+    }
+    conn->jobs_tail = job;
+    conn->njobs ++;
+
+    // Bad requests and array wide operations are done now
+    if ( (! failed) && (blkbytes < wrbytes) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA request short of data [%u, %d bytes]", op, blkbytes );
+	failed = 1;
+    } else if ( (! failed) && ! smsa_reply_fits(op, arg) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA request reply too large [%u, arg %u]", op, arg );
+	failed = 1;
+    }
+    if ( failed ) {
+	job->ret = -1;
+	job->done = 1;
+	return( 1 );
+    }
+    if ( ! smsa_server_owns(conn, op, conn->drum) || smsa_server_stale(conn, flags, seq) ||
+	    ! smsa_server_fits(conn, op, arg) ) {
+	job->ret = -1;
+	job->done = 1;
+	return( 1 );
+    }
+
+    // Writes from our primary count as applied once queued (nothing on the
+    // drum can pass them)
+    if ( conn->replication && smsa_replicated_op(op) ) {
+	smsa_replica_seq = id;
+    }
+    if ( barrier ) {
+	if ( smsa_server_mount_needed(conn, op) ) {
+	    sess.drum = conn->drum;
+	    sess.block = conn->heads[conn->drum];
+	    job->ret = smsa_session_operation( &sess, op, arg, job->data );
+	    if ( job->ret == 0 ) {
+		job->seq = smsa_replicate( op, arg, conn->drum, conn->heads[conn->drum], job->data );
+	    }
+	    conn->drum = sess.drum;
+	    conn->heads[conn->drum] = sess.block;
+	    if ( (smsa_journal_commit() != 0) && smsa_replicated_op(op) ) {
+		job->ret = -1;
+	    }
 	}
+	job->ret = smsa_server_negotiate( conn, op, arg, job->ret, job->data );
+	job->done = 1;
 
-	// Log the creation of the new connection, process the input data
-	logMessage( LOG_INFO_LEVEL, "Server new client connection [%s/%d]", inet_ntoa(caddr.sin_addr), caddr.sin_port );
-	smsa_server_handle_connection( client );
-	logMessage( LOG_INFO_LEVEL, "Closing client connection [%s/%d]", inet_ntoa(caddr.sin_addr), caddr.sin_port );
-	close( client );
+	// The workers are still idle, nothing will come along to release
+	// anyone that waited behind it
+	smsa_release_blocked();
+	return( 1 );
     }
 
-    // Log and shutdowmn, return
-    logMessage( LOG_INFO_LEVEL, "Shutting down SMSA server ..." );
-    close( server );
-    return( 0 );
+    // Route by drum, head relative operations work on the client's drum
+    if ( (cmd == SMSA_SEEK_DRUM) || (cmd == SMSA_BLOCK_SIGN) || (cmd == SMSA_READ_RANGE) || (cmd == SMSA_WRITE_RANGE) ||
+	    (cmd == SMSA_WRITE_AT) || (cmd == SMSA_SIGN_RANGE) ) {
+	job->drum = SMSA_DRUMID(op);
+	conn->drum = job->drum;
+    } else {
+	job->drum = conn->drum;
+    }
+    conn->inflight ++;
+    smsa_jobs_inflight ++;
+    smsa_submit_job( job );
+    return( 1 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Local Functions
+// Function     : smsa_server_complete
+// Description  : Collect the jobs the workers finished and wake their
+//                connections, releasing any waiting for the workers to idle
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_server_complete( void ) {
+
+    // Local variables
+    SMSA_JOB *jobs, *job;
+    SMSA_CONNECTION *conn;
+
+    // Mark each job done, wake or free its connection
+    jobs = smsa_completed_jobs();
+    while ( jobs != NULL ) {
+	job = jobs;
+	jobs = job->next;
+	conn = job->conn;
+	job->done = 1;
+	conn->inflight --;
+	smsa_jobs_inflight --;
+	if ( ! conn->closed ) {
+	    smsa_ready_connection( conn );
+	} else if ( (conn->inflight == 0) && (conn->pending == 0) ) {
+	    smsa_free_connection( conn );
+	}
+    }
+
+    // The workers are idle, let anyone waiting go first
+    if ( smsa_jobs_inflight == 0 ) {
+	smsa_release_blocked();
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : smsa_server_handle_connection
-// Description  : Handle a connection from a client process.
+// Function     : smsa_server_emit
+// Description  : Move the finished replies of the connection into its send
+//                buffer (or response ring), as far as there is room.
+//                Protocol 1 replies go in order, protocol 2 replies as they
+//                finish (unless flagged to stay behind earlier requests).
 //
-// Inputs       : sock - the socket filehandle of the clinet connection
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : conn - the connection
+// Outputs      : the number of replies moved
 
-int smsa_server_handle_connection( int sock ) {
+int smsa_server_emit( SMSA_CONNECTION *conn ) {
 
     // Local variables
-    int receiving = 1, blkbytes;
-    unsigned char block[SMSA_BLOCK_SIZE];
-    uint32_t op;
-    int16_t ret;
+    unsigned char *slot;
+    SMSA_JOB *job, *prev = NULL, **link = &conn->jobs;
+    int count = 0, waiting = 0;
+
+    // Skip the ones still being worked on (protocol 1 stops at the first)
+    while ( (job = *link) != NULL ) {
+	if ( !job->done || (waiting && (job->flags & SMSA_NET_FLAG_ORDERED)) ) {
+	    if ( job->version < SMSA_NET_VERSION_2 ) {
+		break;
+	    }
+	    waiting = 1;
+	    prev = job;
+	    link = &job->cnext;
+	    continue;
+	}
+	if ( conn->shm != NULL ) {
+	    if ( (slot = smsa_ring_slot(&conn->shm->responses)) == NULL ) {
+		break;
+	    }
+	    smsa_pack_packet( slot, job->version, job->op, job->ret, job->id, 0, job->seq,
+		    (job->rdbytes > 0) ? job->data : NULL, job->rdbytes );
+	    smsa_ring_publish( &conn->shm->responses, -1 );
+	} else if ( conn->wlen+SMSA_NET_HEADER_BYTES(job->version)+job->rdbytes <= SMSA_CONN_BUFFER_SIZE ) {
+	    conn->wlen += smsa_pack_packet( &conn->wbuf[conn->wlen], job->version, job->op, job->ret, job->id,
+		    smsa_server_reply_flags(conn), job->seq, (job->rdbytes > 0) ? job->data : NULL, job->rdbytes );
+	} else {
+	    break;
+	}
+	if ( (*link = job->cnext) == NULL ) {
+	    conn->jobs_tail = prev;
+	}
+	conn->njobs --;
+	free( job );
+	count ++;
+    }
+    return( count );
+}
 
-    // Keep receiving requests until done
-    while ( (receiving) && (! smsa_server_shutdown) ) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_reply_ready
+// Description  : Check if the connection has a finished reply emit would
+//                move (given room)
+//
+// Inputs       : conn - the connection
+// Outputs      : 1 if there is one, 0 if not
 
-	// Keep receiving until we have enough data
-	blkbytes = SMSA_BLOCK_SIZE;
-	if ( smsa_recieve_packet( sock, &op, &ret, &blkbytes, block ) == -1 ) {
-	    logMessage( LOG_ERROR_LEVEL, "SMSA receive failed : [%s]", strerror(errno) );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    return( -1 );
-	}
-	assert( (blkbytes == 0) || (blkbytes == SMSA_BLOCK_SIZE) );
+int smsa_server_reply_ready( SMSA_CONNECTION *conn ) {
 
-	// Now process the received  data, send the response
-	ret = smsa_operation( op, block );
-	if ( smsa_send_packet(sock, op, ret, (SMSA_OPCODE(op) == SMSA_DISK_READ) ? block : NULL) == -1 ) {
-	    logMessage( LOG_ERROR_LEVEL, "SMSA send failed : [%s]", strerror(errno) );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    return( -1 );
+    // Local variables
+    SMSA_JOB *job;
+    int waiting = 0;
+
+    // Same walk as smsa_server_emit
+    for ( job = conn->jobs; job != NULL; job = job->cnext ) {
+	if ( job->done && !(waiting && (job->flags & SMSA_NET_FLAG_ORDERED)) ) {
+	    return( 1 );
 	}
+	if ( job->version < SMSA_NET_VERSION_2 ) {
+	    return( 0 );
+	}
+	waiting = 1;
     }
-
-    // Close the socket and return sucessfully
-    close( sock );
     return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : smsa_recieve_packet
-// Description  : Recevie a packet from the other side
+// Function     : smsa_server_reply_flags
+// Description  : Pick the flags for a reply, read blocks are encoded for a
+//                client that asked at mount (not through the rings, which
+//                have no wire to save)
+//
+// Inputs       : conn - the connection
+// Outputs      : the flags for smsa_pack_packet
+
+uint16_t smsa_server_reply_flags( SMSA_CONNECTION *conn ) {
+    return( (conn->encoding && (conn->shm == NULL)) ? SMSA_NET_FLAG_ENCODED : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_parse_packet
+// Description  : Parse a packet out of a receive buffer
 //
-// Inputs       : sock - the socket filehandle of the clinet connection
+// Inputs       : buf - the received bytes
+//                avail - the number of received bytes
+//                version - the protocol the connection speaks
 //                op - the opcode that was read
 //                ret - the return value from the operation (as needed)
-//                blkbytes - the number of bytes read into the block (0 if none)
-//                block - the read block
-// Outputs      : 0 if successful, -1 if failure
+//                id - the request id (0 in protocol 1)
+//                flags - the request flags (0 in protocol 1)
+//                seq - the replication sequence number (0 in protocol 1)
+//                blkbytes - the number of bytes in the block (0 if none)
+//                block - set to the block within the buffer (NULL if none)
+// Outputs      : bytes consumed, 0 if the packet is incomplete, -1 if failure
 
-int smsa_recieve_packet( int sock, uint32_t *op, int16_t *ret, int *blkbytes, unsigned char *block ) {
+int smsa_parse_packet( unsigned char *buf, int avail, int version, uint32_t *op, int16_t *ret, uint32_t *id, uint16_t *flags, uint16_t *seq, int *blkbytes, unsigned char **block ) {
 
     // Local variables
-    uint16_t  len, idx;
-    unsigned char hdr[SMSA_NET_HEADER_SIZE];
+    uint16_t  len, idx, hdrlen = SMSA_NET_HEADER_BYTES(version);
 
     // SMSA Packet definition
     //
     //	Bytes 0-1   : length - how many total bytes in packet
-    //	Bytes 2-6   : opcode - the opcode for the command
-    //  Bytes 7-8   : return - return code of comamnd 
-    //	Bytes 6-261 : block - as needed, SMSA_BLOCK
+    //	Bytes 2-5   : opcode - the opcode for the command
+    //  Bytes 6-7   : return - return code of comamnd (argument in requests)
+    //	Bytes 8-    : block(s) - as needed, whole blocks (of the geometry)
+    //
+    // Protocol 2 (negotiated at mount) puts more in the header
+    //
+    //	Bytes 8-11  : id - picked by the client, echoed in the response
+    //	Bytes 12-13 : flags - SMSA_NET_FLAG_*
+    //	Bytes 14-15 : seq - low 16 bits of a replication sequence number,
+    //	              the write a read must follow (SMSA_NET_FLAG_AFTER)
+    //	              or the one a write became on a primary (else zero)
+    //	Bytes 16-   : block(s) - as needed, whole blocks (or their
+    //	              smsa_encode_blocks form if SMSA_NET_FLAG_ENCODED)
     //
 
-    // Read the header
-    if ( smsa_read_bytes( sock, SMSA_NET_HEADER_SIZE, hdr ) == -1 ) {
-	logMessage( LOG_ERROR_LEVEL, "SMSA receive packet failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	return( -1 );
+    // Wait for the whole header
+    if ( avail < hdrlen ) {
+	return( 0 );
     }
 
     // Now get the header and other data, convert to host byte order
     idx = 0;
-    memcpy( &len, hdr, sizeof(uint16_t) );
+    memcpy( &len, buf, sizeof(uint16_t) );
     idx += sizeof(uint16_t);
     len = ntohs( len );
-    memcpy( op, &hdr[idx], sizeof(uint32_t) );
+    memcpy( op, &buf[idx], sizeof(uint32_t) );
     idx += sizeof(uint32_t);
     *op = ntohl( *op );
-    memcpy( ret, &hdr[idx], sizeof(int16_t) );
+    memcpy( ret, &buf[idx], sizeof(int16_t) );
     idx += sizeof(int16_t);
     *ret = ntohs( *ret );
+    *id = 0;
+    *flags = 0;
+    *seq = 0;
+    if ( version >= SMSA_NET_VERSION_2 ) {
+	memcpy( id, &buf[idx], sizeof(uint32_t) );
+	idx += sizeof(uint32_t);
+	*id = ntohl( *id );
+	memcpy( flags, &buf[idx], sizeof(uint16_t) );
+	idx += sizeof(uint16_t);
+	*flags = ntohs( *flags );
+	memcpy( seq, &buf[idx], sizeof(uint16_t) );
+	idx += sizeof(uint16_t);
+	*seq = ntohs( *seq );
+    }
 
-    // Now see if there is more data to read
-    if ( len > SMSA_NET_HEADER_SIZE ) {
-	// Now read the remainig data for the packet
-	if ( smsa_read_bytes( sock, len-SMSA_NET_HEADER_SIZE, block ) == -1 ) {
-	    logMessage( LOG_ERROR_LEVEL, "SMSA receive packet failed : [%s]", strerror(errno) );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    return( -1 );
-	}
-	*blkbytes = len-SMSA_NET_HEADER_SIZE;
-    } else {
-	// Set the block bytes to none
-	*blkbytes = 0;
+    // Check the length, then wait for the rest of the packet (the payload
+    // need not be whole blocks, a WRITE_AT carries part of one)
+    if ( (len < hdrlen) || (len > SMSA_NET_MAX_PACKET) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA bad packet length [%u]", len );
+	return( -1 );
+    }
+    if ( avail < len ) {
+	return( 0 );
     }
 
+    // Point at the block, if one came along
+    *blkbytes = len-hdrlen;
+    *block = (*blkbytes > 0) ? &buf[idx] : NULL;
+
     // Return successfully
-    logMessage( LOG_INFO_LEVEL, "Received %d bytes on handle %d", len, sock );
-    return( 0 );
+    return( len );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Function     : smsa_send_packet
-// Description  : Send a packet to the other side
+// Function     : smsa_pack_packet
+// Description  : Assemble a packet into a send buffer
 //
-// Inputs       : sock - the socket filehandle of the clinet connection
-//                op - the opcode that was readi
+// Inputs       : buf - the buffer to assemble into
+//                version - the protocol the connection speaks
+//                op - the opcode that was read
 //                ret - return value to return
-//                block - the read block (NULL if not sent)
-// Outputs      : 0 if successful, -1 if failure
+//                id - the request id (protocol 2)
+//                flags - SMSA_NET_FLAG_ENCODED to encode the block(s), dropped
+//                        if that would not save anything (protocol 2)
+//                seq - the replication sequence number (protocol 2)
+//                block - the block(s) to send (NULL if none)
+//                blkbytes - the number of block bytes to send
+// Outputs      : the number of bytes assembled
 
-int smsa_send_packet( int sock, uint32_t op, int16_t ret, unsigned char *block ) {
+int smsa_pack_packet( unsigned char *buf, int version, uint32_t op, int16_t ret, uint32_t id, uint16_t flags, uint16_t seq, unsigned char *block, int blkbytes ) {
 
     // Local varibles
     uint16_t len, idx;
-    unsigned char sndbuf[SMSA_NET_HEADER_SIZE+SMSA_BLOCK_SIZE];
+    int enclen = -1;
 
-    // Read is the only time we send back a block
-    len = SMSA_NET_HEADER_SIZE;
+    // Blocks go along with read replies (and forwarded writes), encoded if
+    // asked and shorter
+    len = SMSA_NET_HEADER_BYTES(version);
+    if ( (block != NULL) && (version >= SMSA_NET_VERSION_2) && (flags & SMSA_NET_FLAG_ENCODED) ) {
+	enclen = smsa_encode_blocks( &buf[len], block, blkbytes );
+    }
+    if ( enclen == -1 ) {
+	flags &= ~SMSA_NET_FLAG_ENCODED;
+    }
     if ( block != NULL ) {
-	len += SMSA_BLOCK_SIZE;
+	len += (enclen != -1) ? enclen : blkbytes;
     }
     len = htons(len);
     op = htonl(op);
     ret = htons(ret);
+    id = htonl(id);
 
     // Assemble the packet
     idx = 0;
-    memcpy( &sndbuf[idx], &len, sizeof(len) ); // Length
+    memcpy( &buf[idx], &len, sizeof(len) ); // Length
     idx += sizeof(uint16_t);
-    memcpy( &sndbuf[idx], &op, sizeof(op) ); // Opcode
+    memcpy( &buf[idx], &op, sizeof(op) ); // Opcode
     idx += sizeof(uint32_t);
-    memcpy( &sndbuf[idx], &ret, sizeof(ret) ); // Result
+    memcpy( &buf[idx], &ret, sizeof(ret) ); // Result
     idx += sizeof(uint16_t);
+    if ( version >= SMSA_NET_VERSION_2 ) {
+	memcpy( &buf[idx], &id, sizeof(id) ); // Request id
+	idx += sizeof(uint32_t);
+	flags = htons(flags);
+	memcpy( &buf[idx], &flags, sizeof(flags) ); // Flags
+	idx += sizeof(uint16_t);
+	seq = htons(seq);
+	memcpy( &buf[idx], &seq, sizeof(seq) ); // Replication sequence number
+	idx += sizeof(uint16_t);
+    }
 
-    // If reading, add block to packet
-    if ( block != NULL ) {
-	memcpy( &sndbuf[idx], block, SMSA_BLOCK_SIZE ); // Result
-	idx += SMSA_BLOCK_SIZE;
+    // Add the block(s) to packet (already there if encoded)
+    if ( enclen != -1 ) {
+	idx += enclen;
+    } else if ( block != NULL ) {
+	memcpy( &buf[idx], block, blkbytes ); // Result
+	idx += blkbytes;
     }
     
-    // Send the packetx, return the return value
-    logMessage( LOG_INFO_LEVEL, "Sending %d bytes on handle %d", idx, sock );
-    return( smsa_send_bytes(sock, idx, sndbuf) );
+    // Return the packet length
+    return( idx );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : smsa_send_bytes
-// Description  : Send a specific length of bytes to socket
+// Function     : smsa_flush_connection
+// Description  : Send as much of the pending responses as the socket takes
 //
-// Inputs       : sock - the socket filehandle of the clinet connection
-//                len - the number of bytes to send
-//                buf - the buffer to send 
+// Inputs       : conn - the connection to send on
 // Outputs      : 0 if successful, -1 if failure
 
-int smsa_send_bytes( int sock, int len, unsigned char *buf ) {
+int smsa_flush_connection( SMSA_CONNECTION *conn ) {
 
     // Local variables
-    int sentBytes = 0, sb;
-
-    // Loop until you have read all the bytes
-    while ( sentBytes < len ) {
-
-	// Read the bytes and check for error
-	if ( (sb = write(sock, &buf[sentBytes], len-sentBytes)) < 0 ) {
+    int sb;
+
+    // Loop until everything is sent or the socket is full
+    while ( conn->woff < conn->wlen ) {
+	if ( (sb = send(conn->sock, &conn->wbuf[conn->woff], conn->wlen-conn->woff, MSG_NOSIGNAL)) < 0 ) {
+	    if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+		return( 0 );
+	    }
+	    if ( errno == EINTR ) {
+		continue;
+	    }
 	    logMessage( LOG_ERROR_LEVEL, "SMSA send bytes failed : [%s]", strerror(errno) );
 	    smsa_error_number = SMSA_NET_ERROR;
 	    return( -1 );
 	}
+	conn->woff += sb;
+    }
 
-	// Check for closed file
-	else if ( sb == 0 ) {
-	    // Close file, not an error
-	    logMessage( LOG_ERROR_LEVEL, "SMSA client socket closed on snd : [%s]", strerror(errno) );
-	    return( -1 );
-	}
+    // All sent, reset the buffer
+    conn->woff = conn->wlen = 0;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ready_connection
+// Description  : Put a connection at the back of the ready list
+//
+// Inputs       : conn - the connection with work to do
+// Outputs      : none
+
+void smsa_ready_connection( SMSA_CONNECTION *conn ) {
 
-	// Now process what we read
-	sentBytes += sb;
+    // Already waiting for its turn
+    if ( conn->queued ) {
+	return;
     }
 
-    // Return successsfully
-    return( 0 );
+    // Append to the list, noting when it started waiting
+    conn->queued = 1;
+    conn->since = smsa_server_now();
+    conn->next = NULL;
+    if ( smsa_ready_tail != NULL ) {
+	smsa_ready_tail->next = conn;
+    } else {
+	smsa_ready_head = conn;
+    }
+    smsa_ready_tail = conn;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : smsa_read_bytes
-// Description  : Recevie a specific length of bytes form socket
+// Function     : smsa_next_ready
+// Description  : Take the connection at the front of the ready list
 //
-// Inputs       : sock - the socket filehandle of the clinet connection
-//                len - the number of bytes to be read
-//                buf - the buffer to read into 
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : none
+// Outputs      : the connection, or NULL if none are ready
 
-int smsa_read_bytes( int sock, int len, unsigned char *buf ) {
+SMSA_CONNECTION *smsa_next_ready( void ) {
 
     // Local variables
-    int readBytes = 0, rb;
-
-    // Loop until you have read all the bytes
-    while ( readBytes < len ) {
+    SMSA_CONNECTION *conn = smsa_ready_head;
 
-	// Read the bytes and check for error
-	if ( (rb = read(sock, &buf[readBytes], len-readBytes)) < 0 ) {
-	    // Check for client error on read
-	    logMessage( LOG_ERROR_LEVEL, "SMSA read bytes failed : [%s]", strerror(errno) );
-	    smsa_error_number = SMSA_NET_ERROR;
-	    return( -1 );
+    // Unlink the front of the list
+    if ( conn != NULL ) {
+	smsa_ready_head = conn->next;
+	if ( smsa_ready_head == NULL ) {
+	    smsa_ready_tail = NULL;
 	}
+	conn->queued = 0;
+	conn->next = NULL;
+    }
+    return( conn );
+}
 
-	// Check for closed file
-	else if ( rb == 0 ) {
-	    // Close file, not an error
-	    logMessage( LOG_ERROR_LEVEL, "SMSA client socket closed on rd : [%s]", strerror(errno) );
-	    return( -1 );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ready_count
+// Description  : Count the connections on the ready list
+//
+// Inputs       : none
+// Outputs      : the number of ready connections
+
+int smsa_ready_count( void ) {
+
+    // Local variables
+    SMSA_CONNECTION *conn;
+    int count = 0;
+
+    // Walk the list
+    for ( conn = smsa_ready_head; conn != NULL; conn = conn->next ) {
+	count ++;
+    }
+    return( count );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_close_connection
+// Description  : Close a connection and release its state
+//
+// Inputs       : conn - the connection to close
+// Outputs      : none
+
+void smsa_close_connection( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    SMSA_CONNECTION **pos;
+    int i;
+
+    // A client that goes away still mounted gives up its mount
+    if ( conn->mounted && (--smsa_mounted_clients == 0) ) {
+	smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+    }
+
+    // Log (with how it fared in the queue), close (which also removes it
+    // from the event set)
+    if ( conn->turns > 0 ) {
+	logMessage( LOG_INFO_LEVEL, "Client [%s] weight %d: %lu requests in %lu turns, wait %lu usecs average (%lu most), "
+		"depth %lu average (%d most)", conn->name, conn->weight, (unsigned long)conn->served, (unsigned long)conn->turns,
+		(unsigned long)(conn->waited/conn->turns), (unsigned long)conn->max_wait,
+		(unsigned long)(conn->depth/conn->turns), conn->max_depth );
+    }
+    logMessage( LOG_INFO_LEVEL, "Closing client connection [%s]", conn->name );
+    close( conn->sock );
+    smsa_unblock_connection( conn );
+
+    // Release the rings and any handles passed to us
+    if ( conn->shm != NULL ) {
+	for ( pos = &smsa_shm_head; *pos != conn; pos = &(*pos)->snext );
+	*pos = conn->snext;
+	smsa_shm_unmap( conn->shm );
+	conn->shm = NULL;
+    }
+    for ( i=0; i<2; i++ ) {
+	if ( conn->passed[i] != -1 ) {
+	    close( conn->passed[i] );
 	}
+    }
+    if ( conn->doorbell != -1 ) {
+	close( conn->doorbell );
+    }
 
-	// Now process what we read
-	readBytes += rb;
+    // Free it, unless the workers (or io_uring) still have work for it
+    conn->closed = 1;
+    if ( (conn->inflight == 0) && (conn->pending == 0) ) {
+	smsa_free_connection( conn );
     }
+}
 
-    // Return successsfully
-    return( 0 );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_free_connection
+// Description  : Release the state of a closed connection
+//
+// Inputs       : conn - the connection to free
+// Outputs      : none
+
+void smsa_free_connection( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    SMSA_JOB *job;
+
+    // Drop any unanswered replies, then the connection
+    while ( (job = conn->jobs) != NULL ) {
+	conn->jobs = job->cnext;
+	free( job );
+    }
+    if ( conn->slot != -1 ) {
+	smsa_uring_release( conn );
+    }
+    free( conn->rbuf );
+    free( conn->wbuf );
+    free( conn );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : smsa_wait_read
-// Description  : Wait for user input on the socket
+// Function     : smsa_block_connection
+// Description  : Park a connection until the workers go idle
 //
-// Inputs       : sock - the socket to write on
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : conn - the connection that has to wait
+// Outputs      : none
 
-int smsa_wait_read( int sock ) {
+void smsa_block_connection( SMSA_CONNECTION *conn ) {
 
     // Local variables
-    fd_set rfds;
-    int nfds, ret;
+    SMSA_CONNECTION **pos;
 
-    // Setup and perform the select
-    nfds = sock + 1;
-    FD_ZERO( &rfds );
-    FD_SET( sock, &rfds );
-    ret = select( nfds, &rfds, NULL, NULL, NULL );
+    // Already parked
+    if ( conn->blocked ) {
+	return;
+    }
 
-    // Check the return value
-    if ( ret == -1 ) {
-	logMessage( LOG_ERROR_LEVEL, "SMSA select() failed : [%s]", strerror(errno) );
-	smsa_error_number = SMSA_NET_ERROR;
-	return( -1 );
+    // Append to the list, the order they arrived is the order they go
+    for ( pos = &smsa_blocked_head; *pos != NULL; pos = &(*pos)->bnext );
+    conn->blocked = 1;
+    conn->bnext = NULL;
+    *pos = conn;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_unblock_connection
+// Description  : Take a connection off the list of those waiting
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void smsa_unblock_connection( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    SMSA_CONNECTION **pos;
+
+    // Find and unlink it
+    if ( ! conn->blocked ) {
+	return;
     }
+    for ( pos = &smsa_blocked_head; *pos != conn; pos = &(*pos)->bnext );
+    *pos = conn->bnext;
+    conn->blocked = 0;
+    conn->bnext = NULL;
+
+    // Nothing left waiting, nothing to hold up the workers for, and with
+    // the workers idle the rest have to go now (the one leaving may have
+    // been what they were waiting behind)
+    if ( smsa_blocked_head == NULL ) {
+	smsa_barrier_waiting = 0;
+    } else if ( smsa_jobs_inflight == 0 ) {
+	smsa_release_blocked();
+    }
+}
 
-    // check to make sure we are selected on the read
-    if ( FD_ISSET( sock, &rfds ) == 0 ) {
-	logMessage( LOG_ERROR_LEVEL, "SMSA select() returned without selecting FD : [%d]", sock );
-	smsa_error_number = SMSA_NET_ERROR;
-	return( -1 );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_release_blocked
+// Description  : Put the waiting connections at the front of the ready list,
+//                so the array wide operation among them runs before anything
+//                else is handed to the workers.  They check again, an array
+//                wide operation finding the workers busy waits once more.
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_release_blocked( void ) {
+
+    // Local variables
+    SMSA_CONNECTION *conn, *head = NULL, *tail = NULL;
+
+    // Build the list of waiting connections not already on the ready list
+    smsa_barrier_waiting = 0;
+    while ( (conn = smsa_blocked_head) != NULL ) {
+	smsa_blocked_head = conn->bnext;
+	conn->blocked = 0;
+	conn->bnext = NULL;
+	if ( conn->queued ) {
+	    continue;
+	}
+	conn->queued = 1;
+	conn->next = NULL;
+	if ( tail != NULL ) {
+	    tail->next = conn;
+	} else {
+	    head = conn;
+	}
+	tail = conn;
     }
 
-    // Return successsfully
-    return( 0 );
+    // Splice it in at the front
+    if ( head != NULL ) {
+	tail->next = smsa_ready_head;
+	smsa_ready_head = head;
+	if ( smsa_ready_tail == NULL ) {
+	    smsa_ready_tail = tail;
+	}
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,129 @@
+#ifndef SMSA_SERVER_INCLUDED
+#define SMSA_SERVER_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_server.h
+//  Description   : This is the interface between the SMSA server's request
+//                  handling and the event loops that drive it (epoll in
+//                  smsa_server.c, io_uring in smsa_uring.c).
+//
+//   Author : Patrick McDaniel
+//   Last Modified : Mon Oct 28 06:58:31 EDT 2013
+//
+
+// Include Files
+#include <stdint.h>
+
+// Project Include Files
+#include <smsa_network.h>
+
+//
+// Type Definitions
+
+// A request parsed out of the receive buffer, waiting in a batch
+typedef struct {
+    uint32_t                 op;        // The opcode
+    uint16_t                 arg;       // The argument (its return field)
+    uint32_t                 id;        // The request id (protocol 2)
+    uint16_t                 flags;     // The request flags (protocol 2)
+    uint16_t                 seq;       // The write a read must follow
+    int                      blkbytes;  // The number of block bytes
+    unsigned char           *block;     // The block(s) (NULL if none)
+} SMSA_REQUEST;
+
+//
+// Global Data
+extern int smsa_server_shutdown;
+extern int smsa_server_uring;
+extern int smsa_server_first_drum;
+extern int smsa_server_last_drum;
+
+//
+// Functional Prototypes
+
+int smsa_server_listen( void );
+    // Create the listening socket (TCP or unix)
+
+void smsa_server_nodelay( int sock );
+    // Turn off Nagle on an accepted TCP connection
+
+int smsa_server_uring_loop( void );
+    // The io_uring server loop (smsa_server runs it when selected)
+
+void smsa_uring_release( SMSA_CONNECTION *conn );
+    // Unregister the buffers of a connection being freed
+
+int smsa_server_process_packet( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, uint32_t id, uint16_t flags, uint16_t seq, int blkbytes, unsigned char *block, unsigned char *out );
+    // Perform a request inline, assembling the response at out
+
+int smsa_server_gather( SMSA_CONNECTION *conn, SMSA_REQUEST *batch, int count );
+    // Add a parsed request to the batch, reserving room for its response
+
+int smsa_server_execute_batch( SMSA_CONNECTION *conn, SMSA_REQUEST *batch, int count, unsigned char *out );
+    // Perform a batch of requests inline, assembling the responses at out
+
+void smsa_server_fail_writes( SMSA_REQUEST *batch, int count, unsigned char *out );
+    // Fail the assembled responses of the changes in a batch
+
+int smsa_server_dispatch( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg, uint32_t id, uint16_t flags, uint16_t seq, int blkbytes, unsigned char *block );
+    // Hand a request to the drum workers, 0 if it has to wait
+
+void smsa_server_complete( void );
+    // Collect the jobs the workers finished
+
+int smsa_server_emit( SMSA_CONNECTION *conn );
+    // Move finished worker replies to the send buffer
+
+int smsa_server_reply_ready( SMSA_CONNECTION *conn );
+    // Check if a finished worker reply is ready to be moved
+
+uint16_t smsa_server_reply_flags( SMSA_CONNECTION *conn );
+    // The flags for a reply on the connection (block encoding)
+
+int smsa_server_room( SMSA_CONNECTION *conn );
+    // Check if a connection can take another request
+
+int smsa_add_weight( char *spec );
+    // Give the clients at an address (<client>=<weight>) a larger share
+
+int smsa_server_weight( char *name );
+    // The weight of a newly accepted connection
+
+uint64_t smsa_server_begin_turn( SMSA_CONNECTION *conn );
+    // Start a connection's turn, topping up its deficit
+
+int smsa_server_afford( SMSA_CONNECTION *conn, uint32_t op, uint16_t arg );
+    // The cost of a request if the deficit covers it, 0 if it has to wait
+
+void smsa_server_end_turn( SMSA_CONNECTION *conn, uint64_t waited, int served, int left );
+    // End a connection's turn, keeping its queueing statistics
+
+int smsa_server_waiting( unsigned char *buf, int avail, int version );
+    // Count the complete requests in a receive buffer
+
+int smsa_parse_packet( unsigned char *buf, int avail, int version, uint32_t *op, int16_t *ret, uint32_t *id, uint16_t *flags, uint16_t *seq, int *blkbytes, unsigned char **block );
+    // Parse a packet out of a receive buffer
+
+int smsa_pack_packet( unsigned char *buf, int version, uint32_t op, int16_t ret, uint32_t id, uint16_t flags, uint16_t seq, unsigned char *block, int blkbytes );
+    // Assemble a packet into a send buffer
+
+void smsa_ready_connection( SMSA_CONNECTION *conn );
+    // Put a connection at the back of the ready list
+
+SMSA_CONNECTION *smsa_next_ready( void );
+    // Take the connection at the front of the ready list
+
+int smsa_ready_count( void );
+    // Count the connections on the ready list
+
+void smsa_close_connection( SMSA_CONNECTION *conn );
+    // Close a connection, freeing it once nothing refers to it
+
+void smsa_free_connection( SMSA_CONNECTION *conn );
+    // Release the state of a closed connection
+
+void smsa_signal_handler( int no );
+    // Shut the server down on a signal
+
+#endif
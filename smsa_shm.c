@@ -0,0 +1,306 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_shm.c
+//  Description   : This is the shared memory ring transport shared by the
+//                  client and the server.  In steady state neither side
+//                  makes a system call, a sleeping consumer is woken with a
+//                  futex (the client) or its eventfd doorbell (the server,
+//                  which waits in epoll).
+//
+//   Author        : Hayder Sharhan
+//   Last Modified : Tue Dec 10 2013
+//
+
+// Include Files
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Project Include Files
+#include <smsa_shm.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#if defined(__x86_64__) || defined(__i386__)
+#define SMSA_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define SMSA_CPU_RELAX() __atomic_thread_fence( __ATOMIC_SEQ_CST )
+#endif
+
+//
+// Global data
+
+int smsa_shm_spins = -1;	// Polls before sleeping (-1 = pick from the core count)
+
+//
+// Functional Prototypes
+int smsa_shm_futex( uint32_t *addr, int op, uint32_t val, int ms );
+int smsa_shm_peer_alive( int sock );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_shm_create
+// Description  : Create a new shared segment with empty rings
+//
+// Inputs       : fd - set to the memfd holding the segment
+// Outputs      : the mapped segment, NULL if failure
+
+SMSA_SHM_SEGMENT *smsa_shm_create( int *fd ) {
+
+	// Local variables
+	SMSA_SHM_SEGMENT *seg;
+
+	// Make the memory file, size it and map it (zeroed, so the rings are empty)
+	if ( (*fd = memfd_create( "smsa_shm", MFD_CLOEXEC )) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA memfd_create() failed : [%s]", strerror(errno) );
+		return( NULL );
+	}
+	if ( ftruncate( *fd, sizeof(SMSA_SHM_SEGMENT) ) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA ftruncate() failed : [%s]", strerror(errno) );
+		close( *fd );
+		return( NULL );
+	}
+	if ( (seg = smsa_shm_map( *fd )) == NULL ) {
+		close( *fd );
+		return( NULL );
+	}
+	return( seg );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_shm_map
+// Description  : Map a segment created by the peer
+//
+// Inputs       : fd - the memfd of the segment
+// Outputs      : the mapped segment, NULL if failure
+
+SMSA_SHM_SEGMENT *smsa_shm_map( int fd ) {
+
+	// Local variables
+	void *seg;
+
+	// Pick how long to spin, on a single core spinning only delays the peer
+	if ( smsa_shm_spins == -1 ) {
+		smsa_shm_spins = ( sysconf(_SC_NPROCESSORS_ONLN) > 1 ) ? SMSA_SHM_SPINS : 0;
+	}
+
+	// Map it shared
+	if ( (seg = mmap( NULL, sizeof(SMSA_SHM_SEGMENT), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 )) == MAP_FAILED ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA mmap() of segment failed : [%s]", strerror(errno) );
+		return( NULL );
+	}
+	return( seg );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_shm_unmap
+// Description  : Release a mapped segment
+//
+// Inputs       : seg - the segment
+// Outputs      : none
+
+void smsa_shm_unmap( SMSA_SHM_SEGMENT *seg ) {
+	munmap( seg, sizeof(SMSA_SHM_SEGMENT) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_slot
+// Description  : Find the next free slot for the producer to fill
+//
+// Inputs       : ring - the ring
+// Outputs      : the slot, NULL if the ring is full
+
+unsigned char *smsa_ring_slot( SMSA_SHM_RING *ring ) {
+
+	// Local variables
+	uint32_t head = ring->head;	// Only we write it
+
+	if ( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) >= SMSA_SHM_SLOTS ) {
+		return( NULL );
+	}
+	return( ring->slots[head % SMSA_SHM_SLOTS] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_publish
+// Description  : Hand the slot just filled to the consumer, waking it if it
+//                went to sleep (the check is ordered after the publish so a
+//                consumer arming itself at the same time is never missed)
+//
+// Inputs       : ring - the ring
+//                doorbell - eventfd to ring to wake the consumer, -1 to use
+//                           a futex on the head instead
+// Outputs      : none
+
+void smsa_ring_publish( SMSA_SHM_RING *ring, int doorbell ) {
+
+	// Local variables
+	uint64_t one = 1;
+
+	__atomic_store_n( &ring->head, ring->head+1, __ATOMIC_RELEASE );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	if ( __atomic_load_n( &ring->sleeping, __ATOMIC_RELAXED ) ) {
+		__atomic_store_n( &ring->sleeping, 0, __ATOMIC_RELAXED );
+		if ( doorbell != -1 ) {
+			if ( write( doorbell, &one, sizeof(one) ) == -1 ) {
+				logMessage( LOG_ERROR_LEVEL, "SMSA doorbell write failed : [%s]", strerror(errno) );
+			}
+		} else {
+			smsa_shm_futex( &ring->head, FUTEX_WAKE, 1, 0 );
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_peek
+// Description  : Find the next filled slot for the consumer
+//
+// Inputs       : ring - the ring
+// Outputs      : the slot, NULL if the ring is empty
+
+unsigned char *smsa_ring_peek( SMSA_SHM_RING *ring ) {
+
+	// Local variables
+	uint32_t tail = ring->tail;	// Only we write it
+
+	if ( __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) == tail ) {
+		return( NULL );
+	}
+	return( ring->slots[tail % SMSA_SHM_SLOTS] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_consume
+// Description  : Give the slot just consumed back to the producer
+//
+// Inputs       : ring - the ring
+// Outputs      : none
+
+void smsa_ring_consume( SMSA_SHM_RING *ring ) {
+	__atomic_store_n( &ring->tail, ring->tail+1, __ATOMIC_RELEASE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_count
+// Description  : Count the filled slots waiting for the consumer
+//
+// Inputs       : ring - the ring
+// Outputs      : the number of filled slots
+
+int smsa_ring_count( SMSA_SHM_RING *ring ) {
+	return( __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) - ring->tail );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_arm
+// Description  : Tell the producer the consumer is going to sleep
+//
+// Inputs       : ring - the ring
+// Outputs      : 1 if armed (the ring is empty), 0 if something arrived
+
+int smsa_ring_arm( SMSA_SHM_RING *ring ) {
+
+	__atomic_store_n( &ring->sleeping, 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	if ( smsa_ring_peek( ring ) != NULL ) {
+		__atomic_store_n( &ring->sleeping, 0, __ATOMIC_RELAXED );
+		return( 0 );
+	}
+	return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_ring_wait
+// Description  : Wait for a filled slot, spinning a while before sleeping on
+//                the head.  Sleeps are bounded so a dead peer is noticed.
+//
+// Inputs       : ring - the ring
+//                sock - the connection to the peer
+// Outputs      : the slot, NULL if the peer went away
+
+unsigned char *smsa_ring_wait( SMSA_SHM_RING *ring, int sock ) {
+
+	// Local variables
+	unsigned char *slot;
+	uint32_t empty;
+	int i;
+
+	// Adaptive part, the reply is usually moments away
+	for ( i=0; i<smsa_shm_spins; i++ ) {
+		if ( (slot = smsa_ring_peek( ring )) != NULL ) {
+			return( slot );
+		}
+		SMSA_CPU_RELAX();
+	}
+
+	// Sleep until the producer publishes
+	while ( (slot = smsa_ring_peek( ring )) == NULL ) {
+		empty = ring->tail;	// The head while the ring is empty
+		if ( smsa_ring_arm( ring ) ) {
+			if ( (smsa_shm_futex( &ring->head, FUTEX_WAIT, empty, SMSA_SHM_WAIT_MS ) == -1) &&
+					(errno == ETIMEDOUT) && !smsa_shm_peer_alive( sock ) ) {
+				logMessage( LOG_ERROR_LEVEL, "SMSA shared memory peer went away" );
+				return( NULL );
+			}
+		}
+	}
+	return( slot );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_shm_futex
+// Description  : Wait on or wake a futex in the shared segment
+//
+// Inputs       : addr - the futex word
+//                op - FUTEX_WAIT or FUTEX_WAKE
+//                val - the expected value (wait) or waiters to wake (wake)
+//                ms - longest wait in milliseconds
+// Outputs      : the result of the system call
+
+int smsa_shm_futex( uint32_t *addr, int op, uint32_t val, int ms ) {
+
+	// Local variables
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	return( syscall( SYS_futex, addr, op, val, (op == FUTEX_WAIT) ? &ts : NULL, NULL, 0 ) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_shm_peer_alive
+// Description  : Check the connection to the peer is still open
+//
+// Inputs       : sock - the connection
+// Outputs      : 1 if open, 0 if closed
+
+int smsa_shm_peer_alive( int sock ) {
+
+	// Local variables
+	char byte;
+	int rb;
+
+	if ( (rb = recv( sock, &byte, 1, MSG_PEEK|MSG_DONTWAIT )) >= 0 ) {
+		return( rb > 0 );
+	}
+	return( (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) );
+}
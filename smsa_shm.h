@@ -0,0 +1,85 @@
+#ifndef SMSA_SHM_INCLUDED
+#define SMSA_SHM_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_shm.h
+//  Description   : This is the shared memory transport for a client and
+//                  server on the same host.  Requests and responses travel
+//                  through a pair of single producer/single consumer rings
+//                  of packet sized slots in a memfd segment.
+//
+//   Author        : Hayder Sharhan
+//   Last Modified : Tue Dec 10 2013
+//
+
+// Include Files
+#include <stdint.h>
+
+// Project Include Files
+#include <smsa_network.h>
+
+// Defines
+#define SMSA_SHM_SLOTS SMSA_MAX_PIPELINE_DEPTH	// Slots in each ring
+#define SMSA_SHM_SPINS 4096			// Polls of an empty ring before sleeping
+#define SMSA_SHM_WAIT_MS 100			// Sleep between checks the peer is alive
+#define SMSA_NET_SHM_ATTACH 0xffffffff		// Request moving a connection to rings
+
+//
+// Type Definitions
+
+// One direction of the transport, head and tail are free running counters
+// kept on their own cache lines
+typedef struct {
+	uint32_t	head;		// Slots filled (only the producer writes)
+	uint32_t	sleeping;	// The consumer is asleep, wake it on publish
+	char		pad1[56];
+	uint32_t	tail;		// Slots taken (only the consumer writes)
+	char		pad2[60];
+	unsigned char	slots[SMSA_SHM_SLOTS][SMSA_NET_MAX_PACKET];
+} SMSA_SHM_RING;
+
+// The shared segment
+typedef struct smsa_shm_segment {
+	SMSA_SHM_RING	requests;	// Client to server
+	SMSA_SHM_RING	responses;	// Server to client
+} SMSA_SHM_SEGMENT;
+
+//
+// Global Data
+extern int smsa_shm_spins;
+
+//
+// Functional Prototypes
+
+SMSA_SHM_SEGMENT *smsa_shm_create( int *fd );
+    // Create a new segment, returning it and its memfd
+
+SMSA_SHM_SEGMENT *smsa_shm_map( int fd );
+    // Map a segment created by the peer
+
+void smsa_shm_unmap( SMSA_SHM_SEGMENT *seg );
+    // Release a mapped segment
+
+unsigned char *smsa_ring_slot( SMSA_SHM_RING *ring );
+    // The next free slot for the producer, NULL if the ring is full
+
+void smsa_ring_publish( SMSA_SHM_RING *ring, int doorbell );
+    // Hand the filled slot to the consumer, waking it if asleep
+
+unsigned char *smsa_ring_peek( SMSA_SHM_RING *ring );
+    // The next filled slot for the consumer, NULL if the ring is empty
+
+void smsa_ring_consume( SMSA_SHM_RING *ring );
+    // Give the consumed slot back to the producer
+
+int smsa_ring_count( SMSA_SHM_RING *ring );
+    // Count the filled slots waiting for the consumer
+
+int smsa_ring_arm( SMSA_SHM_RING *ring );
+    // Mark the consumer asleep, 0 if something arrived meanwhile
+
+unsigned char *smsa_ring_wait( SMSA_SHM_RING *ring, int sock );
+    // Wait for a filled slot, NULL if the peer went away
+
+#endif
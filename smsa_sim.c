@@ -10,6 +10,7 @@
 // Include Files
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -23,19 +24,33 @@
 #include <smsa_network.h>
 #include <smsa_internal.h>
 #include <smsa_cache.h>
+#include <smsa_unittest.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
-#define SMSA_ARGUMENTS "huvl:c:"
+#define SMSA_ARGUMENTS "hvl:c:p:u:snkV:Rm:P:C:U"
 #define USAGE \
-	"USAGE: smsa [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: smsa [-h] [-v] [-l <logfile>] [-c <sz>] [-p <depth>] [-u <path> [-s]] [-n] [-k] [-V <version>] [-R] [-m <map>] [-P <port>] [-C <conns>] [-U] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -c - set cache size to <sz> lines\n" \
+	"    -p - pipeline up to <depth> requests to the server\n" \
+	"    -u - connect to the server's unix socket <path> instead of TCP\n" \
+	"    -s - move the unix socket connection to shared memory rings\n" \
+	"    -n - leave Nagle's algorithm on (TCP_NODELAY is set by default)\n" \
+	"    -k - cork the TCP connection while a batch of requests is written\n" \
+	"    -V - protocol version to ask the server for at mount (1 or 2)\n" \
+	"    -R - send blocks raw (protocol 2 encodes uniform blocks by default)\n" \
+	"    -m - spread the drums over servers, <map> is first-last=endpoint,...\n" \
+	"         where endpoint is a unix socket path or host[:port], followed\n" \
+	"         by +endpoint for each replica the reads can go to\n" \
+	"    -P - connect to the server's TCP <port>\n" \
+	"    -C - open <conns> connections to each server, its drums striped over them\n" \
+	"    -U - run the unit tests against a local array (no workload)\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -64,8 +79,9 @@ int simulate_SMSA( char *wload, int cache_size );
 int main( int argc, char *argv[] )
 {
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0;
+	int ch, verbose = 0, log_initialized = 0, unit_test = 0;
 	uint32_t cache_size = 1024; // Defaults to 1024 cache lines
+	int depth, sharded = 0;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, SMSA_ARGUMENTS)) != -1) {
@@ -90,6 +106,68 @@ int main( int argc, char *argv[] )
 			}
 			break;
 
+		case 'p': // Set pipeline depth
+			if ( (sscanf( optarg, "%d", &depth ) != 1) || (smsa_client_set_pipeline(depth) == -1) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad pipeline depth [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'u': // Use a unix socket
+			smsa_unix_path = optarg;
+			break;
+
+		case 's': // Use shared memory rings
+			smsa_client_shm = 1;
+			break;
+
+		case 'n': // Leave Nagle on
+			smsa_client_nodelay = 0;
+			break;
+
+		case 'k': // Cork batches
+			smsa_client_cork = 1;
+			break;
+
+		case 'V': // Protocol version
+			if ( (sscanf( optarg, "%d", &smsa_client_version ) != 1) ||
+					(smsa_client_version < SMSA_NET_VERSION_1) || (smsa_client_version > SMSA_NET_VERSION_2) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad protocol version [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'R': // Raw blocks
+			smsa_client_encode = 0;
+			break;
+
+		case 'm': // Shard map
+			if ( smsa_client_set_shards(optarg) == -1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad shard map, every drum needs one server [%s]", optarg );
+			    return( -1 );
+			}
+			sharded = 1;
+			break;
+
+		case 'P': // TCP port
+			if ( (sscanf( optarg, "%d", &smsa_tcp_port ) != 1) || (smsa_tcp_port < 1) || (smsa_tcp_port > 65535) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad port [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'C': // Connections per server
+			if ( (sscanf( optarg, "%d", &smsa_client_connections ) != 1) ||
+					(smsa_client_connections < 1) || (smsa_client_connections > SMSA_DISK_ARRAY_SIZE) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad connection count [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'U': // Run the unit tests
+			unit_test = 1;
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -104,6 +182,17 @@ int main( int argc, char *argv[] )
 		enableLogLevels( LOG_INFO_LEVEL );
 	}
 
+	// Shared memory is set up over the unix socket
+	if ( smsa_client_shm && (smsa_unix_path == NULL) && !sharded ) {
+	    fprintf( stderr, "Shared memory (-s) needs a unix socket (-u), aborting.\n" );
+	    return( -1 );
+	}
+
+	// The unit tests need no workload (or server)
+	if ( unit_test ) {
+		return( smsa_run_unit_tests() );
+	}
+
 	// The filename should be the next option
 	if ( optind >= argc ) {
 
@@ -143,9 +232,11 @@ int simulate_SMSA( char *wload, int cache_size ) {
 	// Local variables
 	char line[256], cmd[32];
 	unsigned char buf[SMSA_MAXIMUM_RDWR_SIZE], sig[CMPSC311_HASH_LENGTH], sigstr[CMPSC311_HASH_LENGTH*4];
+	unsigned char sigs[SMSA_MAX_BLOCK_ID*SMSA_SIGNATURE_SIZE];
 	FILE *fhandle = NULL;
-	uint32_t addr, len, ch, slen, op;
-	int i, j, err;
+	SMSA_VIRTUAL_ADDRESS addr;
+	uint32_t len, ch, slen, op, b, n;
+	int i, err;
 
 	// Open the workload file
 	if ( (fhandle=fopen(wload, "r")) == NULL ) {
@@ -176,20 +267,25 @@ int simulate_SMSA( char *wload, int cache_size ) {
 			else if ( strncmp(SMSA_WORKLOAD_SIGNALL,line,strlen(SMSA_WORKLOAD_SIGNALL)) == 0 ) {
 				logMessage( LOG_INFO_LEVEL, "Computing signatures on the array.");
 
-				// Now just test the disk block signature generation
-				for ( i=0; i<SMSA_DISK_ARRAY_SIZE; i++ ) {
-					for ( j=0; j<SMSA_MAX_BLOCK_ID; j++ ) {
-
-					// Send the sign operation
-					op = encode_SMSA_operation( SMSA_BLOCK_SIGN, i, j );
-					if ( smsa_client_operation( op, NULL ) == -1 ) { 
-					    // Error out 
-					    logMessage( LOG_ERROR_LEVEL, "Error signing block [%d,%d]", i, j );
-					    fclose( fhandle );
-					    return( -1 );
-					}
+				// Now sign each drum with a request per SMSA_MAX_BLOCK_ID blocks (one
+				// in the default geometry), the signatures come back
+				for ( i=0; i<smsa_geometry.drums; i++ ) {
+					for ( b=0; b<smsa_geometry.blocks; b+=n ) {
 
-				    }
+						// Send the sign operation
+						n = smsa_geometry.blocks - b;
+						if ( n > SMSA_MAX_BLOCK_ID ) {
+							n = SMSA_MAX_BLOCK_ID;
+						}
+						op = encode_SMSA_operation( SMSA_SIGN_RANGE, i, b );
+						if ( smsa_client_operation_ex( op, n, sigs ) == -1 ) {
+						    // Error out 
+						    logMessage( LOG_ERROR_LEVEL, "Error signing drum [%d]", i );
+						    fclose( fhandle );
+						    return( -1 );
+						}
+					}
+					logMessage( LOG_INFO_LEVEL, "Received %u signatures of drum [%d]", smsa_geometry.blocks, i );
 				}
 
 				// Now print out the performance of the system
@@ -200,7 +296,7 @@ int simulate_SMSA( char *wload, int cache_size ) {
 			else {
 
 				// Parse out the command
-				if ( sscanf( line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch ) != 4 ) {
+				if ( sscanf( line, "%7s %20" SCNu64 " %4u %3u", cmd, &addr, &len, &ch ) != 4 ) {
 					logMessage( LOG_ERROR_LEVEL, "Error parsing virtual command [%s\n]", line );
 					fclose( fhandle );
 					return( -1 );
@@ -208,7 +304,7 @@ int simulate_SMSA( char *wload, int cache_size ) {
 
 				// Check for read
 				if ( strncmp(SMSA_WORKLOAD_READ, cmd, strlen(SMSA_WORKLOAD_READ)) == 0 ) {
-					logMessage( LOG_INFO_LEVEL, "Calling virtual driver read (addr=%x, len=%u)", addr, len);
+					logMessage( LOG_INFO_LEVEL, "Calling virtual driver read (addr=%" PRIx64 ", len=%u)", addr, len);
 
 					// Do the read, fingerprint the returned buffer so we can validate
 					if ( !(err = smsa_vread( addr, len, buf )) ) {
@@ -229,7 +325,7 @@ int simulate_SMSA( char *wload, int cache_size ) {
 				else if ( strncmp(SMSA_WORKLOAD_WRITE, cmd, strlen(SMSA_WORKLOAD_WRITE)) == 0 ) {
 
 					// Now setup the buffer and make the call
-					logMessage( LOG_INFO_LEVEL, "Calling virtual driver write (addr=%x, len=%u, ch=%u)", addr, len, ch);
+					logMessage( LOG_INFO_LEVEL, "Calling virtual driver write (addr=%" PRIx64 ", len=%u, ch=%u)", addr, len, ch);
 					memset( buf, ch, len );
 					err = smsa_vwrite( addr, len, buf );
 				}
@@ -255,6 +351,12 @@ int simulate_SMSA( char *wload, int cache_size ) {
 	// Close the workload file
 	fclose( fhandle );
 
+	// A workload that ends mounted may leave pipelined requests unsent
+	if ( smsa_client_flush() == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure completing the pipelined requests" );
+		return( -1 );
+	}
+
 	// Return successfully
 	return( 0 );
 }
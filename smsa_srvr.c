@@ -14,17 +14,40 @@
 // Project Includes
 #include <smsa.h>
 #include <smsa_network.h>
+#include <smsa_server.h>
 #include <cmpsc311_log.h>
 
 // Defines
-#define SMSA_ARGUMENTS "vhl:"
+#define SMSA_ARGUMENTS "vhl:b:w:u:iP:f:mc:g:d:r:q:j:"
 #define USAGE \
-	"USAGE: smsasrvr [-h] [-v] [-l <logfile>]\n" \
+	"USAGE: smsasrvr [-h] [-v] [-l <logfile>] [-b <backlog>] [-w <workers>] [-u <path>] [-i] [-P <port>] [-f <file>] [-m] [-c <secs>] [-j <journal>] [-g <drums>:<blocks>:<bytes>] [-d <first>-<last>] [-r <replica> ...] [-q <client>=<weight> ...]\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
+	"    -b - queue up to <backlog> connections waiting to be accepted\n" \
+	"    -w - perform drum operations on <workers> threads (one per core)\n" \
+	"    -u - listen on the unix socket <path> instead of TCP\n" \
+	"    -i - drive the sockets with io_uring instead of epoll\n" \
+	"    -P - listen on TCP <port> instead of the default\n" \
+	"    -f - keep the array contents in <file> between mounts, read at the\n" \
+	"         mount and written at the unmount\n" \
+	"    -m - map the array file (the -f <file>, or the default) into memory,\n" \
+	"         drums are read as touched and only changed pages written back\n" \
+	"    -c - checkpoint the changes to the stored array every <secs> seconds\n" \
+	"         (needs -f or -m)\n" \
+	"    -j - journal the changes to <journal> until checkpointed, they are\n" \
+	"         replayed at the next mount if the server stops without storing\n" \
+	"         (needs -f or -m)\n" \
+	"    -g - lay the array out as <drums> drums (up to 16) of <blocks> blocks\n" \
+	"         of <bytes> bytes (powers of 2, 256 to 16384), default 16:256:256\n" \
+	"    -d - serve only drums <first> to <last> (one shard of the array)\n" \
+	"    -r - forward writes to the replica server at <replica> (a unix socket\n" \
+	"         path or host[:port]), may be given more than once\n" \
+	"    -q - give the clients at <client> (an IP address, or unix) <weight>\n" \
+	"         times the share of the server of the others when it is busy,\n" \
+	"         may be given more than once\n" \
 	"\n" \
 
 //
@@ -49,6 +72,7 @@ int main( int argc, char *argv[] )
 {
 	// Local variables
 	int ch, verbose = 0, log_initialized = 0;
+	uint32_t drums, blocks, block_size;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, SMSA_ARGUMENTS)) != -1) {
@@ -67,12 +91,103 @@ int main( int argc, char *argv[] )
 			log_initialized = 1;
 			break;
 
+		case 'b': // Set the listen backlog
+			if ( (sscanf( optarg, "%d", &smsa_server_backlog ) != 1) || (smsa_server_backlog < 1) ) {
+				fprintf( stderr, "Bad backlog [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'w': // Set the number of drum workers
+			if ( (sscanf( optarg, "%d", &smsa_server_workers ) != 1) ||
+					(smsa_server_workers < 1) || (smsa_server_workers > SMSA_DISK_ARRAY_SIZE) ) {
+				fprintf( stderr, "Bad worker count [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'u': // Use a unix socket
+			smsa_unix_path = optarg;
+			break;
+
+		case 'i': // Use the io_uring engine
+			smsa_server_uring = 1;
+			break;
+
+		case 'P': // Set the TCP port
+			if ( (sscanf( optarg, "%d", &smsa_tcp_port ) != 1) || (smsa_tcp_port < 1) || (smsa_tcp_port > 65535) ) {
+				fprintf( stderr, "Bad port [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'f': // Set the array data file (and store the array there)
+			smsa_disk_file = optarg;
+			smsa_disk_store = 1;
+			break;
+
+		case 'm': // Map the array file
+			smsa_disk_mmap = 1;
+			break;
+
+		case 'c': // Set the checkpoint interval
+			if ( (sscanf( optarg, "%d", &smsa_checkpoint_interval ) != 1) || (smsa_checkpoint_interval < 1) ) {
+				fprintf( stderr, "Bad checkpoint interval [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'j': // Journal the changes
+			smsa_journal_file = optarg;
+			break;
+
+		case 'g': // Set the geometry of the array
+			if ( (sscanf( optarg, "%u:%u:%u", &drums, &blocks, &block_size ) != 3) ||
+					(smsa_set_geometry(drums, blocks, block_size) == -1) ) {
+				fprintf( stderr, "Bad array geometry [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'd': // Set the drums served
+			if ( (sscanf( optarg, "%d-%d", &smsa_server_first_drum, &smsa_server_last_drum ) != 2) ||
+					(smsa_server_first_drum < 0) || (smsa_server_last_drum < smsa_server_first_drum) ||
+					(smsa_server_last_drum >= SMSA_DISK_ARRAY_SIZE) ) {
+				fprintf( stderr, "Bad drum range [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'r': // Add a replica
+			if ( smsa_add_replica(optarg) == -1 ) {
+				fprintf( stderr, "Bad replica [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'q': // Weight a client
+			if ( smsa_add_weight(optarg) == -1 ) {
+				fprintf( stderr, "Bad client weight [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
 		}
 	}
 
+	// Checkpoints and the journal are of a stored array
+	if ( smsa_checkpoint_interval && !smsa_disk_store && !smsa_disk_mmap ) {
+		fprintf( stderr, "Checkpoints need a stored array (-f or -m), aborting.\n" );
+		return( -1 );
+	}
+	if ( (smsa_journal_file != NULL) && !smsa_disk_store && !smsa_disk_mmap ) {
+		fprintf( stderr, "A journal needs a stored array (-f or -m), aborting.\n" );
+		return( -1 );
+	}
+
 	// Setup the log as needed
 	if ( ! log_initialized ) {
 		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
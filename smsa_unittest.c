@@ -10,14 +10,24 @@
 // Include Files
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 // Project Includes
 #include <smsa.h>
 #include <smsa_internal.h>
+#include <smsa_network.h>
+#include <smsa_unittest.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
+#define TEST_DISK_FILE "smsa_unittest.dat"
+#define TEST_JOURNAL_FILE "smsa_unittest.jnl"
+#define TEST_JOURNAL_OLD TEST_JOURNAL_FILE ".old"
 
 //
 // Global Data
@@ -27,6 +37,10 @@
 unsigned char * test_disk_block( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, unsigned char *blk );
 int doVread( uint32_t addr, uint32_t len );
 int translateVAddress( uint32_t addr, SMSA_DRUM_ID *drm, SMSA_BLOCK_ID *blk, uint32_t *offset ); // From implementation
+int client_geometry( unsigned char *buf ); // From client
+extern int client_geometry_known; // From client
+int test_journal_writes( void );
+int test_journal_contents( int torn );
 
 //
 // Functions
@@ -107,7 +121,8 @@ int smsa_unit_test( void ) {
 	//
 	// End UNIT Test
 
-	// Log success and return successfully
+	// Unmount, log success and return successfully
+	smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
 	logMessage( LOG_INFO_LEVEL, "UNIT TEST Successful." );
 	return( 0 );
 }
@@ -138,6 +153,468 @@ int smsa_vread_unit_test( void ) {
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_run_unit_tests
+// Description  : Run each of the UNIT tests against a local array, on test
+//                files of its own (the array and journal files are removed
+//                afterwards).
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_run_unit_tests( void ) {
+
+	// Local variables
+	char *disk_file = smsa_disk_file, *journal_file = smsa_journal_file;
+	int disk_mmap = smsa_disk_mmap, ret = 0;
+
+	// Work on files of our own
+	smsa_disk_file = TEST_DISK_FILE;
+	smsa_journal_file = NULL;
+	unlink( TEST_DISK_FILE );
+
+	// The original test keeps the contents over a remount, so needs the map
+	smsa_disk_mmap = 1;
+	if ( smsa_unit_test() || smsa_encoding_unit_test() || smsa_geometry_unit_test() ||
+			smsa_range_unit_test() || smsa_format_unit_test() || smsa_journal_unit_test() ) {
+		ret = -1;
+	}
+
+	// Put it all back (the geometry was the default)
+	smsa_set_geometry( SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE );
+	smsa_disk_file = disk_file;
+	smsa_journal_file = journal_file;
+	smsa_disk_mmap = disk_mmap;
+	unlink( TEST_DISK_FILE );
+	unlink( TEST_JOURNAL_FILE );
+	unlink( TEST_JOURNAL_OLD );
+	logMessage( LOG_INFO_LEVEL, "UNIT TESTS %s.", (ret == 0) ? "Successful" : "FAILED" );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_encoding_unit_test
+// Description  : Round trip blocks through the wire encoding, then make sure
+//                the decoder refuses truncated and malformed encodings
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_encoding_unit_test( void ) {
+
+	// Local variables
+	unsigned char blks[4*SMSA_BLOCK_SIZE], enc[4*SMSA_BLOCK_SIZE], dec[4*SMSA_BLOCK_SIZE];
+	unsigned char bad[8];
+	int i, len, ret, ends[4];
+
+	// Log the test
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Encoding beginning ..." );
+
+	// One block of each kind: a fill, four runs, bytes that never repeat and
+	// a block of zeros
+	memset( &blks[0], 0x5a, SMSA_BLOCK_SIZE );
+	for ( i=0; i<SMSA_BLOCK_SIZE; i++ ) {
+		blks[SMSA_BLOCK_SIZE+i] = (unsigned char)(1 + i/(SMSA_BLOCK_SIZE/4));
+		blks[2*SMSA_BLOCK_SIZE+i] = (unsigned char)(i*37);
+	}
+	memset( &blks[3*SMSA_BLOCK_SIZE], 0x0, SMSA_BLOCK_SIZE );
+	ends[0] = 2;
+	ends[1] = ends[0] + 2 + 2*4;
+	ends[2] = ends[1] + 1 + SMSA_BLOCK_SIZE;
+	ends[3] = ends[2] + 2;
+
+	// Encode them, check each block got the encoding expected
+	len = smsa_encode_blocks( enc, blks, sizeof(blks) );
+	if ( (len != ends[3]) || (enc[0] != SMSA_NET_ENC_FILL) || (enc[ends[0]] != SMSA_NET_ENC_RLE) ||
+			(enc[ends[1]] != SMSA_NET_ENC_RAW) || (enc[ends[2]] != SMSA_NET_ENC_FILL) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED ENCODE [len=%d, expected %d]", len, ends[3] );
+		return( -1 );
+	}
+
+	// Decode them back
+	if ( (smsa_decode_blocks(dec, sizeof(dec), enc, len) != sizeof(blks)) ||
+			(memcmp(dec, blks, sizeof(blks)) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE COMPARE" );
+		return( -1 );
+	}
+
+	// Cut it short everywhere, only the ends of blocks decode (to those)
+	for ( len=0; len<ends[3]; len++ ) {
+		ret = smsa_decode_blocks( dec, sizeof(dec), enc, len );
+		for ( i=0; (i<4) && (ends[i] != len); i++ );
+		if ( ((i < 4) && (ret != (i+1)*SMSA_BLOCK_SIZE)) || ((i == 4) && (len > 0) && (ret != -1)) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED TRUNCATED DECODE [len=%d, ret=%d]", len, ret );
+			return( -1 );
+		}
+	}
+
+	// No room for the last block, and an unknown tag
+	if ( smsa_decode_blocks(dec, sizeof(dec)-1, enc, ends[3]) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE PAST BUFFER" );
+		return( -1 );
+	}
+	enc[ends[2]] = SMSA_NET_ENC_RAW+1;
+	if ( smsa_decode_blocks(dec, sizeof(dec), enc, ends[3]) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE UNKNOWN TAG" );
+		return( -1 );
+	}
+
+	// Runs short of the block, no runs, runs past the block
+	bad[0] = SMSA_NET_ENC_RLE; bad[1] = 1; bad[2] = 9; bad[3] = 0x11;
+	if ( smsa_decode_blocks(dec, sizeof(dec), bad, 4) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE SHORT RUNS" );
+		return( -1 );
+	}
+	bad[1] = 0;
+	if ( smsa_decode_blocks(dec, sizeof(dec), bad, 2) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE NO RUNS" );
+		return( -1 );
+	}
+	bad[1] = 3; bad[2] = 255; bad[4] = 255; bad[5] = 0x22; bad[6] = 0; bad[7] = 0x33;
+	if ( smsa_decode_blocks(dec, sizeof(dec), bad, 8) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED DECODE LONG RUNS" );
+		return( -1 );
+	}
+
+	// Part of a block, or a block that doesn't get shorter, are not encoded
+	if ( (smsa_encode_blocks(enc, blks, SMSA_BLOCK_SIZE+1) != -1) ||
+			(smsa_encode_blocks(enc, &blks[2*SMSA_BLOCK_SIZE], SMSA_BLOCK_SIZE) != -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED ENCODE REFUSAL" );
+		return( -1 );
+	}
+
+	// Log success and return successfully
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Encoding successful." );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_geometry_unit_test
+// Description  : Check the geometry is only changed to a sane one while
+//                unmounted, and that the one a server hands a client at
+//                mount lays the client's array out (and later servers agree)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_geometry_unit_test( void ) {
+
+	// Local variables
+	unsigned char geo[SMSA_NET_GEOMETRY_SIZE], other[SMSA_NET_GEOMETRY_SIZE];
+	uint32_t drums, blocks, block_size;
+
+	// Log the test
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Geometry beginning ..." );
+
+	// Sizes that are not powers of 2 or are too large are refused
+	if ( (smsa_set_geometry(0, 256, 256) != -1) || (smsa_set_geometry(SMSA_DISK_ARRAY_SIZE+1, 256, 256) != -1) ||
+			(smsa_set_geometry(4, 300, 256) != -1) || (smsa_set_geometry(4, SMSA_MAX_DRUM_BLOCKS*2, 256) != -1) ||
+			(smsa_set_geometry(4, 256, 384) != -1) || (smsa_set_geometry(4, 256, SMSA_BLOCK_SIZE/2) != -1) ||
+			(smsa_set_geometry(4, 256, SMSA_MAX_BLOCK_SIZE*2) != -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED ILLEGAL GEOMETRY ACCEPTED" );
+		return( -1 );
+	}
+
+	// A sane one, and its shifts
+	if ( (smsa_set_geometry(4, 4096, 1024) != 0) || (smsa_geometry.block_shift != 10) ||
+			(smsa_geometry.drum_shift != 22) || (smsa_geometry.range_blocks != SMSA_MAX_RANGE_BYTES/1024) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED GEOMETRY SET" );
+		return( -1 );
+	}
+
+	// It can't change under a mounted array
+	smsa_operation( encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL );
+	if ( smsa_set_geometry(SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED GEOMETRY CHANGED WHILE MOUNTED" );
+		return( -1 );
+	}
+	smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+
+	// Pack it as a server would, then take it back out
+	smsa_pack_geometry( geo );
+	smsa_unpack_geometry( geo, &drums, &blocks, &block_size );
+	if ( (drums != 4) || (blocks != 4096) || (block_size != 1024) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED GEOMETRY PACK [%u/%u/%u]", drums, blocks, block_size );
+		return( -1 );
+	}
+
+	// The first server of a mount lays out the client, the next must agree
+	smsa_set_geometry( 2, 256, 256 );
+	smsa_pack_geometry( other );
+	smsa_set_geometry( SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE );
+	client_geometry_known = 0;
+	if ( (client_geometry(geo) != 0) || (smsa_geometry.drums != 4) || (smsa_geometry.blocks != 4096) ||
+			(smsa_geometry.block_size != 1024) || (client_geometry(geo) != 0) || (client_geometry(other) != -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED GEOMETRY NEGOTIATION" );
+		client_geometry_known = 0;
+		return( -1 );
+	}
+	client_geometry_known = 0;
+
+	// Log success and return successfully
+	smsa_set_geometry( SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE );
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Geometry successful." );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_range_unit_test
+// Description  : Exercise the range operations (and partial writes) on a
+//                drum long enough to sign more than one reply can hold
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_range_unit_test( void ) {
+
+	// Local variables
+	unsigned char blks[SMSA_MAX_RANGE_BYTES], blks2[SMSA_MAX_RANGE_BYTES];
+	unsigned char sigs[SMSA_MAX_RANGE_BYTES+SMSA_BLOCK_SIZE], sig[SMSA_SIGNATURE_SIZE];
+	unsigned char at[SMSA_WRITE_AT_HEADER+5];
+	uint32_t op;
+	int i;
+
+	// Log the test, the drums have more blocks than one reply can sign
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Range beginning ..." );
+	if ( smsa_set_geometry(4, 4096, SMSA_BLOCK_SIZE) ||
+			smsa_operation(encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED RANGE MOUNT" );
+		return( -1 );
+	}
+
+	// Write a range, read it back
+	for ( i=0; i<SMSA_MAX_RANGE_BLOCKS; i++ ) {
+		test_disk_block( 1, 100+i, &blks[i*SMSA_BLOCK_SIZE] );
+	}
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 1, 100), SMSA_MAX_RANGE_BLOCKS, blks) ||
+			smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 1, 100), SMSA_MAX_RANGE_BLOCKS, blks2) ||
+			(memcmp(blks, blks2, sizeof(blks)) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED RANGE COMPARE" );
+		return( -1 );
+	}
+
+	// Ranges past one operation or off the end of the drum are refused
+	op = encode_SMSA_operation( SMSA_READ_RANGE, 1, 0 );
+	if ( (smsa_operation_ex(op, SMSA_MAX_RANGE_BLOCKS+1, blks2) != -1) || smsa_reply_fits(op, SMSA_MAX_RANGE_BLOCKS+1) ||
+			(smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 1, 0), SMSA_MAX_RANGE_BLOCKS+1, blks) != -1) ||
+			(smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 1, 4090), 10, blks2) != -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED ILLEGAL RANGE ACCEPTED" );
+		return( -1 );
+	}
+
+	// Write bytes within a block, the rest of it stays
+	at[0] = 0; at[1] = 10;
+	memset( &at[SMSA_WRITE_AT_HEADER], 0xee, 5 );
+	memset( &blks[SMSA_BLOCK_SIZE+10], 0xee, 5 );
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_AT, 1, 101), 5, at) ||
+			smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 1, 101), 1, blks2) ||
+			(memcmp(&blks[SMSA_BLOCK_SIZE], blks2, SMSA_BLOCK_SIZE) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED WRITE AT COMPARE" );
+		return( -1 );
+	}
+	at[1] = SMSA_BLOCK_SIZE-2;
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_AT, 1, 101), 5, at) != -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED WRITE AT PAST BLOCK ACCEPTED" );
+		return( -1 );
+	}
+
+	// Sign a range, each signature is the one the block gets on its own
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_SIGN_RANGE, 1, 100), SMSA_MAX_RANGE_BLOCKS, sigs) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED SIGN RANGE" );
+		return( -1 );
+	}
+	for ( i=0; i<SMSA_MAX_RANGE_BLOCKS; i++ ) {
+		if ( smsa_operation_ex(encode_SMSA_operation(SMSA_SIGN_RANGE, 1, 100+i), 1, sig) ||
+				(memcmp(sig, &sigs[i*SMSA_SIGNATURE_SIZE], SMSA_SIGNATURE_SIZE) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED SIGN RANGE COMPARE [block=%d]", 100+i );
+			return( -1 );
+		}
+	}
+
+	// A reply's worth of signatures fills the buffer and no more, one more
+	// block is refused before anything is signed
+	memset( sigs, 0xa5, sizeof(sigs) );
+	op = encode_SMSA_operation( SMSA_SIGN_RANGE, 1, 0 );
+	if ( smsa_operation_ex(op, SMSA_MAX_SIGN_BLOCKS, sigs) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FULL SIGN RANGE" );
+		return( -1 );
+	}
+	for ( i=SMSA_MAX_RANGE_BYTES; i<sizeof(sigs); i++ ) {
+		if ( sigs[i] != 0xa5 ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED SIGN RANGE OVERRAN BUFFER" );
+			return( -1 );
+		}
+	}
+	if ( (smsa_operation_ex(op, SMSA_MAX_SIGN_BLOCKS+1, sigs) != -1) ||
+			smsa_reply_fits(op, SMSA_MAX_SIGN_BLOCKS+1) || (smsa_reply_bytes(op, SMSA_MAX_SIGN_BLOCKS+1) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED SIGN RANGE PAST REPLY ACCEPTED" );
+		return( -1 );
+	}
+
+	// Log success and return successfully
+	smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+	smsa_set_geometry( SMSA_DISK_ARRAY_SIZE, SMSA_MAX_BLOCK_ID, SMSA_BLOCK_SIZE );
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Range successful." );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_format_unit_test
+// Description  : Format a written drum (a new generation of it) and check its
+//                blocks read, sign and partially write as zeros, in memory
+//                and mapped from the file
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_format_unit_test( void ) {
+
+	// Local variables
+	unsigned char blks[8*SMSA_BLOCK_SIZE], blk[SMSA_BLOCK_SIZE], blk2[SMSA_BLOCK_SIZE];
+	unsigned char zsig[SMSA_SIGNATURE_SIZE], sigs[8*SMSA_SIGNATURE_SIZE];
+	unsigned char at[SMSA_WRITE_AT_HEADER+4];
+	int i, mmap, pass;
+
+	// Log the test
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Format beginning ..." );
+	mmap = smsa_disk_mmap;
+	for ( smsa_disk_mmap=0; smsa_disk_mmap<2; smsa_disk_mmap++ ) {
+
+		// Write a few blocks to the drum (and one to the next), sign them
+		unlink( TEST_DISK_FILE );
+		smsa_operation( encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL );
+		for ( i=0; i<8; i++ ) {
+			test_disk_block( 2, 16+i, &blks[i*SMSA_BLOCK_SIZE] );
+		}
+		if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 2, 16), 8, blks) ||
+				smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 3, 16), 1, test_disk_block(3, 16, blk)) ||
+				smsa_operation_ex(encode_SMSA_operation(SMSA_SIGN_RANGE, 2, 16), 8, sigs) ||
+				smsa_operation_ex(encode_SMSA_operation(SMSA_SIGN_RANGE, 2, 100), 1, zsig) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FORMAT SETUP [mmap=%d]", smsa_disk_mmap );
+			return( -1 );
+		}
+
+		// Format it (twice), the blocks read and sign as zeros each time, and
+		// the bytes of a partial write land in a block of zeros
+		for ( pass=0; pass<2; pass++ ) {
+			memset( blk, 0x0, SMSA_BLOCK_SIZE );
+			if ( smsa_operation(encode_SMSA_operation(SMSA_SEEK_DRUM, 2, 0), NULL) ||
+					smsa_operation(encode_SMSA_operation(SMSA_FORMAT_DRUM, 0, 0), NULL) ||
+					smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 2, 16), 8, blks) ||
+					smsa_operation_ex(encode_SMSA_operation(SMSA_SIGN_RANGE, 2, 16), 8, sigs) ) {
+				logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FORMAT [mmap=%d]", smsa_disk_mmap );
+				return( -1 );
+			}
+			for ( i=0; i<8; i++ ) {
+				if ( (memcmp(&blks[i*SMSA_BLOCK_SIZE], blk, SMSA_BLOCK_SIZE) != 0) ||
+						(memcmp(&sigs[i*SMSA_SIGNATURE_SIZE], zsig, SMSA_SIGNATURE_SIZE) != 0) ) {
+					logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FORMATTED BLOCK NOT ZERO [mmap=%d,block=%d]",
+							smsa_disk_mmap, 16+i );
+					return( -1 );
+				}
+			}
+			at[0] = 0; at[1] = 100;
+			memset( &at[SMSA_WRITE_AT_HEADER], 0x77, 4 );
+			memset( &blk[100], 0x77, 4 );
+			if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_AT, 2, 19), 4, at) ||
+					smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 2, 19), 1, blk2) ||
+					(memcmp(blk, blk2, SMSA_BLOCK_SIZE) != 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FORMATTED PARTIAL WRITE [mmap=%d]", smsa_disk_mmap );
+				return( -1 );
+			}
+		}
+
+		// The next drum is left alone
+		if ( smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 3, 16), 1, blk2) ||
+				(memcmp(test_disk_block(3, 16, blk), blk2, SMSA_BLOCK_SIZE) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED FORMAT REACHED ANOTHER DRUM [mmap=%d]", smsa_disk_mmap );
+			return( -1 );
+		}
+		smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+	}
+	smsa_disk_mmap = mmap;
+
+	// Log success and return successfully
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Format successful." );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_journal_unit_test
+// Description  : Crash a child part way through writing the (journaled,
+//                mapped) array, lose every page it wrote, and check the
+//                journal replays the contents at the next mount.  Then again
+//                with the last record torn, which must be dropped (alone).
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int smsa_journal_unit_test( void ) {
+
+	// Local variables
+	struct stat st;
+	int torn, status, mmap;
+	pid_t pid;
+
+	// Log the test
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Journal beginning ..." );
+	mmap = smsa_disk_mmap;
+	smsa_disk_mmap = 1;
+	for ( torn=0; torn<2; torn++ ) {
+
+		// Start from nothing, the child writes then dies without unmounting
+		unlink( TEST_DISK_FILE );
+		unlink( TEST_JOURNAL_FILE );
+		unlink( TEST_JOURNAL_OLD );
+		smsa_journal_file = TEST_JOURNAL_FILE;
+		if ( (pid = fork()) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL FORK" );
+			return( -1 );
+		}
+		if ( pid == 0 ) {
+			_exit( test_journal_writes() ? 1 : 0 );
+		}
+		if ( (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL WRITER" );
+			return( -1 );
+		}
+
+		// None of the pages made it to the file, and perhaps the last record
+		// was torn by the crash
+		if ( (truncate(TEST_DISK_FILE, 0) == -1) || (stat(TEST_JOURNAL_FILE, &st) == -1) ||
+				(torn && (truncate(TEST_JOURNAL_FILE, st.st_size-1) == -1)) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL CRASH [%s]", strerror(errno) );
+			return( -1 );
+		}
+
+		// Mount (replaying the journal), check the contents
+		if ( smsa_operation(encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL) || test_journal_contents(torn) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL REPLAY [torn=%d]", torn );
+			return( -1 );
+		}
+		smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+
+		// The contents were checkpointed, they survive without the journal
+		smsa_journal_file = NULL;
+		if ( smsa_operation(encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL) || test_journal_contents(torn) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL CHECKPOINT [torn=%d]", torn );
+			return( -1 );
+		}
+		smsa_operation( encode_SMSA_operation(SMSA_UNMOUNT, 0, 0), NULL );
+	}
+	smsa_disk_mmap = mmap;
+
+	// Log success and return successfully
+	logMessage( LOG_INFO_LEVEL, "UNIT TEST Journal successful." );
+	return( 0 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : test_disk_block
@@ -155,6 +632,109 @@ unsigned char * test_disk_block( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, unsigned c
 	return( blk );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_journal_writes
+// Description  : Write the changes the journal test replays (in the child
+//                that crashes), the last in a commit of its own
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 otherwise
+
+int test_journal_writes( void ) {
+
+	// Local variables
+	unsigned char blks[8*SMSA_BLOCK_SIZE], at[SMSA_WRITE_AT_HEADER+5];
+	int i;
+
+	// Mount, write a range and some bytes within it
+	for ( i=0; i<8; i++ ) {
+		test_disk_block( 1, 16+i, &blks[i*SMSA_BLOCK_SIZE] );
+	}
+	at[0] = 0; at[1] = 10;
+	memset( &at[SMSA_WRITE_AT_HEADER], 0xaa, 5 );
+	if ( smsa_operation(encode_SMSA_operation(SMSA_MOUNT, 0, 0), NULL) ||
+			smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 1, 16), 8, blks) ||
+			smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_AT, 1, 19), 5, at) ) {
+		return( -1 );
+	}
+
+	// Write another drum, format it, then write it again
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 2, 16), 4, blks) ||
+			smsa_operation(encode_SMSA_operation(SMSA_SEEK_DRUM, 2, 0), NULL) ||
+			smsa_operation(encode_SMSA_operation(SMSA_FORMAT_DRUM, 0, 0), NULL) ||
+			smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 2, 21), 1, test_disk_block(2, 21, blks)) ||
+			smsa_journal_commit() ) {
+		return( -1 );
+	}
+
+	// The last block goes on its own (the one a torn journal loses)
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_WRITE_RANGE, 3, 16), 1, test_disk_block(3, 16, blks)) ||
+			smsa_journal_commit() ) {
+		return( -1 );
+	}
+
+	// Return successfully (without unmounting)
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_journal_contents
+// Description  : Check the array holds what test_journal_writes wrote
+//
+// Inputs       : torn - the last write was torn from the journal
+// Outputs      : 0 if successful, -1 otherwise
+
+int test_journal_contents( int torn ) {
+
+	// Local variables
+	unsigned char blk[SMSA_BLOCK_SIZE], blk2[SMSA_BLOCK_SIZE];
+	int i;
+
+	// The range (with the bytes written within it)
+	for ( i=16; i<24; i++ ) {
+		test_disk_block( 1, i, blk );
+		if ( i == 19 ) {
+			memset( &blk[10], 0xaa, 5 );
+		}
+		if ( smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 1, i), 1, blk2) ||
+				(memcmp(blk, blk2, SMSA_BLOCK_SIZE) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL COMPARE [drum=1,block=%d]", i );
+			return( -1 );
+		}
+	}
+
+	// The formatted drum, only the block written since
+	for ( i=16; i<22; i++ ) {
+		if ( i == 21 ) {
+			test_disk_block( 2, i, blk );
+		} else {
+			memset( blk, 0x0, SMSA_BLOCK_SIZE );
+		}
+		if ( smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 2, i), 1, blk2) ||
+				(memcmp(blk, blk2, SMSA_BLOCK_SIZE) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL COMPARE [drum=2,block=%d]", i );
+			return( -1 );
+		}
+	}
+
+	// The last block, unless it was torn off
+	if ( torn ) {
+		memset( blk, 0x0, SMSA_BLOCK_SIZE );
+	} else {
+		test_disk_block( 3, 16, blk );
+	}
+	if ( smsa_operation_ex(encode_SMSA_operation(SMSA_READ_RANGE, 3, 16), 1, blk2) ||
+			(memcmp(blk, blk2, SMSA_BLOCK_SIZE) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "UNIT TEST FAILED JOURNAL COMPARE [drum=3,block=16,torn=%d]", torn );
+		return( -1 );
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : doVread
@@ -26,6 +26,24 @@ int smsa_unit_test( void );
 int smsa_vread_unit_test( void );
 	// This is the implementation of the vread UNIT test
 
+int smsa_run_unit_tests( void );
+	// Run each of the UNIT tests against a local array
+
+int smsa_encoding_unit_test( void );
+	// Round trip blocks through the wire encoding (and refuse bad ones)
+
+int smsa_geometry_unit_test( void );
+	// Check the geometry and its negotiation at mount
+
+int smsa_range_unit_test( void );
+	// Exercise the range operations and partial writes
+
+int smsa_format_unit_test( void );
+	// Check a formatted drum reads as zeros
+
+int smsa_journal_unit_test( void );
+	// Crash while writing and check the journal replays
+
 unsigned char * test_disk_block( SMSA_DRUM_ID did, SMSA_BLOCK_ID bid, unsigned char *blk );
 	// create a block for a specific drum and block ID
 
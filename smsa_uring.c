@@ -0,0 +1,684 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_uring.c
+//  Description   : This is the io_uring engine of the SMSA server.  It does
+//                  the same request handling as the epoll loop, but sockets
+//                  are accepted (multishot), read and written through one
+//                  io_uring, with every connection's buffers registered.
+//                  Each pass submits everything queued and reaps every
+//                  completion with a single io_uring_enter call.
+//
+//   Author        : Patrick McDaniel
+//   Last Modified : Mon Oct 28 06:58:31 EDT 2013
+//
+
+// Include Files
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+// Project Include Files
+#include <smsa.h>
+#include <smsa_network.h>
+#include <smsa_server.h>
+#include <smsa_shm.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define SMSA_URING_ENTRIES 1024		// Submission queue entries
+#define SMSA_URING_MAX_CONNS 4096	// Connections with registered buffers
+#define SMSA_URING_READ 1		// Completion tags, or'd with the connection
+#define SMSA_URING_WRITE 2
+#define SMSA_URING_ACCEPT 0		// Completion tags with no connection
+#define SMSA_URING_WORKERS 3
+#define SMSA_URING_TAGS 3
+
+//
+// Type definitions
+
+// The submission and completion rings as mapped from the kernel
+typedef struct {
+    int                   fd;	    // The io_uring instance
+    unsigned             *sq_head;  // Submission ring
+    unsigned             *sq_tail;
+    unsigned             *sq_mask;
+    unsigned             *sq_array;
+    struct io_uring_sqe  *sqes;
+    unsigned              queued;   // Entries filled since the last enter
+    unsigned             *cq_head;  // Completion ring
+    unsigned             *cq_tail;
+    unsigned             *cq_mask;
+    struct io_uring_cqe  *cqes;
+    void                 *ring;	    // The mappings, for cleanup
+    size_t                ring_size;
+    size_t                sqes_size;
+} SMSA_URING;
+
+//
+// Global data
+
+int smsa_server_uring = 0;			// Use the io_uring engine
+static SMSA_URING smsa_uring;			// The ring
+static int smsa_uring_free[SMSA_URING_MAX_CONNS]; // Unused buffer slots
+static int smsa_uring_nfree = 0;
+
+//
+// Functional Prototypes
+int smsa_uring_setup( void );
+void smsa_uring_teardown( void );
+struct io_uring_sqe *smsa_uring_sqe( void );
+int smsa_uring_enter( unsigned wait );
+void smsa_uring_accept( int server, struct io_uring_cqe *cqe );
+void smsa_uring_queue_poll( int fd );
+void smsa_uring_queue_read( SMSA_CONNECTION *conn );
+void smsa_uring_queue_write( SMSA_CONNECTION *conn );
+int smsa_uring_service( SMSA_CONNECTION *conn );
+void smsa_uring_done( SMSA_CONNECTION *conn );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_server_uring_loop
+// Description  : The io_uring server processing loop.  Reads and writes
+//                complete into the connection buffers; connections with
+//                complete requests (or finished worker jobs) then take turns
+//                on the ready list as in the epoll loop.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_server_uring_loop( void ) {
+
+    // Local variables
+    struct sigaction new_action;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    SMSA_CONNECTION *conn;
+    unsigned head, tail;
+    int server, cfd = -1, more;
+    uint64_t tag;
+
+    // Set the signal handler, peers that go away must not kill us on a write
+    new_action.sa_handler = smsa_signal_handler;
+    new_action.sa_flags = SA_NODEFER | SA_ONSTACK;
+    sigemptyset( &new_action.sa_mask );
+    sigaction( SIGINT, &new_action, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    // Create the listening socket and the ring
+    if ( (server = smsa_server_listen()) == -1 ) {
+	return( -1 );
+    }
+    if ( smsa_uring_setup() == -1 ) {
+	smsa_error_number = SMSA_NET_ERROR;
+	close( server );
+	return( -1 );
+    }
+
+    // Start the drum workers, if any, and poll for their completions
+    if ( smsa_server_workers > 0 ) {
+	if ( (cfd = smsa_start_workers()) == -1 ) {
+	    logMessage( LOG_ERROR_LEVEL, "SMSA unable to setup drum workers, aborting." );
+	    smsa_error_number = SMSA_NET_ERROR;
+	    smsa_uring_teardown();
+	    close( server );
+	    return( -1 );
+	}
+	smsa_uring_queue_poll( cfd );
+    }
+
+    // Accept clients as they come
+    sqe = smsa_uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = SMSA_URING_ACCEPT;
+    logMessage( LOG_INFO_LEVEL, "SMSA server using io_uring" );
+
+    // Wait until server is complete
+    smsa_server_shutdown = 0;
+    while ( ! smsa_server_shutdown ) {
+
+	// Submit what was queued, wait for something to complete
+	if ( smsa_uring_enter((smsa_ready_count() == 0) ? 1 : 0) == -1 ) {
+	    break;
+	}
+
+	// Reap every completion
+	head = *smsa_uring.cq_head;
+	tail = __atomic_load_n( smsa_uring.cq_tail, __ATOMIC_ACQUIRE );
+	for ( ; head != tail; head++ ) {
+	    cqe = &smsa_uring.cqes[head & *smsa_uring.cq_mask];
+	    tag = cqe->user_data & SMSA_URING_TAGS;
+	    conn = (SMSA_CONNECTION *)(uintptr_t)(cqe->user_data & ~(uint64_t)SMSA_URING_TAGS);
+
+	    if ( conn == NULL ) {
+		if ( tag == SMSA_URING_ACCEPT ) {
+		    smsa_uring_accept( server, cqe );
+		} else if ( tag == SMSA_URING_WORKERS ) {
+		    if ( ! (cqe->flags & IORING_CQE_F_MORE) ) {
+			smsa_uring_queue_poll( cfd );
+		    }
+		    smsa_server_complete();
+		}
+		continue;
+	    }
+
+	    // A read or write on a connection
+	    conn->pending --;
+	    if ( tag == SMSA_URING_READ ) {
+		conn->reading = 0;
+		if ( cqe->res > 0 ) {
+		    conn->rlen += cqe->res;
+		} else if ( cqe->res != -EINTR ) {
+		    conn->hangup = 1;
+		}
+	    } else {
+		conn->writing = 0;
+		if ( cqe->res >= 0 ) {
+		    conn->woff += cqe->res;
+		    if ( conn->woff == conn->wlen ) {
+			conn->woff = conn->wlen = 0;
+		    }
+		} else if ( (cqe->res != -EINTR) && (cqe->res != -EAGAIN) ) {
+		    conn->hangup = 1;
+		}
+	    }
+	    if ( conn->closed ) {
+		smsa_uring_done( conn );
+	    } else {
+		smsa_ready_connection( conn );
+	    }
+	}
+	__atomic_store_n( smsa_uring.cq_head, head, __ATOMIC_RELEASE );
+
+	// Give every ready connection one turn
+	for ( more = smsa_ready_count(); more > 0; more-- ) {
+	    conn = smsa_next_ready();
+	    switch ( smsa_uring_service(conn) ) {
+		case -1:
+		    shutdown( conn->sock, SHUT_RDWR );
+		    smsa_close_connection( conn );
+		    break;
+		case 1:
+		    smsa_ready_connection( conn );
+		    break;
+	    }
+	}
+    }
+
+    // Log and shutdowmn, return
+    logMessage( LOG_INFO_LEVEL, "Shutting down SMSA server ..." );
+    if ( smsa_server_workers > 0 ) {
+	smsa_stop_workers();
+	smsa_server_complete();
+    }
+    while ( (conn = smsa_next_ready()) != NULL ) {
+	smsa_close_connection( conn );
+    }
+    smsa_uring_teardown();
+    close( server );
+    if ( smsa_unix_path != NULL ) {
+	unlink( smsa_unix_path );
+    }
+    return( 0 );
+}
+
+//
+// Local Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_setup
+// Description  : Create the ring, map it, and make the (sparse) table of
+//                registered buffers, two per connection
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_uring_setup( void ) {
+
+    // Local variables
+    struct io_uring_rsrc_register reg;
+    struct io_uring_params params;
+    unsigned char *ring;
+    int i;
+
+    // Create the ring, only this thread submits
+    memset( &params, 0x0, sizeof(params) );
+    params.flags = IORING_SETUP_CLAMP | IORING_SETUP_SINGLE_ISSUER;
+    if ( (smsa_uring.fd = syscall(__NR_io_uring_setup, SMSA_URING_ENTRIES, &params)) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring_setup() failed : [%s]", strerror(errno) );
+	return( -1 );
+    }
+    if ( ! (params.features & IORING_FEAT_SINGLE_MMAP) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring too old (no single mmap)" );
+	close( smsa_uring.fd );
+	return( -1 );
+    }
+
+    // Map both rings (one mapping) and the submission entries
+    smsa_uring.ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    if ( params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe) > smsa_uring.ring_size ) {
+	smsa_uring.ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    }
+    smsa_uring.sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring = mmap( NULL, smsa_uring.ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	    smsa_uring.fd, IORING_OFF_SQ_RING );
+    smsa_uring.sqes = mmap( NULL, smsa_uring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	    smsa_uring.fd, IORING_OFF_SQES );
+    if ( (ring == MAP_FAILED) || (smsa_uring.sqes == MAP_FAILED) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring mmap() failed : [%s]", strerror(errno) );
+	close( smsa_uring.fd );
+	return( -1 );
+    }
+    smsa_uring.ring = ring;
+    smsa_uring.sq_head = (unsigned *)(ring + params.sq_off.head);
+    smsa_uring.sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    smsa_uring.sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+    smsa_uring.sq_array = (unsigned *)(ring + params.sq_off.array);
+    smsa_uring.cq_head = (unsigned *)(ring + params.cq_off.head);
+    smsa_uring.cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    smsa_uring.cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+    smsa_uring.cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    smsa_uring.queued = 0;
+
+    // Room for every connection's buffers, filled in as clients connect
+    memset( &reg, 0x0, sizeof(reg) );
+    reg.nr = 2*SMSA_URING_MAX_CONNS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if ( syscall(__NR_io_uring_register, smsa_uring.fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring buffer registration failed : [%s]", strerror(errno) );
+	smsa_uring_teardown();
+	return( -1 );
+    }
+    for ( i=0; i<SMSA_URING_MAX_CONNS; i++ ) {
+	smsa_uring_free[i] = SMSA_URING_MAX_CONNS-1-i;
+    }
+    smsa_uring_nfree = SMSA_URING_MAX_CONNS;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_teardown
+// Description  : Release the ring
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_uring_teardown( void ) {
+    munmap( smsa_uring.sqes, smsa_uring.sqes_size );
+    munmap( smsa_uring.ring, smsa_uring.ring_size );
+    close( smsa_uring.fd );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_sqe
+// Description  : Get a cleared submission entry, submitting what is queued
+//                if the ring is full
+//
+// Inputs       : none
+// Outputs      : the entry
+
+struct io_uring_sqe *smsa_uring_sqe( void ) {
+
+    // Local variables
+    struct io_uring_sqe *sqe;
+    unsigned tail = *smsa_uring.sq_tail, idx;
+
+    // Make room if the kernel hasn't caught up
+    while ( tail - __atomic_load_n(smsa_uring.sq_head, __ATOMIC_ACQUIRE) >= SMSA_URING_ENTRIES ) {
+	smsa_uring_enter( 0 );
+    }
+
+    // Take the next entry, it is handed over on the next enter
+    idx = tail & *smsa_uring.sq_mask;
+    sqe = &smsa_uring.sqes[idx];
+    memset( sqe, 0x0, sizeof(*sqe) );
+    smsa_uring.sq_array[idx] = idx;
+    __atomic_store_n( smsa_uring.sq_tail, tail+1, __ATOMIC_RELEASE );
+    smsa_uring.queued ++;
+    return( sqe );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_enter
+// Description  : Submit the queued entries and (optionally) wait for a
+//                completion, all in one system call
+//
+// Inputs       : wait - number of completions to wait for (0 or 1)
+// Outputs      : 0 if successful, -1 if failure
+
+int smsa_uring_enter( unsigned wait ) {
+
+    // Local variables
+    int done;
+
+    if ( (smsa_uring.queued == 0) && (wait == 0) ) {
+	return( 0 );
+    }
+    done = syscall( __NR_io_uring_enter, smsa_uring.fd, smsa_uring.queued, wait,
+	    (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+    if ( done >= 0 ) {
+	smsa_uring.queued -= done;
+	return( 0 );
+    }
+    if ( (errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY) ) {
+	return( 0 );
+    }
+    logMessage( LOG_ERROR_LEVEL, "SMSA io_uring_enter() failed : [%s]", strerror(errno) );
+    smsa_error_number = SMSA_NET_ERROR;
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_accept
+// Description  : Setup a connection accepted by the multishot accept, its
+//                buffers are registered and the first read queued
+//
+// Inputs       : server - the listening socket
+//                cqe - the accept completion
+// Outputs      : none
+
+void smsa_uring_accept( int server, struct io_uring_cqe *cqe ) {
+
+    // Local variables
+    struct sockaddr_storage caddr;
+    struct sockaddr_in *inaddr = (struct sockaddr_in *)&caddr;
+    struct io_uring_rsrc_update2 update;
+    struct io_uring_sqe *sqe;
+    struct iovec iov[2];
+    SMSA_CONNECTION *conn;
+    socklen_t len = sizeof(caddr);
+    int client = cqe->res;
+
+    // The multishot accept ends on errors, start it again
+    if ( ! (cqe->flags & IORING_CQE_F_MORE) ) {
+	sqe = smsa_uring_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = server;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = SMSA_URING_ACCEPT;
+    }
+    if ( client < 0 ) {
+	logMessage( LOG_WARNING_LEVEL, "SMSA server accept failed : [%s]", strerror(-client) );
+	return;
+    }
+
+    // Setup the connection state and buffers
+    if ( smsa_uring_nfree == 0 ) {
+	logMessage( LOG_WARNING_LEVEL, "SMSA server out of connection slots" );
+	close( client );
+	return;
+    }
+    if ( ((conn = calloc(1, sizeof(SMSA_CONNECTION))) == NULL) ||
+	    ((conn->rbuf = malloc(SMSA_CONN_BUFFER_SIZE)) == NULL) ||
+	    ((conn->wbuf = malloc(SMSA_CONN_BUFFER_SIZE)) == NULL) ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA server out of memory for connection" );
+	if ( conn != NULL ) {
+	    free( conn->rbuf );
+	    free( conn );
+	}
+	close( client );
+	return;
+    }
+    conn->sock = client;
+    conn->doorbell = conn->passed[0] = conn->passed[1] = -1;
+    conn->version = SMSA_NET_VERSION_1;
+    conn->slot = smsa_uring_free[--smsa_uring_nfree];
+
+    // Register its buffers in its slot
+    iov[0].iov_base = conn->rbuf;
+    iov[0].iov_len = SMSA_CONN_BUFFER_SIZE;
+    iov[1].iov_base = conn->wbuf;
+    iov[1].iov_len = SMSA_CONN_BUFFER_SIZE;
+    memset( &update, 0x0, sizeof(update) );
+    update.offset = 2*conn->slot;
+    update.data = (uintptr_t)iov;
+    update.nr = 2;
+    if ( syscall(__NR_io_uring_register, smsa_uring.fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring buffer update failed : [%s]", strerror(errno) );
+	smsa_uring_free[smsa_uring_nfree++] = conn->slot;
+	conn->slot = -1;
+	smsa_close_connection( conn );
+	return;
+    }
+
+    // Log the creation of the new connection, start reading
+    if ( (getpeername(client, (struct sockaddr *)&caddr, &len) == 0) && (caddr.ss_family == AF_INET) ) {
+	snprintf( conn->name, sizeof(conn->name), "%s/%d", inet_ntoa(inaddr->sin_addr), ntohs(inaddr->sin_port) );
+	smsa_server_nodelay( client );
+    } else {
+	snprintf( conn->name, sizeof(conn->name), "unix/%d", client );
+    }
+    conn->weight = smsa_server_weight( conn->name );
+    logMessage( LOG_INFO_LEVEL, "Server new client connection [%s]", conn->name );
+    smsa_uring_queue_read( conn );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_release
+// Description  : Unregister the buffers of a connection being freed
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void smsa_uring_release( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    struct io_uring_rsrc_update2 update;
+    struct iovec iov[2];
+
+    // Empty entries clear the slot
+    memset( iov, 0x0, sizeof(iov) );
+    memset( &update, 0x0, sizeof(update) );
+    update.offset = 2*conn->slot;
+    update.data = (uintptr_t)iov;
+    update.nr = 2;
+    if ( syscall(__NR_io_uring_register, smsa_uring.fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA io_uring buffer update failed : [%s]", strerror(errno) );
+    }
+    smsa_uring_free[smsa_uring_nfree++] = conn->slot;
+    conn->slot = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_queue_poll
+// Description  : Poll (multishot) the workers' completion event
+//
+// Inputs       : fd - the completion event handle
+// Outputs      : none
+
+void smsa_uring_queue_poll( int fd ) {
+
+    // Local variables
+    struct io_uring_sqe *sqe = smsa_uring_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = SMSA_URING_WORKERS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_queue_read
+// Description  : Read into the free end of the receive buffer
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void smsa_uring_queue_read( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    struct io_uring_sqe *sqe = smsa_uring_sqe();
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = conn->sock;
+    sqe->addr = (uintptr_t)&conn->rbuf[conn->rlen];
+    sqe->len = SMSA_CONN_BUFFER_SIZE - conn->rlen;
+    sqe->off = -1;
+    sqe->buf_index = 2*conn->slot;
+    sqe->user_data = (uintptr_t)conn | SMSA_URING_READ;
+    conn->reading = 1;
+    conn->pending ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_queue_write
+// Description  : Write the unsent part of the send buffer
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void smsa_uring_queue_write( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    struct io_uring_sqe *sqe = smsa_uring_sqe();
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = conn->sock;
+    sqe->addr = (uintptr_t)&conn->wbuf[conn->woff];
+    sqe->len = conn->wlen - conn->woff;
+    sqe->off = -1;
+    sqe->buf_index = 2*conn->slot + 1;
+    sqe->user_data = (uintptr_t)conn | SMSA_URING_WRITE;
+    conn->writing = 1;
+    conn->pending ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_service
+// Description  : Give a connection its turn.  Answer the complete requests
+//                received that its deficit covers in batches, then make sure
+//                a write of the responses and a read for more requests are
+//                in flight.
+//
+// Inputs       : conn - the connection to service
+// Outputs      : 1 if there is more to do, 0 if not, -1 if closed or failed
+
+int smsa_uring_service( SMSA_CONNECTION *conn ) {
+
+    // Local variables
+    SMSA_REQUEST batch[SMSA_SERVER_QUANTUM], *req;
+    unsigned char *block;
+    int pos, used, blkbytes, served, count, cost;
+    uint64_t waited;
+    uint32_t op, id;
+    uint16_t flags, seq;
+    int16_t ret;
+
+    // The client went away
+    if ( conn->hangup ) {
+	logMessage( LOG_INFO_LEVEL, "SMSA client socket closed on rd [%s]", conn->name );
+	return( -1 );
+    }
+
+    // Gather complete requests while there is room for the responses and
+    // the deficit covers them, the workers take theirs as they come, inline
+    // ones are done in batches
+    smsa_server_emit( conn );
+    waited = smsa_server_begin_turn( conn );
+    pos = conn->rpos;
+    served = count = 0;
+    while ( smsa_server_room(conn) &&
+	    ((used = smsa_parse_packet(&conn->rbuf[pos], conn->rlen-pos, conn->version, &batch[count].op, &ret, &batch[count].id,
+		&batch[count].flags, &batch[count].seq, &batch[count].blkbytes, &batch[count].block)) > 0) ) {
+	req = &batch[count];
+	req->arg = ret;
+	if ( (cost = smsa_server_afford(conn, req->op, req->arg)) == 0 ) {
+	    break;
+	}
+	if ( req->op == SMSA_NET_SHM_ATTACH ) {
+	    // Shared memory needs the epoll loop (answered after the batch before it)
+	    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+	    conn->wlen += smsa_pack_packet( &conn->wbuf[conn->wlen], conn->version, req->op, -1, req->id, 0, 0, NULL, 0 );
+	    count = 0;
+	} else if ( smsa_server_workers > 0 ) {
+	    if ( ! smsa_server_dispatch(conn, req->op, req->arg, req->id, req->flags, req->seq, req->blkbytes, req->block) ) {
+		break;
+	    }
+	} else if ( (count = smsa_server_gather(conn, batch, count)) == SMSA_SERVER_QUANTUM ) {
+	    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+	    count = 0;
+	}
+	conn->deficit -= cost;
+	pos += used;
+	served ++;
+    }
+    conn->wlen += smsa_server_execute_batch( conn, batch, count, &conn->wbuf[conn->wlen] );
+    if ( served > 0 ) {
+	logMessage( LOG_INFO_LEVEL, "Received %d requests (%d bytes) on [%s]", served, pos-conn->rpos, conn->name );
+    }
+
+    // Drop what was used, unless a read is filling the buffer right now
+    if ( (pos > 0) && !conn->reading ) {
+	memmove( conn->rbuf, &conn->rbuf[pos], conn->rlen-pos );
+	conn->rlen -= pos;
+	pos = 0;
+    }
+    conn->rpos = pos;
+    smsa_server_emit( conn );
+
+    // A malformed request ends the connection
+    if ( smsa_parse_packet(&conn->rbuf[pos], conn->rlen-pos, conn->version, &op, &ret, &id, &flags, &seq, &blkbytes, &block) == -1 ) {
+	logMessage( LOG_ERROR_LEVEL, "SMSA received malformed packet on [%s]", conn->name );
+	smsa_error_number = SMSA_NET_ERROR;
+	return( -1 );
+    }
+    smsa_server_end_turn( conn, waited, served, smsa_server_waiting(&conn->rbuf[pos], conn->rlen-pos, conn->version) );
+
+    // Keep a write and a read in flight
+    if ( (conn->wlen > conn->woff) && !conn->writing ) {
+	smsa_uring_queue_write( conn );
+    }
+    if ( !conn->reading && (conn->rlen < SMSA_CONN_BUFFER_SIZE) ) {
+	smsa_uring_queue_read( conn );
+    }
+
+    // Go again while there are requests we can answer
+    if ( conn->blocked ) {
+	return( 0 );
+    }
+    return( (smsa_server_room(conn) && (smsa_parse_packet(&conn->rbuf[pos], conn->rlen-pos, conn->version, &op, &ret, &id, &flags, &seq, &blkbytes, &block) > 0)) ||
+	    (smsa_server_reply_ready(conn) && (conn->wlen+SMSA_NET_MAX_PACKET <= SMSA_CONN_BUFFER_SIZE)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_uring_done
+// Description  : A read or write finished on a closed connection, free it
+//                once nothing is left in flight
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void smsa_uring_done( SMSA_CONNECTION *conn ) {
+    if ( (conn->pending == 0) && (conn->inflight == 0) ) {
+	smsa_free_connection( conn );
+    }
+}
@@ -0,0 +1,282 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : smsa_worker.c
+//  Description   : This is the drum worker pool of the SMSA server.  Each
+//                  worker is a thread pinned to a core that owns a fixed set
+//                  of drums (drum % workers), so operations on different
+//                  drums run in parallel without sharing any drum state.
+//
+//   Author        : Hayder Sharhan
+//   Last Modified : Tue Dec 10 2013
+//
+
+// Include Files
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Project Include Files
+#include <smsa.h>
+#include <smsa_internal.h>
+#include <smsa_network.h>
+#include <cmpsc311_log.h>
+
+//
+// Type definitions
+
+// A drum worker and its queue of jobs
+typedef struct {
+	pthread_t	thread;		// The worker thread
+	int		index;		// The worker number (and its core)
+	pthread_mutex_t	lock;		// Protects the queue
+	pthread_cond_t	wakeup;		// Signalled when jobs are queued
+	SMSA_JOB	*head;		// Jobs waiting to be performed
+	SMSA_JOB	*tail;
+} SMSA_WORKER;
+
+//
+// Global data
+
+int smsa_server_workers = 0;			// Number of drum workers (0 = serve inline)
+static SMSA_WORKER *smsa_workers = NULL;	// The workers themselves
+static int smsa_workers_stopping = 0;		// Set to have the workers exit
+static int smsa_completion_fd = -1;		// Signals the server that jobs are done
+static pthread_mutex_t smsa_completion_lock = PTHREAD_MUTEX_INITIALIZER;
+static SMSA_JOB *smsa_completed = NULL;		// Jobs done, waiting for the server
+
+//
+// Functional Prototypes
+void *smsa_worker_main( void *arg );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_start_workers
+// Description  : Start the drum workers, pinning each to its own core
+//
+// Inputs       : none (smsa_server_workers is the number to start)
+// Outputs      : the completion event file handle, -1 if failure
+
+int smsa_start_workers( void ) {
+
+	// Local variables
+	cpu_set_t cpus;
+	long ncpu;
+	int i;
+
+	// Check for a sensible number of workers
+	if ( (smsa_server_workers < 1) || (smsa_server_workers > SMSA_DISK_ARRAY_SIZE) ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA bad worker count [%d]", smsa_server_workers );
+		return( -1 );
+	}
+
+	// The server waits for completions on an eventfd
+	if ( (smsa_completion_fd = eventfd(0, EFD_NONBLOCK)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA eventfd() failed : [%s]", strerror(errno) );
+		return( -1 );
+	}
+
+	// Now create the workers
+	ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+	smsa_workers = calloc( smsa_server_workers, sizeof(SMSA_WORKER) );
+	smsa_workers_stopping = 0;
+	for ( i=0; i<smsa_server_workers; i++ ) {
+		smsa_workers[i].index = i;
+		pthread_mutex_init( &smsa_workers[i].lock, NULL );
+		pthread_cond_init( &smsa_workers[i].wakeup, NULL );
+		if ( pthread_create(&smsa_workers[i].thread, NULL, smsa_worker_main, &smsa_workers[i]) != 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA unable to start drum worker %d", i );
+			smsa_server_workers = i;
+			smsa_stop_workers();
+			return( -1 );
+		}
+
+		// Pin it, not fatal if the system won't let us
+		CPU_ZERO( &cpus );
+		CPU_SET( (ncpu > 0) ? i % ncpu : 0, &cpus );
+		if ( pthread_setaffinity_np(smsa_workers[i].thread, sizeof(cpus), &cpus) != 0 ) {
+			logMessage( LOG_WARNING_LEVEL, "SMSA unable to pin drum worker %d", i );
+		}
+	}
+
+	// Return the completion handle
+	logMessage( LOG_INFO_LEVEL, "Started %d drum workers", smsa_server_workers );
+	return( smsa_completion_fd );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_stop_workers
+// Description  : Stop the drum workers, waiting for them to finish their jobs
+//
+// Inputs       : none
+// Outputs      : none
+
+void smsa_stop_workers( void ) {
+
+	// Local variables
+	int i;
+
+	// Wake everyone up and tell them to go
+	for ( i=0; i<smsa_server_workers; i++ ) {
+		pthread_mutex_lock( &smsa_workers[i].lock );
+		smsa_workers_stopping = 1;
+		pthread_cond_signal( &smsa_workers[i].wakeup );
+		pthread_mutex_unlock( &smsa_workers[i].lock );
+	}
+	for ( i=0; i<smsa_server_workers; i++ ) {
+		pthread_join( smsa_workers[i].thread, NULL );
+		pthread_mutex_destroy( &smsa_workers[i].lock );
+		pthread_cond_destroy( &smsa_workers[i].wakeup );
+	}
+
+	// Release the pool
+	free( smsa_workers );
+	smsa_workers = NULL;
+	if ( smsa_completion_fd != -1 ) {
+		close( smsa_completion_fd );
+		smsa_completion_fd = -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_submit_job
+// Description  : Queue a job on the worker that owns its drum
+//
+// Inputs       : job - the job to perform
+// Outputs      : none
+
+void smsa_submit_job( SMSA_JOB *job ) {
+
+	// Local variables
+	SMSA_WORKER *wrk = &smsa_workers[job->drum % smsa_server_workers];
+
+	// Append to the queue, wake the worker
+	job->next = NULL;
+	pthread_mutex_lock( &wrk->lock );
+	if ( wrk->tail != NULL ) {
+		wrk->tail->next = job;
+	} else {
+		wrk->head = job;
+	}
+	wrk->tail = job;
+	pthread_cond_signal( &wrk->wakeup );
+	pthread_mutex_unlock( &wrk->lock );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_completed_jobs
+// Description  : Collect the jobs the workers have finished
+//
+// Inputs       : none
+// Outputs      : the finished jobs (linked through next), NULL if none
+
+SMSA_JOB *smsa_completed_jobs( void ) {
+
+	// Local variables
+	SMSA_JOB *jobs;
+	uint64_t count;
+
+	// Clear the event, then take the whole list
+	if ( (smsa_completion_fd != -1) && (read(smsa_completion_fd, &count, sizeof(count)) == -1) && (errno != EAGAIN) ) {
+		logMessage( LOG_ERROR_LEVEL, "SMSA completion read failed : [%s]", strerror(errno) );
+	}
+	pthread_mutex_lock( &smsa_completion_lock );
+	jobs = smsa_completed;
+	smsa_completed = NULL;
+	pthread_mutex_unlock( &smsa_completion_lock );
+	return( jobs );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_execute_job
+// Description  : Perform a job with the heads of the connection it came in
+//                on.  The read head of each drum belongs to the worker that
+//                owns the drum, so only that one is loaded and saved.
+//
+// Inputs       : job - the job to perform
+// Outputs      : none
+
+void smsa_execute_job( SMSA_JOB *job ) {
+
+	// Local variables
+	uint32_t bid = (job->from == job->drum) ? job->conn->heads[job->drum] : 0;
+	SMSA_SESSION sess = { job->from, bid };
+
+	// Load the heads the connection left, do the operation (passing any
+	// change on to the replicas), save them
+	job->ret = smsa_session_operation( &sess, job->op, job->arg, job->data );
+	if ( job->ret == 0 ) {
+		job->seq = smsa_replicate( job->op, job->arg, job->from, bid, job->data );
+	}
+	if ( sess.drum == job->drum ) {
+		job->conn->heads[sess.drum] = sess.block;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : smsa_worker_main
+// Description  : The drum worker thread, performs jobs until told to stop
+//
+// Inputs       : arg - the worker structure
+// Outputs      : NULL
+
+void *smsa_worker_main( void *arg ) {
+
+	// Local variables
+	SMSA_WORKER *wrk = arg;
+	SMSA_JOB *jobs, *job, *last;
+	uint64_t one = 1;
+
+	while ( 1 ) {
+
+		// Wait for work, take everything queued
+		pthread_mutex_lock( &wrk->lock );
+		while ( (wrk->head == NULL) && !smsa_workers_stopping ) {
+			pthread_cond_wait( &wrk->wakeup, &wrk->lock );
+		}
+		jobs = wrk->head;
+		wrk->head = wrk->tail = NULL;
+		pthread_mutex_unlock( &wrk->lock );
+		if ( jobs == NULL ) {
+			break;
+		}
+
+		// Perform them in order, making their writes durable together
+		// (failing them if that cannot be done)
+		for ( job = jobs; job != NULL; job = job->next ) {
+			smsa_execute_job( job );
+			last = job;
+		}
+		if ( smsa_journal_commit() != 0 ) {
+			for ( job = jobs; job != NULL; job = job->next ) {
+				if ( smsa_replicated_op(job->op) ) {
+					job->ret = -1;
+				}
+			}
+		}
+
+		// Hand the batch back to the server
+		pthread_mutex_lock( &smsa_completion_lock );
+		last->next = smsa_completed;
+		smsa_completed = jobs;
+		pthread_mutex_unlock( &smsa_completion_lock );
+		if ( write(smsa_completion_fd, &one, sizeof(one)) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "SMSA completion write failed : [%s]", strerror(errno) );
+		}
+	}
+
+	// Return, no return value
+	return( NULL );
+}